@@ -46,6 +46,12 @@
 #include <getopt.h>
 #include <signal.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
 
 #include <rte_common.h>
 #include <rte_log.h>
@@ -76,10 +82,10 @@
 
 #include <assert.h>
 #include "pc_eval.h"
+#include "hs.h"
 
 static volatile bool force_quit;
-
-void *rt = NULL;
+static volatile bool dump_counters;     /* SIGUSR1, printed by the master lcore */
 
 #define RTE_LOGTYPE_L2FWD RTE_LOGTYPE_USER1
 
@@ -109,13 +115,140 @@ static unsigned int l2fwd_rx_queue_per_lcore = 1;
 
 #define MAX_RX_QUEUE_PER_LCORE 16
 #define MAX_TX_QUEUE_PER_PORT 16
+#define MAX_RX_QUEUE_PER_PORT 128
+
+struct lcore_rx_queue {
+	uint8_t port_id;
+	uint16_t queue_id;
+};
+
+struct lcore_stats;
+
+/*
+ * Each forwarding lcore has its own TX queues on every port, from
+ * tx_queue_base on, one per action queue
+ */
 struct lcore_queue_conf {
-	unsigned n_rx_port;
-	unsigned rx_port_list[MAX_RX_QUEUE_PER_LCORE];
+	unsigned n_rx_queue;
+	struct lcore_rx_queue rx_queue_list[MAX_RX_QUEUE_PER_LCORE];
+	uint16_t tx_queue_base;
+	unsigned socket_id;     /* replica of the classifier looked up */
+	struct rte_ring *ring;  /* of a classify lcore in pipeline mode */
+	struct lcore_stats *stats;
+	struct rte_eth_dev_tx_buffer *tx_buffer[RTE_MAX_ETHPORTS][MAX_TX_QUEUE_PER_PORT];
 } __rte_cache_aligned;
 struct lcore_queue_conf lcore_queue_conf[RTE_MAX_LCORE];
 
-static struct rte_eth_dev_tx_buffer *tx_buffer[RTE_MAX_ETHPORTS];
+static uint16_t nb_txq = 1;    /* action TX queues of each lcore */
+
+/*
+ * Pipeline mode (-P): the lcores with RX queues parse the headers into
+ * keys and hand bursts of them over rings to the classify lcores, which
+ * transmit. Packets go to a classify lcore by a hash of their key, so the
+ * packets of a flow stay in order.
+ */
+#define MAX_CLS_LCORES 16
+#define PIPE_RING_SIZE 256      /* bursts */
+#define PIPE_POOL_CACHE 32
+#define PIPE_DEQ_BURST 8
+
+struct pipe_burst {
+	unsigned num;
+	struct rte_mbuf *m[MAX_PKT_BURST];
+	struct packet key[MAX_PKT_BURST];
+};
+
+static unsigned nb_cls_lcores;  /* 0 to run to completion */
+static struct rte_ring *cls_rings[MAX_CLS_LCORES];
+static struct rte_mempool *pipe_pool;
+
+/* lcores classifying and transmitting, those with RX queues unless -P */
+static inline bool
+lcore_classifies(unsigned lcore_id)
+{
+	if (nb_cls_lcores)
+		return lcore_queue_conf[lcore_id].ring != NULL;
+	return lcore_queue_conf[lcore_id].n_rx_queue > 0;
+}
+
+static inline bool
+lcore_busy(unsigned lcore_id)
+{
+	return lcore_queue_conf[lcore_id].n_rx_queue > 0 ||
+		lcore_queue_conf[lcore_id].ring != NULL;
+}
+
+/* RSS queues of each port, set by -Q or by the highest one of --config */
+static uint16_t nb_rxq = 1;
+static uint16_t port_nb_rxq[RTE_MAX_ETHPORTS];
+
+/* (port,queue,lcore) entries of --config, or of the default assignment */
+#define MAX_LCORE_PARAMS 1024
+static struct lcore_params {
+	uint8_t port_id;
+	uint16_t queue_id;
+	unsigned lcore_id;
+} lcore_params[MAX_LCORE_PARAMS];
+static unsigned nb_lcore_params;
+
+/*
+ * Rule actions, indexed by the rule priority the classifier returns.
+ * Packets matching no rule are dropped.
+ */
+enum {
+	ACT_FWD = 0,        /* to a port and TX queue */
+	ACT_DROP = 1,
+	ACT_MARK = 2,       /* FDIR id of the mbuf set for later stages, forwarded */
+};
+
+#define ACT_PORT_PAIRED 0xff    /* the port paired with the RX one */
+
+struct rule_action {
+	uint8_t type;
+	uint8_t count;      /* packets and bytes counted */
+	uint8_t port;
+	uint8_t queue;
+	uint32_t mark;
+};
+
+/*
+ * Per-rule counters, an array per lcore written by that lcore only and
+ * summed when printed. Each array starts on its own cache line.
+ */
+struct rule_counter {
+	uint64_t pkts;
+	uint64_t bytes;
+};
+
+/*
+ * What the lcores forward with, replaced as a whole when the rules are
+ * reloaded: the rule numbers of actions and counters are the classifier's.
+ * Classifier and actions are replicated in the memory of each socket with
+ * forwarding lcores, lcores look up the one of their socket.
+ */
+struct fwd_state {
+	void *rt[RTE_MAX_NUMA_NODES];
+	struct rule_action *actions[RTE_MAX_NUMA_NODES];
+	int action_num;
+	int socket;             /* one with replicas, for statistics */
+	struct pc_stats st;     /* of its replica, taken once built */
+	struct rule_counter *counters[RTE_MAX_LCORE];
+};
+
+static struct fwd_state *fwd_state;
+static bool fwd_sockets[RTE_MAX_NUMA_NODES];    /* sockets of the replicas */
+
+/*
+ * Quiescent state based reclamation. The lcores load fwd_state once a
+ * loop and, before loading it again, publish the fwd_epoch they saw, so
+ * after fwd_epoch is bumped past a swap the old state is unused once every
+ * lcore published the new epoch.
+ */
+static uint64_t fwd_epoch;
+
+static struct lcore_epoch {
+	uint64_t epoch;
+} __rte_cache_aligned lcore_epoch[RTE_MAX_LCORE];
 
 static const struct rte_eth_conf port_conf = {
 	.rxmode = {
@@ -141,6 +274,25 @@ struct l2fwd_port_statistics {
 } __rte_cache_aligned;
 struct l2fwd_port_statistics port_statistics[RTE_MAX_ETHPORTS];
 
+/*
+ * Per-lcore statistics, written by that lcore only. The master sums them
+ * into port_statistics each timer period and only ever reads them.
+ * Bucket i of the histogram counts the packets of the bursts classified in
+ * [2^i, 2^(i+1)) cycles per packet, the last one everything slower.
+ */
+#define CPP_HIST_NUM 16
+
+struct lcore_stats {
+	uint64_t pkts;
+	uint64_t bursts;
+	uint64_t cycles;        /* in the classifier */
+	uint64_t miss;          /* matching no rule */
+	uint64_t match_sum;     /* digest of the keys with their matches */
+	uint64_t cpp_hist[CPP_HIST_NUM];
+	struct l2fwd_port_statistics port[RTE_MAX_ETHPORTS];
+} __rte_cache_aligned;
+static struct lcore_stats lcore_stats[RTE_MAX_LCORE];
+
 /* A tsc-based timer responsible for triggering statistics printout */
 #define TIMER_MILLISECOND 2000000ULL /* around 1ms at 2 Ghz */
 #define MAX_TIMER_PERIOD 86400 /* 1 day max */
@@ -160,15 +312,98 @@ static int64_t timer_period = 10 * TIMER_MILLISECOND * 1000; /* default period i
 
 struct platform_config {
     char *s_rule_file;
+    char *action_file;
     int pc_algo;
+    int watch;          /* rebuild when the rule or action file changes */
 };
 
-/* Print out statistics on packets dropped */
+/* the lcore is done with the state it loaded before, returns the current */
+static inline struct fwd_state *
+fwd_quiesce(unsigned lcore_id)
+{
+	uint64_t e = __atomic_load_n(&fwd_epoch, __ATOMIC_ACQUIRE);
+
+	__atomic_store_n(&lcore_epoch[lcore_id].epoch, e, __ATOMIC_RELEASE);
+	return __atomic_load_n(&fwd_state, __ATOMIC_ACQUIRE);
+}
+
+/* sum of the counters of every lcore, they go on while being read */
+static void
+print_rule_counters(const struct fwd_state *st)
+{
+	uint64_t pkts, bytes;
+	unsigned lcore_id;
+	int i;
+
+	printf("\nRule counters ======================================");
+	for (i = 0; i < st->action_num; i++) {
+		if (!st->actions[st->socket][i].count)
+			continue;
+		pkts = bytes = 0;
+		RTE_LCORE_FOREACH(lcore_id) {
+			if (st->counters[lcore_id] == NULL)
+				continue;
+			pkts += st->counters[lcore_id][i].pkts;
+			bytes += st->counters[lcore_id][i].bytes;
+		}
+		printf("\nRule %d: %20"PRIu64" packets %20"PRIu64" bytes",
+			   i + 1, pkts, bytes);
+	}
+	printf("\n====================================================\n");
+}
+
+/* cost of the classifier on each forwarding lcore */
+static void
+print_lcore_stats(void)
+{
+	const struct lcore_stats *ls;
+	unsigned lcore_id;
+	uint64_t pkts, match_sum = 0;
+	double ns = 1e9 / rte_get_tsc_hz();
+	int i;
+
+	printf("\nLcore statistics ===================================");
+	RTE_LCORE_FOREACH(lcore_id) {
+		if (!lcore_classifies(lcore_id))
+			continue;
+		ls = &lcore_stats[lcore_id];
+		pkts = ls->pkts;
+		printf("\nStatistics for lcore %u -----------------------------"
+			   "\nPackets classified: %18"PRIu64
+			   "\nBursts: %30"PRIu64
+			   "\nPackets matched: %21"PRIu64
+			   "\nPackets missed: %22"PRIu64
+			   "\nMatch digest: %24"PRIx64,
+			   lcore_id, pkts, ls->bursts, pkts - ls->miss, ls->miss,
+			   ls->match_sum);
+		match_sum += ls->match_sum;
+		if (pkts == 0)
+			continue;
+		printf("\nPackets per burst: %19.1f"
+			   "\nCycles per packet: %19.1f (%.1f ns)",
+			   (double)pkts / ls->bursts,
+			   (double)ls->cycles / pkts, ls->cycles * ns / pkts);
+		for (i = 0; i < CPP_HIST_NUM; i++) {
+			if (ls->cpp_hist[i] == 0)
+				continue;
+			printf("\n  %s%6u cycles: %16"PRIu64" (%5.2f%%)",
+				   i == CPP_HIST_NUM - 1 ? ">=" : " <",
+				   1u << (i == CPP_HIST_NUM - 1 ? i : i + 1),
+				   ls->cpp_hist[i], 100.0 * ls->cpp_hist[i] / pkts);
+		}
+	}
+	printf("\nMatch digest of all lcores: %10"PRIx64, match_sum);
+}
+
+/* Print out statistics on packets dropped and on the classifier */
 static void
 print_stats(void)
 {
 	uint64_t total_packets_dropped, total_packets_tx, total_packets_rx;
-	unsigned portid;
+	const struct l2fwd_port_statistics *ps;
+	/* the master, calling this, keeps it from being freed */
+	struct fwd_state *fs = __atomic_load_n(&fwd_state, __ATOMIC_ACQUIRE);
+	unsigned portid, lcore_id;
 
 	total_packets_dropped = 0;
 	total_packets_tx = 0;
@@ -186,6 +421,15 @@ print_stats(void)
 		/* skip disabled ports */
 		if ((l2fwd_enabled_port_mask & (1 << portid)) == 0)
 			continue;
+
+		memset(&port_statistics[portid], 0, sizeof(port_statistics[portid]));
+		RTE_LCORE_FOREACH(lcore_id) {
+			ps = &lcore_stats[lcore_id].port[portid];
+			port_statistics[portid].tx += ps->tx;
+			port_statistics[portid].rx += ps->rx;
+			port_statistics[portid].dropped += ps->dropped;
+		}
+
 		printf("\nStatistics for port %u ------------------------------"
 			   "\nPackets sent: %24"PRIu64
 			   "\nPackets received: %20"PRIu64
@@ -206,7 +450,11 @@ print_stats(void)
 		   total_packets_tx,
 		   total_packets_rx,
 		   total_packets_dropped);
-	printf("\n====================================================\n");
+	print_lcore_stats();
+	printf("\nClassifier statistics ==============================\n");
+	/* a walk of the classifier would stall the RX of the master */
+	print_pc_stats(&fs->st);
+	printf("====================================================\n");
 }
 
 /*
@@ -237,9 +485,10 @@ prepare_one_packet(struct rte_mbuf **pkts_in, struct packet *pkts, int i)
 {
     pkts[i].val[0].u32 = rte_be_to_cpu_32(*(rte_pktmbuf_mtod_offset(pkts_in[i], uint32_t *, OFF_ETHHEAD + OFF_IPV42SRCADD)));
     pkts[i].val[1].u32 = rte_be_to_cpu_32(*(rte_pktmbuf_mtod_offset(pkts_in[i], uint32_t *, OFF_ETHHEAD + OFF_IPV42DSTADD)));
-    pkts[i].val[2].u16 = rte_be_to_cpu_16(*(rte_pktmbuf_mtod_offset(pkts_in[i], uint16_t *, OFF_ETHHEAD + sizeof(struct ipv4_hdr) + OFF_TCP2SRCPT)));
-    pkts[i].val[3].u16 = rte_be_to_cpu_16(*(rte_pktmbuf_mtod_offset(pkts_in[i], uint16_t *, OFF_ETHHEAD + sizeof(struct ipv4_hdr) + OFF_TCP2DSTPT)));
-    pkts[i].val[4].u8 = *(rte_pktmbuf_mtod_offset(pkts_in[i], uint8_t *, OFF_ETHHEAD + OFF_IPV42PROTO));
+    /* whole u32s, the classifiers compare the ports and protocol by u32 */
+    pkts[i].val[2].u32 = rte_be_to_cpu_16(*(rte_pktmbuf_mtod_offset(pkts_in[i], uint16_t *, OFF_ETHHEAD + sizeof(struct ipv4_hdr) + OFF_TCP2SRCPT)));
+    pkts[i].val[3].u32 = rte_be_to_cpu_16(*(rte_pktmbuf_mtod_offset(pkts_in[i], uint16_t *, OFF_ETHHEAD + sizeof(struct ipv4_hdr) + OFF_TCP2DSTPT)));
+    pkts[i].val[4].u32 = *(rte_pktmbuf_mtod_offset(pkts_in[i], uint8_t *, OFF_ETHHEAD + OFF_IPV42PROTO));
     pkts[i].match = rte_be_to_cpu_16(*(rte_pktmbuf_mtod_offset(pkts_in[i], uint16_t *, OFF_ETHHEAD + OFF_IPV42PKTID)));
 }
 
@@ -265,18 +514,43 @@ prepare_packets(struct rte_mbuf **pkts_in, struct packet *pkts, int nb_rx)
 }
 
 static inline void
-send_one_packet(struct rte_mbuf *m, int res, uint8_t dst_port)
+send_one_packet(struct rte_mbuf *m, int res, uint8_t dst_port,
+		struct lcore_queue_conf *qconf, const struct fwd_state *fs)
 {
-    if (likely(res >= 0)) {
-	    rte_eth_tx_buffer(dst_port, 0, tx_buffer[dst_port], m);
-    }
-    else {
-        rte_pktmbuf_free(m);
-    }
+	const struct rule_action *act;
+	uint8_t port;
+
+	if (unlikely(res < 0)) {
+		qconf->stats->miss++;
+		rte_pktmbuf_free(m);
+		return;
+	}
+
+	act = &fs->actions[qconf->socket_id][res];
+	if (act->count) {
+		fs->counters[rte_lcore_id()][res].pkts++;
+		fs->counters[rte_lcore_id()][res].bytes += rte_pktmbuf_pkt_len(m);
+	}
+
+	switch (act->type) {
+	case ACT_DROP:
+		rte_pktmbuf_free(m);
+		return;
+	case ACT_MARK:
+		m->hash.fdir.hi = act->mark;
+		m->ol_flags |= PKT_RX_FDIR | PKT_RX_FDIR_ID;
+		break;
+	}
+
+	port = act->port == ACT_PORT_PAIRED ? dst_port : act->port;
+	qconf->stats->port[port].tx += rte_eth_tx_buffer(port,
+			qconf->tx_queue_base + act->queue,
+			qconf->tx_buffer[port][act->queue], m);
 }
 
 static inline void
-send_packets(struct rte_mbuf **m, int *match_res, int num, uint8_t tx_portid)
+send_packets(struct rte_mbuf **m, int *match_res, int num, uint8_t tx_portid,
+		struct lcore_queue_conf *qconf, const struct fwd_state *fs)
 {
 	int i;
 
@@ -289,12 +563,279 @@ send_packets(struct rte_mbuf **m, int *match_res, int num, uint8_t tx_portid)
 	for (i = 0; i < (num - PREFETCH_OFFSET); i++) {
 		rte_prefetch0(rte_pktmbuf_mtod(m[
 				i + PREFETCH_OFFSET], void *));
-        send_one_packet(m[i], match_res[i], tx_portid);
+        send_one_packet(m[i], match_res[i], tx_portid, qconf, fs);
 	}
 
 	/* Process left packets */
 	for (; i < num; i++)
-		send_one_packet(m[i], match_res[i], tx_portid);
+		send_one_packet(m[i], match_res[i], tx_portid, qconf, fs);
+}
+
+/* histogram bucket of a cost of cpp cycles per packet */
+static inline int
+cpp_bucket(uint64_t cpp)
+{
+	int b = cpp ? 63 - __builtin_clzll(cpp) : 0;
+
+	return b < CPP_HIST_NUM ? b : CPP_HIST_NUM - 1;
+}
+
+/* sends what the TX buffers of the lcore hold */
+static void
+flush_tx_buffers(struct lcore_queue_conf *qconf)
+{
+	unsigned portid;
+	uint16_t q;
+
+	for (portid = 0; portid < RTE_MAX_ETHPORTS; portid++) {
+		if ((l2fwd_enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		for (q = 0; q < nb_txq; q++)
+			qconf->stats->port[portid].tx += rte_eth_tx_buffer_flush(portid,
+					qconf->tx_queue_base + q, qconf->tx_buffer[portid][q]);
+	}
+}
+
+/* the master prints the statistics once timer_tsc reaches timer_period */
+static inline void
+master_timer(uint64_t diff_tsc, uint64_t *timer_tsc)
+{
+	if (timer_period <= 0)
+		return;
+
+	*timer_tsc += diff_tsc;
+	if (unlikely(*timer_tsc >= (uint64_t) timer_period)) {
+		print_stats();
+		*timer_tsc = 0;
+	}
+}
+
+/*
+ * Digest of a key with its match, summed over the packets so that it does
+ * not depend on their order or lcore. The same trace forwarded without
+ * drops gives the same total to run to completion and to pipeline mode.
+ */
+static inline uint64_t
+match_digest(const struct packet *key, int res)
+{
+	uint64_t h;
+
+	h = ((uint64_t)key->val[DIM_SIP].u32 << 32 | key->val[DIM_DIP].u32) ^
+		((uint64_t)key->val[DIM_SPORT].u16 << 40 |
+		 (uint64_t)key->val[DIM_DPORT].u16 << 24 |
+		 (uint64_t)key->val[DIM_PROTO].u8 << 16) ^
+		(uint32_t)(res + 1);
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/* classifies a burst of keys, timed into the lcore statistics */
+static inline void
+classify_burst(int algo_id, void * const *rt, const struct packet *pkts,
+		int num, int *match_res, struct lcore_stats *ls)
+{
+	uint64_t cycles;
+	int j;
+
+	cycles = rte_rdtsc();
+	if (algo_id == ALGO_HS) {
+		hs_classify_burst(pkts, num, match_res, rt);
+	} else {
+		for (j = 0; j < num; j++)
+			match_res[j] = algrthms[algo_id].classify(&pkts[j], rt);
+	}
+	cycles = rte_rdtsc() - cycles;
+
+	ls->pkts += num;
+	ls->bursts++;
+	ls->cycles += cycles;
+	ls->cpp_hist[cpp_bucket(cycles / num)] += num;
+
+	for (j = 0; j < num; j++)
+		ls->match_sum += match_digest(&pkts[j], match_res[j]);
+}
+
+/* classify lcore of the packet, the same for every packet of a flow */
+static inline unsigned
+key_lcore(const struct packet *key)
+{
+	uint32_t h;
+
+	h = key->val[DIM_SIP].u32 ^ key->val[DIM_DIP].u32 ^
+		((uint32_t)key->val[DIM_SPORT].u16 << 16 | key->val[DIM_DPORT].u16) ^
+		key->val[DIM_PROTO].u8;
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+
+	return h % nb_cls_lcores;
+}
+
+/* hands a burst to a classify lcore, dropped if its ring is full */
+static inline void
+pipe_enqueue(unsigned c, struct pipe_burst *b, struct lcore_stats *ls)
+{
+	unsigned i;
+
+	if (likely(rte_ring_enqueue(cls_rings[c], b) == 0))
+		return;
+
+	for (i = 0; i < b->num; i++) {
+		ls->port[b->m[i]->port].dropped++;
+		rte_pktmbuf_free(b->m[i]);
+	}
+	rte_mempool_put(pipe_pool, b);
+}
+
+/* pipeline RX stage, parses the packets and spreads them by flow */
+static void
+pipe_rx_loop(void)
+{
+	struct rte_mbuf *pkts_burst[MAX_PKT_BURST];
+	struct packet keys[MAX_PKT_BURST];
+	struct pipe_burst *pending[MAX_CLS_LCORES] = { NULL };
+	struct pipe_burst *b;
+	struct lcore_queue_conf *qconf;
+	struct lcore_stats *ls;
+	struct fwd_state *fs;
+	unsigned lcore_id, portid, queueid, c;
+	int i, j, nb_rx;
+	uint64_t prev_tsc, cur_tsc, diff_tsc, timer_tsc = 0;
+	const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S *
+			BURST_TX_DRAIN_US;
+	bool master;
+
+	lcore_id = rte_lcore_id();
+	qconf = &lcore_queue_conf[lcore_id];
+	ls = qconf->stats;
+	master = lcore_id == rte_get_master_lcore();
+
+	RTE_LOG(INFO, L2FWD, "entering RX stage on lcore %u\n", lcore_id);
+
+	prev_tsc = rte_rdtsc();
+	while (!force_quit) {
+		/* only the master uses the state, for the statistics */
+		if (unlikely(master)) {
+			fs = fwd_quiesce(lcore_id);
+			if (unlikely(dump_counters)) {
+				dump_counters = false;
+				print_rule_counters(fs);
+			}
+		}
+
+		cur_tsc = rte_rdtsc();
+
+		/*
+		 * Partial bursts drain
+		 */
+		diff_tsc = cur_tsc - prev_tsc;
+		if (unlikely(diff_tsc > drain_tsc)) {
+			for (c = 0; c < nb_cls_lcores; c++) {
+				if (pending[c] != NULL) {
+					pipe_enqueue(c, pending[c], ls);
+					pending[c] = NULL;
+				}
+			}
+			if (master)
+				master_timer(diff_tsc, &timer_tsc);
+			prev_tsc = cur_tsc;
+		}
+
+		for (i = 0; i < qconf->n_rx_queue; i++) {
+			portid = qconf->rx_queue_list[i].port_id;
+			queueid = qconf->rx_queue_list[i].queue_id;
+			nb_rx = rte_eth_rx_burst((uint8_t) portid, queueid,
+						 pkts_burst, MAX_PKT_BURST);
+			if (nb_rx == 0)
+				continue;
+			ls->port[portid].rx += nb_rx;
+
+			prepare_packets(pkts_burst, keys, nb_rx);
+
+			for (j = 0; j < nb_rx; j++) {
+				c = key_lcore(&keys[j]);
+				if ((b = pending[c]) == NULL) {
+					if (unlikely(rte_mempool_get(pipe_pool, (void **)&b) != 0)) {
+						ls->port[portid].dropped++;
+						rte_pktmbuf_free(pkts_burst[j]);
+						continue;
+					}
+					b->num = 0;
+					pending[c] = b;
+				}
+				b->m[b->num] = pkts_burst[j];
+				b->key[b->num] = keys[j];
+				if (++b->num == MAX_PKT_BURST) {
+					pipe_enqueue(c, b, ls);
+					pending[c] = NULL;
+				}
+			}
+		}
+	}
+}
+
+/* pipeline classify stage, classifies the bursts of its ring and sends */
+static void
+pipe_cls_loop(int algo_id)
+{
+	struct pipe_burst *bursts[PIPE_DEQ_BURST];
+	int match_res[MAX_PKT_BURST];
+	struct pipe_burst *b;
+	struct lcore_queue_conf *qconf;
+	struct lcore_stats *ls;
+	struct fwd_state *fs;
+	unsigned lcore_id, socket_id, n, i, j;
+	uint64_t prev_tsc, cur_tsc, diff_tsc, timer_tsc = 0;
+	const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S *
+			BURST_TX_DRAIN_US;
+	bool master;
+
+	lcore_id = rte_lcore_id();
+	qconf = &lcore_queue_conf[lcore_id];
+	ls = qconf->stats;
+	socket_id = qconf->socket_id;
+	master = lcore_id == rte_get_master_lcore();
+
+	RTE_LOG(INFO, L2FWD, "entering classify stage on lcore %u\n", lcore_id);
+
+	prev_tsc = rte_rdtsc();
+	while (!force_quit) {
+		fs = fwd_quiesce(lcore_id);
+
+		if (unlikely(dump_counters) && master) {
+			dump_counters = false;
+			print_rule_counters(fs);
+		}
+
+		cur_tsc = rte_rdtsc();
+
+		/*
+		 * TX burst queue drain
+		 */
+		diff_tsc = cur_tsc - prev_tsc;
+		if (unlikely(diff_tsc > drain_tsc)) {
+			flush_tx_buffers(qconf);
+			if (master)
+				master_timer(diff_tsc, &timer_tsc);
+			prev_tsc = cur_tsc;
+		}
+
+		n = rte_ring_dequeue_burst(qconf->ring, (void **)bursts,
+				PIPE_DEQ_BURST, NULL);
+		for (i = 0; i < n; i++) {
+			b = bursts[i];
+			classify_burst(algo_id, &fs->rt[socket_id], b->key, b->num,
+					match_res, ls);
+			for (j = 0; j < b->num; j++)
+				send_one_packet(b->m[j], match_res[j],
+						l2fwd_dst_ports[b->m[j]->port], qconf, fs);
+		}
+		if (n > 0)
+			rte_mempool_put_bulk(pipe_pool, (void * const *)bursts, n);
+	}
 }
 
 /* HyperSplit main processing loop */
@@ -305,56 +846,108 @@ fwd_main_loop(int algo_id)
 	struct rte_mbuf *m;
 	int sent;
 	unsigned lcore_id;
-	int i, j, nb_rx;
-    unsigned portid;
+	int i, nb_rx;
+    unsigned portid, queueid;
 	struct lcore_queue_conf *qconf;
 	struct rte_eth_dev_tx_buffer *buffer;
 
     int id;
     unsigned dst_port;
+	struct lcore_stats *ls;
+	struct fwd_state *fs;
+	unsigned socket_id;
+	uint64_t prev_tsc = 0, cur_tsc, diff_tsc, timer_tsc = 0;
+	const uint64_t drain_tsc = (rte_get_tsc_hz() + US_PER_S - 1) / US_PER_S *
+			BURST_TX_DRAIN_US;
 
 	lcore_id = rte_lcore_id();
 	qconf = &lcore_queue_conf[lcore_id];
+	bool master = lcore_id == rte_get_master_lcore();
+
+	if (nb_cls_lcores && qconf->n_rx_queue > 0) {
+		pipe_rx_loop();
+		return;
+	}
+	if (qconf->ring != NULL) {
+		pipe_cls_loop(algo_id);
+		return;
+	}
 
-	if (qconf->n_rx_port == 0) {
+	if (qconf->n_rx_queue == 0) {
 		RTE_LOG(INFO, L2FWD, "lcore %u has nothing to do\n", lcore_id);
+		/* the master still prints the counters and statistics */
+		prev_tsc = rte_rdtsc();
+		while (master && !force_quit) {
+			fs = fwd_quiesce(lcore_id);
+			if (unlikely(dump_counters)) {
+				dump_counters = false;
+				print_rule_counters(fs);
+			}
+			rte_delay_ms(10);
+			cur_tsc = rte_rdtsc();
+			master_timer(cur_tsc - prev_tsc, &timer_tsc);
+			prev_tsc = cur_tsc;
+		}
 		return;
 	}
+	ls = qconf->stats;
+	socket_id = qconf->socket_id;
 
 	RTE_LOG(INFO, L2FWD, "entering main loop on lcore %u\n", lcore_id);
 
-	for (i = 0; i < qconf->n_rx_port; i++) {
-		portid = qconf->rx_port_list[i];
-		RTE_LOG(INFO, L2FWD, " -- lcoreid=%u portid=%u\n", lcore_id,
-			portid);
+	for (i = 0; i < qconf->n_rx_queue; i++) {
+		portid = qconf->rx_queue_list[i].port_id;
+		queueid = qconf->rx_queue_list[i].queue_id;
+		RTE_LOG(INFO, L2FWD, " -- lcoreid=%u portid=%u rxqueueid=%u\n",
+			lcore_id, portid, queueid);
 	}
 
     struct packet *pkts = calloc(MAX_PKT_BURST, sizeof *pkts);
     /* int match_ids[MAX_PKT_BURST]; */
     int match_res[MAX_PKT_BURST];
 
+    prev_tsc = rte_rdtsc();
     while (!force_quit) {
+		fs = fwd_quiesce(lcore_id);
+
+		if (unlikely(dump_counters) && master) {
+			dump_counters = false;
+			print_rule_counters(fs);
+		}
+
+		cur_tsc = rte_rdtsc();
+
+		/*
+		 * TX burst queue drain
+		 */
+		diff_tsc = cur_tsc - prev_tsc;
+		if (unlikely(diff_tsc > drain_tsc)) {
+			flush_tx_buffers(qconf);
+			if (master)
+				master_timer(diff_tsc, &timer_tsc);
+			prev_tsc = cur_tsc;
+		}
+
 		/*
 		 * Read packet from RX queues
 		 */
-		for (i = 0; i < qconf->n_rx_port; i++) {
+		for (i = 0; i < qconf->n_rx_queue; i++) {
 
-			portid = qconf->rx_port_list[i];
-			nb_rx = rte_eth_rx_burst((uint8_t) portid, 0,
+			portid = qconf->rx_queue_list[i].port_id;
+			queueid = qconf->rx_queue_list[i].queue_id;
+			nb_rx = rte_eth_rx_burst((uint8_t) portid, queueid,
 						 pkts_burst, MAX_PKT_BURST);
             dst_port = l2fwd_dst_ports[portid];
 
             if (nb_rx > 0) {
+                ls->port[portid].rx += nb_rx;
 
                 prepare_packets(pkts_burst, pkts, nb_rx);
 
-                for (j = 0; j < nb_rx; j++) {
-                    match_res[j] = algrthms[algo_id].classify(&pkts[j], &rt);
-                    //print_packet(pkts[j]);
-                    //printf("match %d\n", match_res[j]);
-                }
+                classify_burst(algo_id, &fs->rt[socket_id], pkts, nb_rx,
+                        match_res, ls);
 
-                send_packets(pkts_burst, match_res, nb_rx, dst_port);
+                send_packets(pkts_burst, match_res, nb_rx, dst_port, qconf, fs);
             }
 		}
 	}
@@ -374,8 +967,21 @@ l2fwd_usage(const char *prgname)
 {
 	printf("%s [EAL options] -- -p PORTMASK [-q NQ]\n"
 	       "  -p PORTMASK: hexadecimal bitmask of ports to configure\n"
-	       "  -q NQ: number of queue (=ports) per lcore (default is 1)\n"
-		   "  -T PERIOD: statistics will be refreshed each PERIOD seconds (0 to disable, 10 default, 86400 maximum)\n",
+	       "  -q NQ: number of RX queues per lcore (default is 1)\n"
+	       "  -Q NQ: number of RSS queues per port (default is 1)\n"
+	       "  -t NQ: number of TX queues per lcore and port, the QUEUE of fwd\n"
+	       "      actions (default is 1)\n"
+	       "  --config (port,queue,lcore)[,(port,queue,lcore)]: RX queues of\n"
+	       "      the lcores, instead of -q queues each in order\n"
+		   "  -T PERIOD: statistics will be refreshed each PERIOD seconds (0 to disable, 10 default, 86400 maximum)\n"
+		   "  -F: HyperSplit looks up in a compact copy of the tree, a burst at a time\n"
+		   "  -K LEVELS: top levels of the compact tree laid out implicitly, implies -F\n"
+		   "  -A FILE: rule actions, a line per rule: RULE fwd PORT [QUEUE] | drop |\n"
+		   "      mark ID, then optionally count; other rules go to the paired port,\n"
+		   "      SIGUSR1 prints the counters\n"
+		   "  -W: rebuild when the rule or action file changes, without stopping\n"
+		   "  -P NC: pipeline, the lcores with RX queues parse the packets and NC\n"
+		   "      other lcores classify and send them\n",
 	       prgname);
 }
 
@@ -414,6 +1020,92 @@ l2fwd_parse_nqueue(const char *q_arg)
 	return n;
 }
 
+static unsigned int
+l2fwd_parse_ntxq(const char *q_arg)
+{
+	char *end = NULL;
+	unsigned long n;
+
+	n = strtoul(q_arg, &end, 10);
+	if ((q_arg[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return 0;
+	if (n == 0 || n > MAX_TX_QUEUE_PER_PORT)
+		return 0;
+
+	return n;
+}
+
+static unsigned int
+l2fwd_parse_nrxq(const char *q_arg)
+{
+	char *end = NULL;
+	unsigned long n;
+
+	n = strtoul(q_arg, &end, 10);
+	if ((q_arg[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return 0;
+	if (n == 0 || n > MAX_RX_QUEUE_PER_PORT)
+		return 0;
+
+	return n;
+}
+
+static unsigned int
+l2fwd_parse_ncls(const char *q_arg)
+{
+	char *end = NULL;
+	unsigned long n;
+
+	n = strtoul(q_arg, &end, 10);
+	if ((q_arg[0] == '\0') || (end == NULL) || (*end != '\0'))
+		return 0;
+	if (n == 0 || n > MAX_CLS_LCORES)
+		return 0;
+
+	return n;
+}
+
+/* --config "(port,queue,lcore)[,(port,queue,lcore)]" */
+static int
+l2fwd_parse_config(const char *q_arg)
+{
+	char s[64], c;
+	const char *p, *p0 = q_arg;
+	unsigned long port, queue, lcore;
+	unsigned size;
+
+	nb_lcore_params = 0;
+
+	while ((p = strchr(p0, '(')) != NULL) {
+		++p;
+		if ((p0 = strchr(p, ')')) == NULL)
+			return -1;
+
+		size = p0 - p;
+		if (size >= sizeof(s))
+			return -1;
+		snprintf(s, sizeof(s), "%.*s", size, p);
+
+		if (sscanf(s, "%lu,%lu,%lu%c", &port, &queue, &lcore, &c) != 3)
+			return -1;
+		if (port >= RTE_MAX_ETHPORTS || queue >= MAX_RX_QUEUE_PER_PORT ||
+		    lcore >= RTE_MAX_LCORE)
+			return -1;
+		if (nb_lcore_params >= MAX_LCORE_PARAMS) {
+			printf("exceeded max number of lcore params: %u\n",
+				nb_lcore_params);
+			return -1;
+		}
+
+		lcore_params[nb_lcore_params].port_id = port;
+		lcore_params[nb_lcore_params].queue_id = queue;
+		lcore_params[nb_lcore_params].lcore_id = lcore;
+		nb_lcore_params++;
+	}
+
+	return nb_lcore_params > 0 ? 0 : -1;
+}
+
 static int
 l2fwd_parse_timer_period(const char *q_arg)
 {
@@ -439,12 +1131,13 @@ l2fwd_parse_args(struct platform_config *p_plat_cfg, int argc, char **argv)
 	int option_index;
 	char *prgname = argv[0];
 	static struct option lgopts[] = {
+		{"config", 1, 0, 'c'},
 		{NULL, 0, 0, 0}
 	};
 
 	argvopt = argv;
 
-	while ((opt = getopt_long(argc, argvopt, "p:q:T:r:a:",
+	while ((opt = getopt_long(argc, argvopt, "p:q:T:r:a:FK:A:Q:t:c:WP:",
 				  lgopts, &option_index)) != EOF) {
 
 	switch (opt) {
@@ -468,11 +1161,40 @@ l2fwd_parse_args(struct platform_config *p_plat_cfg, int argc, char **argv)
 			}
 			break;
 
-		/* timer period */
-		case 'T':
-			timer_period = l2fwd_parse_timer_period(optarg) * 1000 * TIMER_MILLISECOND;
-			if (timer_period < 0) {
-				printf("invalid timer period\n");
+		/* RSS queues of each port */
+		case 'Q':
+			nb_rxq = l2fwd_parse_nrxq(optarg);
+			if (nb_rxq == 0) {
+				printf("invalid queue number\n");
+				l2fwd_usage(prgname);
+				return -1;
+			}
+			break;
+
+		/* action TX queues of each lcore */
+		case 't':
+			nb_txq = l2fwd_parse_ntxq(optarg);
+			if (nb_txq == 0) {
+				printf("invalid TX queue number\n");
+				l2fwd_usage(prgname);
+				return -1;
+			}
+			break;
+
+		/* queue to lcore assignment */
+		case 'c':
+			if (l2fwd_parse_config(optarg) < 0) {
+				printf("invalid config\n");
+				l2fwd_usage(prgname);
+				return -1;
+			}
+			break;
+
+		/* timer period */
+		case 'T':
+			timer_period = l2fwd_parse_timer_period(optarg) * 1000 * TIMER_MILLISECOND;
+			if (timer_period < 0) {
+				printf("invalid timer period\n");
 				l2fwd_usage(prgname);
 				return -1;
 			}
@@ -487,6 +1209,34 @@ l2fwd_parse_args(struct platform_config *p_plat_cfg, int argc, char **argv)
             assert(p_plat_cfg->pc_algo > ALGO_INV && p_plat_cfg->pc_algo < ALGO_NUM);
             break;
 
+        case 'F':
+            hs_cfg.flat = 1;
+            break;
+
+        case 'K':
+            hs_cfg.flat_top = atoi(optarg);
+            assert(hs_cfg.flat_top > 0 && hs_cfg.flat_top <= HS_TOP_MAX);
+            hs_cfg.flat = 1;
+            break;
+
+        case 'A':
+            p_plat_cfg->action_file = optarg;
+            break;
+
+        case 'W':
+            p_plat_cfg->watch = 1;
+            break;
+
+		/* pipeline mode, classify lcores */
+		case 'P':
+			nb_cls_lcores = l2fwd_parse_ncls(optarg);
+			if (nb_cls_lcores == 0) {
+				printf("invalid classify lcore number\n");
+				l2fwd_usage(prgname);
+				return -1;
+			}
+			break;
+
 		/* long options */
 		case 0:
 			l2fwd_usage(prgname);
@@ -572,7 +1322,553 @@ signal_handler(int signum)
 		printf("\n\nSignal %d received, preparing to exit...\n",
 				signum);
 		force_quit = true;
+	} else if (signum == SIGUSR1) {
+		dump_counters = true;
+	}
+}
+
+/* one past the highest rule priority, the size of the action table */
+static int
+rule_pri_num(const struct rule_set *rs)
+{
+	int i, pri, num = 0;
+
+	for (i = 0; i < rs->num; i++) {
+		pri = rs->r_rules != NULL ? rs->r_rules[i].pri : rs->p_rules[i].pri;
+		if (pri >= num)
+			num = pri + 1;
 	}
+
+	return num;
+}
+
+/* a decimal number up to max */
+static int
+parse_num(const char *arg, unsigned long max, unsigned long *val)
+{
+	char *end = NULL;
+
+	*val = strtoul(arg, &end, 10);
+	if (arg[0] == '\0' || end == NULL || *end != '\0' || *val > max)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * The action table, every rule forwarding to the paired port unless the
+ * action file says otherwise. Rules are numbered from 1 as in the rule file.
+ */
+static int
+load_actions(struct rule_action **tbl, const char *file, int num)
+{
+	char line[256], type[16], arg[3][16];
+	struct rule_action act;
+	unsigned long port = 0, val = 0;
+	int i, n, pri, err, lineno = 0;
+	FILE *fp;
+
+	struct rule_action *actions;
+
+	actions = *tbl = rte_zmalloc("actions", num * sizeof(*actions),
+			RTE_CACHE_LINE_SIZE);
+	if (actions == NULL)
+		return -1;
+	for (i = 0; i < num; i++)
+		actions[i].port = ACT_PORT_PAIRED;
+
+	if (file == NULL)
+		return 0;
+
+	if ((fp = fopen(file, "r")) == NULL) {
+		fprintf(stderr, "Cannot open file %s\n", file);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		n = sscanf(line, "%d %15s %15s %15s %15s", &pri, type,
+				arg[0], arg[1], arg[2]);
+		if (n <= 0 || line[0] == '#')
+			continue;
+
+		memset(&act, 0, sizeof(act));
+		act.port = ACT_PORT_PAIRED;
+		n -= 2;
+		if (n > 0 && strcmp(arg[n - 1], "count") == 0) {
+			act.count = 1;
+			n--;
+		}
+
+		err = n < 0 || pri < 1 || pri > num;
+		if (err) {
+			/* reported below */
+		} else if (strcmp(type, "fwd") == 0) {
+			act.type = ACT_FWD;
+			err = n < 1 || n > 2 ||
+				parse_num(arg[0], RTE_MAX_ETHPORTS - 1, &port) ||
+				(l2fwd_enabled_port_mask & (1 << port)) == 0;
+			val = 0;
+			if (!err && n == 2)
+				err = parse_num(arg[1], nb_txq - 1, &val);
+			act.port = port;
+			act.queue = val;
+		} else if (strcmp(type, "drop") == 0) {
+			act.type = ACT_DROP;
+			err = n != 0;
+		} else if (strcmp(type, "mark") == 0) {
+			act.type = ACT_MARK;
+			err = n != 1 || parse_num(arg[0], UINT32_MAX, &val);
+			act.mark = val;
+		} else {
+			err = 1;
+		}
+
+		if (err) {
+			fprintf(stderr, "Illegal action at line %d of %s\n", lineno, file);
+			fclose(fp);
+			return -1;
+		}
+		actions[pri - 1] = act;
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static void
+free_state(int algo_id, struct fwd_state *fs)
+{
+	unsigned lcore_id;
+	int i;
+
+	for (i = 0; i < RTE_MAX_NUMA_NODES; i++) {
+		if (fs->rt[i] != NULL)
+			algrthms[algo_id].cleanup(&fs->rt[i]);
+		rte_free(fs->actions[i]);
+	}
+	RTE_LCORE_FOREACH(lcore_id)
+		rte_free(fs->counters[lcore_id]);
+	rte_free(fs);
+}
+
+/*
+ * Memory the calling thread touches from now on comes from the socket
+ * where it can, -1 goes back to the default policy. The classifiers
+ * allocate with malloc, so their replicas are placed by building each
+ * under the policy of its socket. The policy only prefers the socket and
+ * pages already touched stay where they are, so replica_remote() checks
+ * where they went. Without NUMA support this does nothing.
+ */
+static void
+prefer_socket(int socket)
+{
+	unsigned long mask;
+
+	if (socket < 0) {
+		syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+		return;
+	}
+	mask = 1UL << socket;
+	syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, sizeof(mask) * 8);
+}
+
+/* socket of the replica being built, for hs_flat_alloc() */
+static int build_socket = SOCKET_ID_ANY;
+
+/* the compact HyperSplit array is the whole lookup, put it on the socket */
+static void *
+hs_flat_alloc(size_t bytes)
+{
+	return rte_malloc_socket("hs_flat", bytes, RTE_CACHE_LINE_SIZE,
+			build_socket);
+}
+
+/* node of the page at addr, -1 if it cannot be told */
+static int
+page_node(const void *addr)
+{
+	int node;
+
+	if (addr == NULL || syscall(SYS_get_mempolicy, &node, NULL, 0,
+				addr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+		return -1;
+	return node;
+}
+
+/*
+ * Number of the sampled pages of the replica that are not on its socket:
+ * the instance and, for HyperSplit, the root, the rules and the compact
+ * array.
+ */
+static int
+replica_remote(int algo_id, int socket, void *rt)
+{
+	const struct hs_tree *tree = rt;
+	const void *addr[4] = {rt};
+	int i, node, remote = 0;
+
+	if (algo_id == ALGO_HS) {
+		addr[1] = tree->root;
+		addr[2] = tree->rules;
+		addr[3] = tree->flat;
+	}
+	for (i = 0; i < 4; i++) {
+		node = page_node(addr[i]);
+		if (node >= 0 && node != socket)
+			remote++;
+	}
+	return remote;
+}
+
+/*
+ * The classifier of the rule file with its actions and counters, a
+ * replica on each of fwd_sockets, NULL if they cannot be built or the
+ * files are malformed.
+ */
+static struct fwd_state *
+build_state(const struct platform_config *cfg)
+{
+    struct timespec starttime, stoptime;
+    struct rule_action *actions = NULL;
+    struct fwd_state *fs;
+    uint64_t timediff;
+    unsigned lcore_id;
+    int socket, num, remote;
+    struct rule_set rs = {
+        .r_rules = NULL,
+        .p_rules = NULL,
+        .num = 0,
+    };
+
+    fs = rte_zmalloc("fwd_state", sizeof(*fs), RTE_CACHE_LINE_SIZE);
+    if (fs == NULL)
+        return NULL;
+
+    if (algrthms[cfg->pc_algo].load_rules(&rs, cfg->s_rule_file) != 0)
+        goto err;
+
+    num = rule_pri_num(&rs);
+    if (load_actions(&actions, cfg->action_file, num) != 0) {
+        fprintf(stderr, "Cannot load the rule actions\n");
+        goto err;
+    }
+    fs->action_num = num;
+
+    hs_cfg.flat_alloc = hs_flat_alloc;
+    hs_cfg.flat_free = rte_free;
+
+    /* updates are whole rebuilds, so every replica gets them */
+    for (socket = 0; socket < RTE_MAX_NUMA_NODES; socket++) {
+        if (!fwd_sockets[socket])
+            continue;
+
+        printf("Building on socket %d\n", socket);
+
+        prefer_socket(socket);
+        build_socket = socket;
+        gettimeofday(&starttime, NULL);
+        if (algrthms[cfg->pc_algo].build(&rs, &fs->rt[socket]) != 0) {
+            prefer_socket(-1);
+            fprintf(stderr, "Building failed\n");
+            fs->rt[socket] = NULL;
+            goto err;
+        }
+        gettimeofday(&stoptime, NULL);
+        prefer_socket(-1);
+        timediff = make_timediff(&starttime, &stoptime);
+
+        printf("Building pass\n");
+        printf("Time for building: %ld(us)\n", timediff);
+        remote = replica_remote(cfg->pc_algo, socket, fs->rt[socket]);
+        if (remote > 0)
+            printf("Replica of socket %d has %d sampled pages on other "
+                    "sockets\n", socket, remote);
+
+        fs->actions[socket] = rte_malloc_socket("actions",
+                num * sizeof(*actions), RTE_CACHE_LINE_SIZE, socket);
+        if (fs->actions[socket] == NULL) {
+            fprintf(stderr, "Cannot allocate the rule actions\n");
+            goto err;
+        }
+        rte_memcpy(fs->actions[socket], actions, num * sizeof(*actions));
+        fs->socket = socket;
+    }
+    rte_free(actions);
+    actions = NULL;
+    unload_rules(&rs);
+
+    algrthms[cfg->pc_algo].stats(&fs->rt[fs->socket], &fs->st);
+    print_pc_stats(&fs->st);
+
+    RTE_LCORE_FOREACH(lcore_id) {
+        fs->counters[lcore_id] = rte_zmalloc_socket("rule_counters",
+                fs->action_num * sizeof(struct rule_counter),
+                RTE_CACHE_LINE_SIZE, rte_lcore_to_socket_id(lcore_id));
+        if (fs->counters[lcore_id] == NULL) {
+            fprintf(stderr, "Cannot allocate rule counters\n");
+            free_state(cfg->pc_algo, fs);
+            return NULL;
+        }
+    }
+
+    return fs;
+
+err:
+    rte_free(actions);
+    unload_rules(&rs);
+    free_state(cfg->pc_algo, fs);
+    return NULL;
+}
+
+/* lcores loading fwd_state, the forwarding ones and the master */
+static bool
+lcore_uses_state(unsigned lcore_id)
+{
+	return lcore_classifies(lcore_id) || lcore_id == rte_get_master_lcore();
+}
+
+/*
+ * Publishes fs and frees the state it replaces once no lcore can still be
+ * using it. The lcores never wait, only the caller does.
+ */
+static void
+replace_state(const struct platform_config *cfg, struct fwd_state *fs)
+{
+	struct fwd_state *old = fwd_state;
+	unsigned lcore_id;
+	uint64_t e;
+
+	__atomic_store_n(&fwd_state, fs, __ATOMIC_RELEASE);
+	e = __atomic_add_fetch(&fwd_epoch, 1, __ATOMIC_SEQ_CST);
+
+	RTE_LCORE_FOREACH(lcore_id) {
+		if (!lcore_uses_state(lcore_id))
+			continue;
+		while (__atomic_load_n(&lcore_epoch[lcore_id].epoch,
+					__ATOMIC_ACQUIRE) < e) {
+			/* the lcores stop publishing, leave the old one */
+			if (force_quit)
+				return;
+			usleep(100);
+		}
+	}
+
+	if (cfg->action_file != NULL)
+		print_rule_counters(old);
+	free_state(cfg->pc_algo, old);
+}
+
+/* modification time of a file, 0 if it is missing */
+static uint64_t
+file_mtime(const char *file)
+{
+	struct stat sb;
+
+	if (file == NULL || stat(file, &sb) != 0)
+		return 0;
+
+	return (uint64_t)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+}
+
+/*
+ * Control thread of -W, polling the rule and action files each second.
+ * A change is rebuilt once the files stayed the same for a poll, so
+ * files being written are not read; renaming complete files into place is
+ * safer still. Failed builds keep the current rules.
+ */
+static void *
+watch_main(void *arg)
+{
+	const struct platform_config *cfg = arg;
+	uint64_t cur[2], seen[2], built[2];
+	struct fwd_state *fs;
+
+	built[0] = seen[0] = file_mtime(cfg->s_rule_file);
+	built[1] = seen[1] = file_mtime(cfg->action_file);
+
+	while (!force_quit) {
+		sleep(1);
+		cur[0] = file_mtime(cfg->s_rule_file);
+		cur[1] = file_mtime(cfg->action_file);
+		if (cur[0] != seen[0] || cur[1] != seen[1]) {
+			seen[0] = cur[0];
+			seen[1] = cur[1];
+			continue;
+		}
+		if ((cur[0] == built[0] && cur[1] == built[1]) || cur[0] == 0)
+			continue;
+		built[0] = cur[0];
+		built[1] = cur[1];
+
+		printf("Reloading the rules of %s\n", cfg->s_rule_file);
+		if ((fs = build_state(cfg)) == NULL) {
+			fprintf(stderr, "Reloading failed, the rules are kept\n");
+			continue;
+		}
+		replace_state(cfg, fs);
+		printf("Reloading done\n");
+	}
+
+	return NULL;
+}
+
+/*
+ * Runs the control thread on the cores of the process no forwarding lcore
+ * runs on, as given to the EAL with -l or -c, so building never takes
+ * their cycles. cpus is the affinity before the EAL pinned the master.
+ */
+static void
+start_watch(struct platform_config *cfg, const cpu_set_t *cpus,
+		pthread_t *tid)
+{
+	cpu_set_t set = *cpus;
+	unsigned lcore_id;
+	int ret;
+
+	RTE_LCORE_FOREACH(lcore_id)
+		if (lcore_busy(lcore_id))
+			CPU_CLR(lcore_id, &set);
+
+	ret = pthread_create(tid, NULL, watch_main, cfg);
+	if (ret != 0)
+		rte_exit(EXIT_FAILURE, "Cannot create the watch thread: %s\n",
+			strerror(ret));
+
+	if (CPU_COUNT(&set) == 0)
+		printf("Notice: no core left for the watch thread, it shares the master's.\n");
+	else if (pthread_setaffinity_np(*tid, sizeof(set), &set) != 0)
+		printf("Notice: cannot move the watch thread off the forwarding cores.\n");
+}
+
+/* -q queues of the enabled ports per lcore in order, -Q queues a port */
+static void
+default_lcore_params(uint8_t nb_ports)
+{
+	unsigned lcore_id = 0, n = 0;
+	uint8_t portid;
+	uint16_t q;
+
+	for (portid = 0; portid < nb_ports; portid++) {
+		if ((l2fwd_enabled_port_mask & (1 << portid)) == 0)
+			continue;
+
+		for (q = 0; q < nb_rxq; q++) {
+			while (rte_lcore_is_enabled(lcore_id) == 0 ||
+			       n == l2fwd_rx_queue_per_lcore) {
+				lcore_id++;
+				n = 0;
+				if (lcore_id >= RTE_MAX_LCORE)
+					rte_exit(EXIT_FAILURE, "Not enough cores\n");
+			}
+			if (nb_lcore_params >= MAX_LCORE_PARAMS)
+				rte_exit(EXIT_FAILURE, "Too many queues\n");
+
+			lcore_params[nb_lcore_params].port_id = portid;
+			lcore_params[nb_lcore_params].queue_id = q;
+			lcore_params[nb_lcore_params].lcore_id = lcore_id;
+			nb_lcore_params++;
+			n++;
+		}
+	}
+}
+
+/*
+ * Hands the RX queues of lcore_params to the lcores. Every queue of an
+ * enabled port up to the highest one given must go to exactly one lcore.
+ */
+static void
+init_lcore_rx_queues(uint8_t nb_ports)
+{
+	static uint8_t seen[RTE_MAX_ETHPORTS][MAX_RX_QUEUE_PER_PORT];
+	struct lcore_queue_conf *qconf;
+	struct lcore_params *lp;
+	uint8_t portid;
+	uint16_t q;
+	unsigned i;
+
+	for (i = 0; i < nb_lcore_params; i++) {
+		lp = &lcore_params[i];
+		if (lp->port_id >= nb_ports ||
+		    (l2fwd_enabled_port_mask & (1 << lp->port_id)) == 0)
+			rte_exit(EXIT_FAILURE, "Port %u of --config is not enabled\n",
+				lp->port_id);
+		if (rte_lcore_is_enabled(lp->lcore_id) == 0)
+			rte_exit(EXIT_FAILURE, "Lcore %u of --config is not enabled\n",
+				lp->lcore_id);
+		if (seen[lp->port_id][lp->queue_id]++)
+			rte_exit(EXIT_FAILURE, "Queue %u of port %u given twice\n",
+				lp->queue_id, lp->port_id);
+
+		qconf = &lcore_queue_conf[lp->lcore_id];
+		if (qconf->n_rx_queue >= MAX_RX_QUEUE_PER_LCORE)
+			rte_exit(EXIT_FAILURE, "Too many queues on lcore %u\n",
+				lp->lcore_id);
+		qconf->rx_queue_list[qconf->n_rx_queue].port_id = lp->port_id;
+		qconf->rx_queue_list[qconf->n_rx_queue].queue_id = lp->queue_id;
+		qconf->n_rx_queue++;
+
+		if (port_nb_rxq[lp->port_id] <= lp->queue_id)
+			port_nb_rxq[lp->port_id] = lp->queue_id + 1;
+
+		printf("Lcore %u: RX port %u queue %u, Dst port %u\n", lp->lcore_id,
+			lp->port_id, lp->queue_id, l2fwd_dst_ports[lp->port_id]);
+	}
+
+	for (portid = 0; portid < nb_ports; portid++) {
+		if ((l2fwd_enabled_port_mask & (1 << portid)) == 0)
+			continue;
+		if (port_nb_rxq[portid] == 0)
+			rte_exit(EXIT_FAILURE, "Port %u has no lcore\n", portid);
+		for (q = 0; q < port_nb_rxq[portid]; q++)
+			if (seen[portid][q] == 0)
+				rte_exit(EXIT_FAILURE, "Queue %u of port %u has no lcore\n",
+					q, portid);
+	}
+}
+
+/*
+ * Pipeline mode: the first -P enabled lcores without RX queues classify,
+ * each draining a ring the RX lcores enqueue to. Returns the RX lcores.
+ */
+static unsigned
+init_cls_lcores(void)
+{
+	struct lcore_queue_conf *qconf;
+	unsigned lcore_id, c = 0, nb_rx_lcores = 0;
+	char name[32];
+
+	RTE_LCORE_FOREACH(lcore_id) {
+		qconf = &lcore_queue_conf[lcore_id];
+		if (qconf->n_rx_queue > 0) {
+			nb_rx_lcores++;
+			continue;
+		}
+		if (c == nb_cls_lcores)
+			continue;
+
+		snprintf(name, sizeof(name), "cls_ring_%u", lcore_id);
+		qconf->ring = rte_ring_create(name, PIPE_RING_SIZE,
+				rte_lcore_to_socket_id(lcore_id), RING_F_SC_DEQ);
+		if (qconf->ring == NULL)
+			rte_exit(EXIT_FAILURE, "Cannot create the ring of lcore %u\n",
+				lcore_id);
+		cls_rings[c++] = qconf->ring;
+		printf("Lcore %u: classify\n", lcore_id);
+	}
+	if (c < nb_cls_lcores)
+		rte_exit(EXIT_FAILURE, "Not enough cores for %u classify lcores\n",
+			nb_cls_lcores);
+
+	pipe_pool = rte_mempool_create("pipe_bursts",
+			nb_cls_lcores * (PIPE_RING_SIZE + nb_rx_lcores + PIPE_DEQ_BURST) +
+			rte_lcore_count() * PIPE_POOL_CACHE * 2,
+			sizeof(struct pipe_burst), PIPE_POOL_CACHE, 0,
+			NULL, NULL, NULL, NULL, rte_socket_id(), 0);
+	if (pipe_pool == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot init the burst pool\n");
+
+	return nb_rx_lcores;
 }
 
 int
@@ -584,21 +1880,25 @@ main(int argc, char **argv)
     uint8_t nb_ports;
     uint8_t nb_ports_available;
     uint8_t portid, last_port;
-    unsigned lcore_id, rx_lcore_id;
+    struct rte_eth_conf local_port_conf;
+    unsigned lcore_id;
     unsigned nb_ports_in_mask = 0;
+    unsigned nb_fwd_lcores = 0, nb_rx_lcores = 0, nb_mbufs;
+    uint16_t q, nb_tx_queues;
+    cpu_set_t cpus;
+    pthread_t watch_tid;
 
-    struct timespec starttime, stoptime;
-    uint64_t timediff;
-    struct rule_set rs = {
-        .r_rules = NULL,
-        .p_rules = NULL,
-        .num = 0,
-    };
     struct platform_config plat_cfg = {
         .s_rule_file = NULL,
+        .action_file = NULL,
         .pc_algo = ALGO_INV,
+        .watch = 0,
     };
 
+	/* the cores of the process, the EAL pins this thread to the master's */
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) != 0)
+		CPU_ZERO(&cpus);
+
 	/* init EAL */
 	ret = rte_eal_init(argc, argv);
 	if (ret < 0)
@@ -609,6 +1909,7 @@ main(int argc, char **argv)
 	force_quit = false;
 	signal(SIGINT, signal_handler);
 	signal(SIGTERM, signal_handler);
+	signal(SIGUSR1, signal_handler);
 
 	/* parse application arguments (after the EAL ones) */
 	ret = l2fwd_parse_args(&plat_cfg, argc, argv);
@@ -621,30 +1922,6 @@ main(int argc, char **argv)
         exit(-1);
     }
 
-    algrthms[plat_cfg.pc_algo].load_rules(&rs, plat_cfg.s_rule_file);
-
-    printf("Building\n");
-
-    gettimeofday(&starttime, NULL);
-    if (algrthms[plat_cfg.pc_algo].build(&rs, &rt) != 0) {
-        fprintf(stderr, "Building failed\n");
-        unload_rules(&rs);
-        exit(-1);
-    }
-    gettimeofday(&stoptime, NULL);
-    timediff = make_timediff(&starttime, &stoptime);
-
-    printf("Building pass\n");
-    printf("Time for building: %ld(us)\n", timediff);
-
-    unload_rules(&rs);
-
-	/* create the mbuf pool */
-	l2fwd_pktmbuf_pool = rte_pktmbuf_pool_create("mbuf_pool", NB_MBUF, 32,
-		0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
-	if (l2fwd_pktmbuf_pool == NULL)
-		rte_exit(EXIT_FAILURE, "Cannot init mbuf pool\n");
-
 	nb_ports = rte_eth_dev_count();
 	if (nb_ports == 0)
 		rte_exit(EXIT_FAILURE, "No Ethernet ports - bye\n");
@@ -657,9 +1934,6 @@ main(int argc, char **argv)
 		l2fwd_dst_ports[portid] = 0;
 	last_port = 0;
 
-	/*
-	 * Each logical core is assigned a dedicated TX queue on each port.
-	 */
 	for (portid = 0; portid < nb_ports; portid++) {
 		/* skip ports that are not enabled */
 		if ((l2fwd_enabled_port_mask & (1 << portid)) == 0)
@@ -673,40 +1947,57 @@ main(int argc, char **argv)
 			last_port = portid;
 
 		nb_ports_in_mask++;
-
-		rte_eth_dev_info_get(portid, &dev_info);
 	}
 	if (nb_ports_in_mask % 2) {
 		printf("Notice: odd number of ports in portmask.\n");
 		l2fwd_dst_ports[last_port] = last_port;
 	}
 
-	rx_lcore_id = 0;
-	qconf = NULL;
-
 	/* Initialize the port/queue configuration of each logical core */
-	for (portid = 0; portid < nb_ports; portid++) {
-		/* skip ports that are not enabled */
-		if ((l2fwd_enabled_port_mask & (1 << portid)) == 0)
-			continue;
-
-		/* get the lcore_id for this port */
-		while (rte_lcore_is_enabled(rx_lcore_id) == 0 ||
-		       lcore_queue_conf[rx_lcore_id].n_rx_port ==
-		       l2fwd_rx_queue_per_lcore) {
-			rx_lcore_id++;
-			if (rx_lcore_id >= RTE_MAX_LCORE)
-				rte_exit(EXIT_FAILURE, "Not enough cores\n");
-		}
+	if (nb_lcore_params == 0)
+		default_lcore_params(nb_ports);
+	init_lcore_rx_queues(nb_ports);
+	if (nb_cls_lcores)
+		nb_rx_lcores = init_cls_lcores();
 
-		if (qconf != &lcore_queue_conf[rx_lcore_id])
-			/* Assigned a new logical core in the loop above. */
-			qconf = &lcore_queue_conf[rx_lcore_id];
-
-		qconf->rx_port_list[qconf->n_rx_port] = portid;
-		qconf->n_rx_port++;
-		printf("Lcore %u: RX port %u, Dst port %u\n", rx_lcore_id, (unsigned) portid, l2fwd_dst_ports[portid]);
+	/*
+	 * Each forwarding lcore is assigned nb_txq dedicated TX queues on
+	 * each port, so lcores never share one.
+	 */
+	RTE_LCORE_FOREACH(lcore_id) {
+		qconf = &lcore_queue_conf[lcore_id];
+		qconf->stats = &lcore_stats[lcore_id];
+		if (!lcore_classifies(lcore_id))
+			continue;
+		qconf->tx_queue_base = nb_fwd_lcores * nb_txq;
+		qconf->socket_id = rte_lcore_to_socket_id(lcore_id);
+		fwd_sockets[qconf->socket_id] = true;
+		nb_fwd_lcores++;
 	}
+	nb_tx_queues = nb_fwd_lcores * nb_txq;
+	if (nb_fwd_lcores == 0)
+		fwd_sockets[rte_lcore_to_socket_id(rte_get_master_lcore())] = true;
+
+	fwd_state = build_state(&plat_cfg);
+	if (fwd_state == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot build the classifier\n");
+
+	/* the mbufs the rings and TX buffers of all queues may hold */
+	nb_mbufs = nb_fwd_lcores * (MAX_PKT_BURST + 32);
+	if (nb_cls_lcores)
+		nb_mbufs += nb_rx_lcores * (MAX_PKT_BURST + 32) + nb_cls_lcores *
+			(PIPE_RING_SIZE + nb_rx_lcores + PIPE_DEQ_BURST) * MAX_PKT_BURST;
+	for (portid = 0; portid < nb_ports; portid++)
+		if (l2fwd_enabled_port_mask & (1 << portid))
+			nb_mbufs += port_nb_rxq[portid] * nb_rxd + nb_tx_queues *
+				(nb_txd + MAX_PKT_BURST);
+
+	/* create the mbuf pool */
+	l2fwd_pktmbuf_pool = rte_pktmbuf_pool_create("mbuf_pool",
+		RTE_MAX(nb_mbufs, (unsigned)NB_MBUF), 32,
+		0, RTE_MBUF_DEFAULT_BUF_SIZE, rte_socket_id());
+	if (l2fwd_pktmbuf_pool == NULL)
+		rte_exit(EXIT_FAILURE, "Cannot init mbuf pool\n");
 
 	nb_ports_available = nb_ports;
 
@@ -721,48 +2012,80 @@ main(int argc, char **argv)
 		/* init port */
 		printf("Initializing port %u... ", (unsigned) portid);
 		fflush(stdout);
-		ret = rte_eth_dev_configure(portid, 1, 1, &port_conf);
+
+		rte_eth_dev_info_get(portid, &dev_info);
+		if (port_nb_rxq[portid] > dev_info.max_rx_queues ||
+		    nb_tx_queues > dev_info.max_tx_queues)
+			rte_exit(EXIT_FAILURE, "Port %u has %u RX and %u TX queues at "
+				"most, %u and %u needed\n", (unsigned) portid,
+				dev_info.max_rx_queues, dev_info.max_tx_queues,
+				port_nb_rxq[portid], nb_tx_queues);
+
+		/* hash the 5-tuple so a flow stays on one queue, in order */
+		local_port_conf = port_conf;
+		if (port_nb_rxq[portid] > 1) {
+			local_port_conf.rx_adv_conf.rss_conf.rss_hf =
+				(ETH_RSS_IP | ETH_RSS_TCP | ETH_RSS_UDP) &
+				dev_info.flow_type_rss_offloads;
+			if (local_port_conf.rx_adv_conf.rss_conf.rss_hf != 0)
+				local_port_conf.rxmode.mq_mode = ETH_MQ_RX_RSS;
+			else
+				printf("no RSS, the driver spreads the packets... ");
+		}
+
+		ret = rte_eth_dev_configure(portid, port_nb_rxq[portid],
+				nb_tx_queues, &local_port_conf);
 		if (ret < 0)
 			rte_exit(EXIT_FAILURE, "Cannot configure device: err=%d, port=%u\n",
 				  ret, (unsigned) portid);
 
 		rte_eth_macaddr_get(portid,&l2fwd_ports_eth_addr[portid]);
 
-		/* init one RX queue */
-		fflush(stdout);
-		ret = rte_eth_rx_queue_setup(portid, 0, nb_rxd,
-					     rte_eth_dev_socket_id(portid),
-					     NULL,
-					     l2fwd_pktmbuf_pool);
-		if (ret < 0)
-			rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup:err=%d, port=%u\n",
-				  ret, (unsigned) portid);
+		/* init the RX queues */
+		for (q = 0; q < port_nb_rxq[portid]; q++) {
+			ret = rte_eth_rx_queue_setup(portid, q, nb_rxd,
+						     rte_eth_dev_socket_id(portid),
+						     NULL,
+						     l2fwd_pktmbuf_pool);
+			if (ret < 0)
+				rte_exit(EXIT_FAILURE, "rte_eth_rx_queue_setup:err=%d, port=%u\n",
+					  ret, (unsigned) portid);
+		}
 
-		/* init one TX queue on each port */
-		fflush(stdout);
-		ret = rte_eth_tx_queue_setup(portid, 0, nb_txd,
-				rte_eth_dev_socket_id(portid),
-				NULL);
-		if (ret < 0)
-			rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup:err=%d, port=%u\n",
-				ret, (unsigned) portid);
-
-		/* Initialize TX buffers */
-		tx_buffer[portid] = rte_zmalloc_socket("tx_buffer",
-				RTE_ETH_TX_BUFFER_SIZE(MAX_PKT_BURST), 0,
-				rte_eth_dev_socket_id(portid));
-		if (tx_buffer[portid] == NULL)
-			rte_exit(EXIT_FAILURE, "Cannot allocate buffer for tx on port %u\n",
-					(unsigned) portid);
-
-		rte_eth_tx_buffer_init(tx_buffer[portid], MAX_PKT_BURST);
-
-		ret = rte_eth_tx_buffer_set_err_callback(tx_buffer[portid],
-				rte_eth_tx_buffer_count_callback,
-				&port_statistics[portid].dropped);
-		if (ret < 0)
-				rte_exit(EXIT_FAILURE, "Cannot set error callback for "
-						"tx buffer on port %u\n", (unsigned) portid);
+		/* init the TX queues, nb_txq of each forwarding lcore */
+		for (q = 0; q < nb_tx_queues; q++) {
+			ret = rte_eth_tx_queue_setup(portid, q, nb_txd,
+					rte_eth_dev_socket_id(portid),
+					NULL);
+			if (ret < 0)
+				rte_exit(EXIT_FAILURE, "rte_eth_tx_queue_setup:err=%d, port=%u\n",
+					ret, (unsigned) portid);
+		}
+
+		/* Initialize TX buffers of each lcore, actions may pick one */
+		RTE_LCORE_FOREACH(lcore_id) {
+			qconf = &lcore_queue_conf[lcore_id];
+			if (!lcore_classifies(lcore_id))
+				continue;
+
+			for (q = 0; q < nb_txq; q++) {
+				qconf->tx_buffer[portid][q] = rte_zmalloc_socket("tx_buffer",
+						RTE_ETH_TX_BUFFER_SIZE(MAX_PKT_BURST), 0,
+						rte_lcore_to_socket_id(lcore_id));
+				if (qconf->tx_buffer[portid][q] == NULL)
+					rte_exit(EXIT_FAILURE, "Cannot allocate buffer for tx on port %u\n",
+							(unsigned) portid);
+
+				rte_eth_tx_buffer_init(qconf->tx_buffer[portid][q], MAX_PKT_BURST);
+
+				ret = rte_eth_tx_buffer_set_err_callback(qconf->tx_buffer[portid][q],
+						rte_eth_tx_buffer_count_callback,
+						&lcore_stats[lcore_id].port[portid].dropped);
+				if (ret < 0)
+						rte_exit(EXIT_FAILURE, "Cannot set error callback for "
+								"tx buffer on port %u\n", (unsigned) portid);
+			}
+		}
 
 		/* Start device */
 		ret = rte_eth_dev_start(portid);
@@ -794,6 +2117,9 @@ main(int argc, char **argv)
 
 	check_all_ports_link_status(nb_ports, l2fwd_enabled_port_mask);
 
+	if (plat_cfg.watch)
+		start_watch(&plat_cfg, &cpus, &watch_tid);
+
 	ret = 0;
 	/* launch per-lcore init on every lcore */
 	/* rte_eal_mp_remote_launch(l2fwd_launch_one_lcore, NULL, CALL_MASTER); */
@@ -805,6 +2131,12 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (plat_cfg.watch)
+		pthread_join(watch_tid, NULL);
+
+	if (plat_cfg.action_file != NULL)
+		print_rule_counters(fwd_state);
+
 	for (portid = 0; portid < nb_ports; portid++) {
 		if ((l2fwd_enabled_port_mask & (1 << portid)) == 0)
 			continue;
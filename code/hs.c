@@ -15,9 +15,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include "hs.h"
 #include "utils.h"
+#include "uthash.h"
 
 /* we need a stack to traverse k-d tree */
 struct s_node {
@@ -33,20 +38,6 @@ struct seg_point {
     struct { uint8_t begin :1; uint8_t end :1; } flag;
 };
 
-static struct {
-    size_t segment_num[DIM_MAX];
-    size_t segment_total;
-
-    size_t worst_depth;
-    size_t average_depth;
-
-    size_t tree_node_num;
-    size_t leaf_node_num;
-
-    /* TODO: assume max_depth = 128 */
-    size_t depth_node[128][2];
-} g_statistics;
-
 static int seg_pnt_cmp(const void *a, const void *b)
 {
     struct seg_point *pa = (typeof(pa))a;
@@ -61,18 +52,346 @@ static int seg_pnt_cmp(const void *a, const void *b)
     }
 }
 
-static int build_hs_tree(
-        const struct rule_set *rs, struct hs_node *cur_node, int depth)
+/* build profiler phases */
+enum {
+    HS_PROF_SORT,
+    HS_PROF_WEIGHT,
+    HS_PROF_SPLIT,
+    HS_PROF_COPY,
+    HS_PROF_ALLOC,
+    HS_PROF_NUM
+};
+
+static const char * const hs_prof_phase[HS_PROF_NUM] = {
+    "sort", "weight", "split", "copy", "alloc"
+};
+
+/* a node to build and the rules inside its region */
+struct hs_work {
+    struct rule_set rs;
+    struct hs_node *node;
+    int depth;
+    int own;                /* rs.r_rules and pkts are freed once built */
+    int *pkts;              /* sample packets inside the region */
+    int pkt_num;
+    struct hs_node **slot;  /* where the parent points to node */
+    uint32_t splits;        /* split copies above owed to its first leaf */
+};
+
+/* explicit work stack shared by the builder threads */
+struct hs_builder {
+    struct hs_tree *tree;
+    struct hs_work *stack;
+    int top;
+    int cap;
+    int busy;               /* items taken but not finished */
+    int err;
+    size_t reserved;        /* leaf sizes of the items not built yet */
+    size_t limit;           /* bytes the instance may reach, 0 for no limit */
+    const struct trace *sample;
+    int lazy_depth;         /* nodes this deep are left as stubs */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+struct hs_cfg hs_cfg = {0, 1, 0, NULL, 0, 0, 0, 0, 1, 0, 0, 0, 0};
+
+static int depth_limit(void)
+{
+    if (hs_cfg.max_depth > 0 && hs_cfg.max_depth < HS_DEPTH_LIMIT) {
+        return hs_cfg.max_depth;
+    }
+
+    return HS_DEPTH_LIMIT;
+}
+
+/* the depth statistics grow with the tree */
+static size_t *depth_row(struct hs_statistics *st, int depth)
+{
+    size_t (*rows)[2];
+    int cap;
+
+    if (depth >= st->depth_cap) {
+        for (cap = st->depth_cap ? st->depth_cap : 32; cap <= depth; cap <<= 1);
+        rows = realloc(st->depth_node, cap * sizeof(*rows));
+        if (rows == NULL) {
+            return NULL;
+        }
+        bzero(rows + st->depth_cap, (cap - st->depth_cap) * sizeof(*rows));
+        st->depth_node = rows;
+        st->depth_cap = cap;
+    }
+
+    return st->depth_node[depth];
+}
+
+static void drop_work(struct hs_tree *tree, struct hs_work *w)
+{
+    if (w->own) {
+        SAFE_FREE(w->rs.r_rules);
+        SAFE_FREE(w->pkts);
+        prof_free(tree->prof, w->rs.num * sizeof(*w->rs.r_rules) +
+                w->pkt_num * sizeof(*w->pkts));
+    }
+}
+
+static size_t bucket_bytes(int num)
+{
+    return sizeof(struct hs_bucket) + num * sizeof(struct rng_rule);
+}
+
+static size_t stub_bytes(int num)
+{
+    return sizeof(struct hs_stub) + sizeof(struct hs_node) +
+        num * sizeof(struct rng_rule);
+}
+
+/* a node waiting to be built ends as a bucket, or a stub if there are any */
+static size_t leaf_bytes(const struct hs_builder *b, int num)
+{
+    return b->lazy_depth < INT_MAX ? stub_bytes(num) : bucket_bytes(num);
+}
+
+/* the build leaves a share of the budget to the updates */
+static size_t build_limit(void)
+{
+    return hs_cfg.mem_budget - hs_cfg.mem_budget / HS_BUDGET_SPARE;
+}
+
+/*
+ * Every node waiting to be built holds a reservation of its leaf size, so
+ * the build can always end within the limit by turning them into buckets.
+ * A split is taken only if its nodes and the reservations of its children
+ * still fit.
+ */
+static int mem_split(struct hs_builder *b, int num, int l_num, int r_num)
+{
+    struct hs_tree *tree = b->tree;
+    size_t nodes = 2 * sizeof(struct hs_node);
+    size_t reserve = leaf_bytes(b, l_num) + leaf_bytes(b, r_num);
+    int ret = 1;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->limit && tree->mem_used + nodes + b->reserved + reserve -
+            leaf_bytes(b, num) > b->limit) {
+        ret = 0;
+    } else {
+        tree->mem_used += nodes;
+        b->reserved += reserve;
+        b->reserved -= leaf_bytes(b, num);
+    }
+    pthread_mutex_unlock(&b->lock);
+
+    return ret;
+}
+
+static int u32_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Cost-based split on dimension d, for nl, nr rules and pl, pr sample packets
+ * on either side of a threshold:
+ *  - with a sample, the expected search depth pl * log2(nl + 1) +
+ *    pr * log2(nr + 1),
+ *  - without, the larger side max(nl, nr),
+ * plus copy_weight times the rules copied to both sides, nl + nr - n. The
+ * candidates are the segment points, as for the weight median. vals holds
+ * 2 * rules + packets.
+ */
+static double sweep_split(const struct rule_set *rs, const struct hs_work *w,
+        int d, const struct seg_point *seg_pnts, int pnt_num, uint32_t *vals,
+        const struct trace *sample, union point *thresh)
+{
+    uint32_t *begins = vals, *ends = vals + rs->num, *pvals = ends + rs->num;
+    int i, b_num, e_num, p_num;
+    double cost, best = DBL_MAX;
+    union point th;
+
+    for (i = 0; i < rs->num; i++) {
+        begins[i] = rs->r_rules[i].dim[d][0].u32;
+        ends[i] = rs->r_rules[i].dim[d][1].u32;
+    }
+    for (i = 0; i < w->pkt_num; i++) {
+        pvals[i] = sample->pkts[w->pkts[i]].val[d].u32;
+    }
+    qsort(begins, rs->num, sizeof(*begins), u32_cmp);
+    qsort(ends, rs->num, sizeof(*ends), u32_cmp);
+    qsort(pvals, w->pkt_num, sizeof(*pvals), u32_cmp);
+
+    /* the thresholds do not decrease, so one sweep counts both sides */
+    for (b_num = e_num = p_num = 0, i = 1; i < pnt_num - 1; i++) {
+        th = seg_pnts[i].pnt;
+        if (seg_pnts[i].flag.begin) {
+            point_dec(&th);
+        }
+
+        for (; b_num < rs->num && begins[b_num] <= th.u32; b_num++);
+        for (; e_num < rs->num && ends[e_num] <= th.u32; e_num++);
+        for (; p_num < w->pkt_num && pvals[p_num] <= th.u32; p_num++);
+
+        if (w->pkt_num > 0) {
+            cost = p_num * log2(b_num + 1) +
+                (w->pkt_num - p_num) * log2(rs->num - e_num + 1);
+        } else {
+            cost = b_num > rs->num - e_num ? b_num : rs->num - e_num;
+        }
+        cost += hs_cfg.copy_weight * (b_num - e_num);
+        if (cost < best) {
+            best = cost;
+            *thresh = th;
+        }
+    }
+
+    return best;
+}
+
+/* sample packets of one side of the split */
+static int split_pkts(const struct hs_work *w, const struct trace *sample,
+        int d2s, const union point *thresh, int right, struct hs_work *child)
+{
+    int i;
+
+    child->pkts = NULL;
+    child->pkt_num = 0;
+    if (w->pkt_num == 0) {
+        return 0;
+    }
+
+    child->pkts = malloc(w->pkt_num * sizeof(*child->pkts));
+    if (child->pkts == NULL) {
+        return -1;
+    }
+
+    for (i = 0; i < w->pkt_num; i++) {
+        if ((sample->pkts[w->pkts[i]].val[d2s].u32 > thresh->u32) == right) {
+            child->pkts[child->pkt_num++] = w->pkts[i];
+        }
+    }
+
+    return 0;
+}
+
+/* rules of one side of the split, trimmed to its range */
+static int split_rules(const struct rule_set *rs, int d2s,
+        struct range *rng, struct rule_set *child_rs)
+{
+    struct rng_rule *rules;
+    int i;
+
+    child_rs->r_rules = malloc(rs->num * sizeof(*child_rs->r_rules));
+    if (child_rs->r_rules == NULL) {
+        return -1;
+    }
+
+    for (i = 0, child_rs->num = 0; i < rs->num; i++) {
+        if (is_greater(&rs->r_rules[i].dim[d2s][0], &rng->end) ||
+            is_less(&rs->r_rules[i].dim[d2s][1], &rng->begin)) {
+            continue;
+        }
+
+        child_rs->r_rules[child_rs->num] = rs->r_rules[i];
+
+        /* rules must be trimmed */
+        if (is_less(&child_rs->r_rules[child_rs->num].dim[d2s][0],
+            &rng->begin)) {
+            child_rs->r_rules[child_rs->num].dim[d2s][0] = rng->begin;
+        }
+        if (is_greater(&child_rs->r_rules[child_rs->num].dim[d2s][1],
+            &rng->end)) {
+            child_rs->r_rules[child_rs->num].dim[d2s][1] = rng->end;
+        }
+
+        child_rs->num++;
+    }
+
+    /* the copy stays alive until the child is built */
+    rules = realloc(child_rs->r_rules, (child_rs->num ? child_rs->num : 1) *
+            sizeof(*child_rs->r_rules));
+    if (rules != NULL) {
+        child_rs->r_rules = rules;
+    }
+
+    return 0;
+}
+
+/* the rules are kept for the subtree to be built on first use */
+static int make_stub(struct hs_work *w)
+{
+    struct hs_node *cur_node = w->node;
+    struct hs_stub *stub;
+
+    stub = malloc(sizeof(*stub));
+    if (stub == NULL) {
+        return -1;
+    }
+    stub->node = calloc(1, sizeof(*stub->node));
+    if (stub->node == NULL) {
+        SAFE_FREE(stub);
+        return -1;
+    }
+    stub->node->d2s = -1;
+
+    stub->num = w->rs.num;
+    stub->splits = w->splits;
+    if (w->own) {
+        stub->rules = w->rs.r_rules;
+        w->rs.r_rules = NULL;
+    } else {
+        stub->rules = malloc(w->rs.num * sizeof(*stub->rules));
+        if (stub->rules == NULL) {
+            SAFE_FREE(stub->node);
+            SAFE_FREE(stub);
+            return -1;
+        }
+        memcpy(stub->rules, w->rs.r_rules, w->rs.num * sizeof(*stub->rules));
+    }
+
+    cur_node->d2s = HS_STUB;
+    cur_node->depth = w->depth;
+    cur_node->thresh.u64 = 0;
+    cur_node->stub = stub;
+
+    return 0;
+}
+
+/*
+ * Build one node: a leaf, a rule bucket past the depth limit, or an internal
+ * node whose children are returned as new work. Returns the number of
+ * children, -1 on failure.
+ */
+static int build_hs_node(struct hs_builder *b, struct hs_work *w,
+        struct hs_work child[2])
 {
     int *wght, wght_all;
     float wght_avg, wght_jdg;
     int max_pnt, num, pnt_num, d2s, d, i, j;
 
     union point thresh;
-    struct rule_set child_rs;
     struct seg_point *seg_pnts;
     struct range lrange, rrange;
 
+    const struct rule_set *rs = &w->rs;
+    struct hs_node *cur_node = w->node;
+    int depth = w->depth, do_split = 0;
+    struct hs_tree *tree = b->tree;
+    struct hs_statistics *st = &tree->st;
+    struct pc_prof *prof = tree->prof;
+    uint64_t t = prof_now(prof);
+    size_t seg_bytes;
+
+    const struct trace *sample = b->sample;
+    uint32_t *vals = NULL;
+    double cost, best_cost = DBL_MAX;
+    union point th;
+
+    if (w->slot != NULL && depth >= b->lazy_depth) {
+        return make_stub(w);
+    }
+
     max_pnt = d2s = 0;
     num = rs->num << 1;
     wght_avg = rs->num + 1; //max, all rules project one segment
@@ -80,16 +399,26 @@ static int build_hs_tree(
     bzero(&lrange, sizeof(lrange));
     bzero(&rrange, sizeof(rrange));
 
+    seg_bytes = num * (sizeof(*wght) + sizeof(*seg_pnts));
+
     wght = malloc(num * sizeof(*wght));
     seg_pnts  = malloc(num * sizeof(*seg_pnts));
-    child_rs.r_rules = malloc(rs->num * sizeof(*child_rs.r_rules));
-    if (wght == NULL || seg_pnts == NULL || child_rs.r_rules == NULL) {
+    if (wght == NULL || seg_pnts == NULL) {
         SAFE_FREE(wght);
         SAFE_FREE(seg_pnts);
-        SAFE_FREE(child_rs.r_rules);
         return -1;
     }
-
+    if (w->pkt_num > 0 || hs_cfg.copy_weight > 0) {
+        seg_bytes += (num + w->pkt_num) * sizeof(*vals);
+        vals = malloc((num + w->pkt_num) * sizeof(*vals));
+        if (vals == NULL) {
+            SAFE_FREE(wght);
+            SAFE_FREE(seg_pnts);
+            return -1;
+        }
+    }
+    prof_alloc(prof, seg_bytes);
+    prof_phase(prof, depth, HS_PROF_ALLOC, &t);
     /*
      * start here
      */
@@ -108,6 +437,7 @@ static int build_hs_tree(
         }
 
         qsort(seg_pnts, num, sizeof(*seg_pnts), seg_pnt_cmp);
+        prof_phase(prof, depth, HS_PROF_SORT, &t);
 
         /*
          * make segments. Note: pnts with the same val may form one seg
@@ -155,13 +485,36 @@ static int build_hs_tree(
         }
 
         if (depth == 0) {
-            g_statistics.segment_num[d] = pnt_num;
-            g_statistics.segment_total *= pnt_num;
+            st->segment_num[d] = pnt_num;
+            st->segment_total *= pnt_num;
         }
 
         if (pnt_num < 3) {
+            prof_phase(prof, depth, HS_PROF_SPLIT, &t);
             continue; /* skip this dim: no more ranges */
         }
+        prof_phase(prof, depth, HS_PROF_SPLIT, &t);
+
+        /*
+         * sample packets inside or copies priced, split for the lowest cost
+         */
+        if (w->pkt_num > 0 || hs_cfg.copy_weight > 0) {
+            cost = sweep_split(rs, w, d, seg_pnts, pnt_num, vals, sample, &th);
+            if (cost < best_cost) {
+                best_cost = cost;
+                d2s = d;
+                thresh = th;
+
+                lrange.begin = seg_pnts[0].pnt;
+                lrange.end = thresh;
+
+                rrange.begin = thresh;
+                point_inc(&rrange.begin);
+                rrange.end = seg_pnts[pnt_num - 1].pnt;
+            }
+            prof_phase(prof, depth, HS_PROF_WEIGHT, &t);
+            continue;
+        }
 
         /*
          * gen heuristic info
@@ -178,6 +531,8 @@ static int build_hs_tree(
             }
         }
 
+        prof_phase(prof, depth, HS_PROF_WEIGHT, &t);
+
         wght_jdg = (float)wght_all / (pnt_num - 1);
 
         if (wght_avg <= wght_jdg) {
@@ -208,210 +563,907 @@ static int build_hs_tree(
         rrange.begin = thresh;
         point_inc(&rrange.begin);
         rrange.end = seg_pnts[pnt_num - 1].pnt;
+        prof_phase(prof, depth, HS_PROF_SPLIT, &t);
 
     } /* end of for (d = 0; d < DIM_MAX; d++) */
 
     SAFE_FREE(seg_pnts);
     SAFE_FREE(wght);
+    SAFE_FREE(vals);
+    prof_free(prof, seg_bytes);
+
+    cur_node->depth = depth;
 
     /*
-     * gen leaf node
+     * gen leaf node, every rule left covers it: for multi-match they are
+     * all kept as a bucket
      */
-    if (max_pnt < 3) {
+    if (max_pnt < 3 && (!tree->multi || rs->num <= 1)) {
         cur_node->d2s = -1;
-        cur_node->depth = depth;
-        cur_node->thresh.u64 = rs->r_rules[0].pri;
+        cur_node->thresh.u64 = rs->num ? rs->r_rules[0].pri : -1;
         cur_node->child[0] = NULL;
         cur_node->child[1] = NULL;
 
-        SAFE_FREE(child_rs.r_rules);
-        g_statistics.leaf_node_num++;
-        g_statistics.depth_node[depth][1]++;
-        g_statistics.average_depth += depth;
-        if (g_statistics.worst_depth < depth) {
-            g_statistics.worst_depth = depth;
-        }
+        prof_phase(prof, depth, HS_PROF_ALLOC, &t);
         return 0;
     }
 
-    cur_node->d2s = d2s;
-    cur_node->depth = depth;
-    cur_node->thresh = thresh;
-
     /*
-     * gen left child
+     * split the rules, the split is dropped if it does not fit the budget
      */
-    cur_node->child[0] = malloc(sizeof(*cur_node->child[0]));
-    if (cur_node->child[0] == NULL) {
-        SAFE_FREE(child_rs.r_rules);
-        return -1;
-    }
-
-    bzero(child_rs.r_rules, rs->num * sizeof(*child_rs.r_rules));
-
-    for (i = 0, child_rs.num = 0; i < rs->num; i++) {
-        if (is_greater(&rs->r_rules[i].dim[d2s][0], &lrange.end) ||
-            is_less(&rs->r_rules[i].dim[d2s][1], &lrange.begin)) {
-            continue;
+    if (max_pnt >= 3 && depth < depth_limit()) {
+        for (i = 0; i < 2; i++) {
+            child[i].depth = depth + 1;
+            child[i].own = 1;
+            if (split_rules(rs, d2s, i ? &rrange : &lrange, &child[i].rs) != 0) {
+                if (i) {
+                    drop_work(tree, &child[0]);
+                }
+                return -1;
+            }
+            if (split_pkts(w, sample, d2s, &thresh, i, &child[i]) != 0) {
+                child[i].pkt_num = 0;
+                drop_work(tree, &child[i]);
+                if (i) {
+                    drop_work(tree, &child[0]);
+                }
+                return -1;
+            }
+            prof_alloc(prof, child[i].rs.num * sizeof(*rs->r_rules) +
+                    child[i].pkt_num * sizeof(*child[i].pkts));
         }
+        prof_phase(prof, depth, HS_PROF_COPY, &t);
 
-        child_rs.r_rules[child_rs.num] = rs->r_rules[i];
-
-        /* rules must be trimmed */
-        if (is_less(&child_rs.r_rules[child_rs.num].dim[d2s][0],
-            &lrange.begin)) {
-            child_rs.r_rules[child_rs.num].dim[d2s][0] = lrange.begin;
-        }
-        if (is_greater(&child_rs.r_rules[child_rs.num].dim[d2s][1],
-            &lrange.end)) {
-            child_rs.r_rules[child_rs.num].dim[d2s][1] = lrange.end;
+        if (!mem_split(b, rs->num, child[0].rs.num, child[1].rs.num)) {
+            drop_work(tree, &child[0]);
+            drop_work(tree, &child[1]);
+        } else {
+            do_split = 1;
         }
-
-        child_rs.num++;
     }
 
-    if (build_hs_tree(&child_rs, cur_node->child[0], depth + 1) != 0) {
-        SAFE_FREE(cur_node->child[0]);
-        SAFE_FREE(child_rs.r_rules);
-        return -1;
+    /*
+     * gen rule bucket, the rules are kept in priority order
+     */
+    if (!do_split) {
+        cur_node->bucket = malloc(bucket_bytes(rs->num));
+        if (cur_node->bucket == NULL) {
+            cur_node->d2s = -1;
+            cur_node->child[1] = NULL;
+            return -1;
+        }
+        cur_node->d2s = HS_BUCKET;
+        cur_node->thresh.u64 = 0;
+        cur_node->bucket->num = rs->num;
+        memcpy(cur_node->bucket->rules, rs->r_rules,
+                rs->num * sizeof(*rs->r_rules));
+
+        prof_phase(prof, depth, HS_PROF_COPY, &t);
+        return 0;
     }
 
     /*
-     * gen right child
+     * gen children, they are built as new work
      */
-    cur_node->child[1] = malloc(sizeof(*cur_node->child[1]));
-    if (cur_node->child[1] == NULL) {
-        SAFE_FREE(child_rs.r_rules);
+    cur_node->child[0] = calloc(1, sizeof(*cur_node->child[0]));
+    cur_node->child[1] = calloc(1, sizeof(*cur_node->child[1]));
+    if (cur_node->child[0] == NULL || cur_node->child[1] == NULL) {
+        SAFE_FREE(cur_node->child[0]);
+        SAFE_FREE(cur_node->child[1]);
+        cur_node->d2s = -1;
+        drop_work(tree, &child[0]);
+        drop_work(tree, &child[1]);
         return -1;
     }
+    cur_node->d2s = d2s;
+    cur_node->thresh = thresh;
 
-    bzero(child_rs.r_rules, rs->num * sizeof(*child_rs.r_rules));
+    for (i = 0; i < 2; i++) {
+        cur_node->child[i]->d2s = -1;
+        cur_node->child[i]->thresh.u64 = -1;
+        child[i].node = cur_node->child[i];
+        child[i].slot = &cur_node->child[i];
+    }
+    prof_phase(prof, depth, HS_PROF_ALLOC, &t);
 
-    for (i = 0, child_rs.num = 0; i < rs->num; i++) {
-        if (is_greater(&rs->r_rules[i].dim[d2s][0], &rrange.end) ||
-            is_less(&rs->r_rules[i].dim[d2s][1], &rrange.begin)) {
-            continue;
-        }
+    return 2;
+}
 
-        child_rs.r_rules[child_rs.num] = rs->r_rules[i];
+static int push_work(struct hs_builder *b, const struct hs_work *w)
+{
+    struct hs_work *stack;
+    int cap;
 
-        /* rules must be trimmed */
-        if (is_less(&child_rs.r_rules[child_rs.num].dim[d2s][0],
-            &rrange.begin)) {
-            child_rs.r_rules[child_rs.num].dim[d2s][0] = rrange.begin;
-        }
-        if (is_greater(&child_rs.r_rules[child_rs.num].dim[d2s][1],
-            &rrange.end)) {
-            child_rs.r_rules[child_rs.num].dim[d2s][1] = rrange.end;
+    if (b->top == b->cap) {
+        cap = b->cap ? b->cap << 1 : 64;
+        stack = realloc(b->stack, cap * sizeof(*stack));
+        if (stack == NULL) {
+            return -1;
         }
-
-        child_rs.num++;
+        b->stack = stack;
+        b->cap = cap;
     }
 
-    if (build_hs_tree(&child_rs, cur_node->child[1], depth + 1) != 0) {
-        SAFE_FREE(cur_node->child[1]);
-        SAFE_FREE(child_rs.r_rules);
-        return -1;
+    b->stack[b->top++] = *w;
+    return 0;
+}
+
+/* remember where a stub hangs so that it can be built later */
+static int add_stub(struct hs_tree *tree, struct hs_node **slot)
+{
+    struct hs_node ***stubs;
+    int cap;
+
+    if (tree->slot_num == tree->slot_cap) {
+        cap = tree->slot_cap ? tree->slot_cap << 1 : 64;
+        stubs = realloc(tree->stubs, cap * sizeof(*stubs));
+        if (stubs == NULL) {
+            return -1;
+        }
+        tree->stubs = stubs;
+        tree->mem_used += (cap - tree->slot_cap) * sizeof(*stubs);
+        tree->slot_cap = cap;
     }
 
-    SAFE_FREE(child_rs.r_rules);
-    g_statistics.tree_node_num++;
-    g_statistics.depth_node[depth][0]++;
+    tree->stubs[tree->slot_num++] = slot;
     return 0;
 }
 
-static void cleanup_hs_tree(struct hs_node *node)
+/* rules of a rule set but the no-match region rule of a rebuild, kept last */
+static int real_rules(const struct rule_set *rs)
 {
-    if (node->child[0] == NULL && node->child[1] == NULL) {
-        return;
+    return rs->num && rs->r_rules[rs->num - 1].pri == -1 ? rs->num - 1 : rs->num;
+}
+
+/* take work until the stack is empty and no node is being built */
+static void *hs_worker(void *arg)
+{
+    struct hs_builder *b = arg;
+    struct hs_tree *tree = b->tree;
+    struct hs_statistics *st = &tree->st;
+    struct hs_work w, child[2];
+    size_t *row;
+    int ret, i;
+
+    pthread_mutex_lock(&b->lock);
+    for (;;) {
+        while (b->top == 0 && b->busy > 0 && !b->err) {
+            pthread_cond_wait(&b->cond, &b->lock);
+        }
+        if (b->top == 0 || b->err) {
+            break;
+        }
+        w = b->stack[--b->top];
+        b->busy++;
+        pthread_mutex_unlock(&b->lock);
+
+        ret = build_hs_node(b, &w, child);
+
+        pthread_mutex_lock(&b->lock);
+        b->busy--;
+        row = depth_row(st, w.depth);
+        if (ret < 0 || row == NULL) {
+            b->err = 1;
+        } else if (ret == 0 && w.node->d2s != HS_STUB) {
+            b->reserved -= leaf_bytes(b, w.rs.num);
+            st->leaf_node_num++;
+            st->rule_copies += real_rules(&w.rs);
+            if (w.node->d2s == -1) {
+                w.node->copies = real_rules(&w.rs);
+                w.node->splits = w.splits;
+            } else {
+                w.node->bucket->splits = w.splits;
+            }
+            row[1]++;
+            st->average_depth += w.depth;
+            st->sample_depth += (size_t)w.pkt_num * w.depth;
+            st->sample_num += w.pkt_num;
+            if (st->worst_depth < w.depth) {
+                st->worst_depth = w.depth;
+            }
+            if (w.node->d2s == HS_BUCKET) {
+                st->bucket_num++;
+                st->bucket_rules += w.rs.num;
+                tree->mem_used += bucket_bytes(w.rs.num);
+            }
+        } else if (ret == 0) {
+            /* stubs are not leaves, they keep their rules */
+            b->reserved -= leaf_bytes(b, w.rs.num);
+            tree->mem_used += stub_bytes(w.rs.num);
+            st->stub_num++;
+            st->stub_rules += w.rs.num;
+            if (add_stub(tree, w.slot) != 0) {
+                b->err = 1;
+            }
+        } else {
+            st->tree_node_num++;
+            /* the first leaf on the right keeps the share of the split */
+            child[0].splits = w.splits;
+            child[1].splits = real_rules(&child[0].rs) +
+                real_rules(&child[1].rs) - real_rules(&w.rs);
+            st->split_copies += child[1].splits;
+            row[0]++;
+        }
+        /* the left child is built first */
+        for (i = ret - 1; i >= 0; i--) {
+            if (b->err || push_work(b, &child[i]) != 0) {
+                b->err = 1;
+                drop_work(tree, &child[i]);
+            }
+        }
+        drop_work(tree, &w);
+        pthread_cond_broadcast(&b->cond);
     }
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
 
-    cleanup_hs_tree(node->child[0]);
-    SAFE_FREE(node->child[0]);
+    return NULL;
+}
+
+/*
+ * build the subtree of a node from the rules in its region, the instance
+ * stays within limit bytes
+ */
+static int build_hs_tree(const struct rule_set *rs, struct hs_node *cur_node,
+        int depth, struct hs_tree *tree, const struct trace *sample,
+        int lazy_depth, int threads, size_t limit)
+{
+    struct hs_builder b;
+    struct hs_work w = {*rs, cur_node, depth, 0, NULL, 0, NULL, 0};
+    pthread_t *tids = NULL;
+    int i, num = 0;
+
+    bzero(&b, sizeof(b));
+    b.tree = tree;
+    b.limit = limit;
+    b.sample = sample;
+    b.lazy_depth = lazy_depth > 0 ? lazy_depth : INT_MAX;
+    b.reserved = leaf_bytes(&b, rs->num);
+
+    /* the whole sample is inside the region of the root */
+    if (sample != NULL && sample->num > 0) {
+        w.pkts = malloc(sample->num * sizeof(*w.pkts));
+        for (i = 0; w.pkts != NULL && i < sample->num; i++) {
+            w.pkts[i] = i;
+        }
+        w.pkt_num = w.pkts ? sample->num : 0;
+    }
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.cond, NULL);
+
+    /* the subtree must fit as a bucket at least */
+    if (limit && tree->mem_used + b.reserved > limit) {
+        tree->over_budget = 1;
+        b.err = 1;
+    } else if (push_work(&b, &w) != 0) {
+        b.err = 1;
+    } else {
+        if (threads > 1) {
+            tids = malloc((threads - 1) * sizeof(*tids));
+        }
+        for (num = 0; tids != NULL && num < threads - 1; num++) {
+            if (pthread_create(&tids[num], NULL, hs_worker, &b) != 0) {
+                break;
+            }
+        }
+        hs_worker(&b);
+        for (i = 0; i < num; i++) {
+            pthread_join(tids[i], NULL);
+        }
+        SAFE_FREE(tids);
+    }
 
-    cleanup_hs_tree(node->child[1]);
-    SAFE_FREE(node->child[1]);
+    while (b.top > 0) {
+        drop_work(tree, &b.stack[--b.top]);
+    }
+    SAFE_FREE(w.pkts);
+    SAFE_FREE(b.stack);
+    pthread_cond_destroy(&b.cond);
+    pthread_mutex_destroy(&b.lock);
 
-    return;
+    return b.err ? -1 : 0;
 }
 
-static void printf_stats_nodes()
+/* what a leaf or a stub holds besides the node */
+static void free_leaf(struct hs_node *leaf)
 {
-    int i;
+    if (leaf->d2s == HS_BUCKET) {
+        SAFE_FREE(leaf->bucket);
+    } else if (leaf->d2s == HS_STUB) {
+        SAFE_FREE(leaf->stub->rules);
+        SAFE_FREE(leaf->stub->node);
+        SAFE_FREE(leaf->stub);
+    }
+}
 
-    /* depth statistics */
-    printf("\nworst_depth = %lu", g_statistics.worst_depth);
-    printf("\naverage_depth = %f", (float)g_statistics.average_depth /
-            g_statistics.leaf_node_num);
+static void cleanup_hs_tree(struct hs_node *root)
+{
+    struct hs_node **stack = NULL, **tmp, *node;
+    int top = 0, cap = 0, i;
 
-    /* node statistics */
-    printf("\ntree_node_num = %lu", g_statistics.tree_node_num);
-    printf("\nleaf_node_num = %lu", g_statistics.leaf_node_num);
-    printf("\ntotal_memory = %lu", (g_statistics.tree_node_num +
-        g_statistics.leaf_node_num) << 3);
+    if (root->d2s < 0) {
+        free_leaf(root);
+        return;
+    }
 
-    /* node statistics detail */
-    printf("\ndepth   node    intrnl  leaf\n");
-    for (i = 0; i <= g_statistics.worst_depth; i++) {
-        printf("%-8d%-8lu%-8lu%-8lu\n", i, g_statistics.depth_node[i][0] +
-            g_statistics.depth_node[i][1], g_statistics.depth_node[i][0],
-            g_statistics.depth_node[i][1]);
+    /* the nodes are freed when popped, the root stays */
+    for (node = root; node != NULL; node = top ? stack[--top] : NULL) {
+        if (node->d2s < 0) {
+            free_leaf(node);
+        } else {
+            if (top + 2 > cap) {
+                cap = cap ? cap << 1 : 64;
+                tmp = realloc(stack, cap * sizeof(*stack));
+                if (tmp == NULL) {
+                    break; /* leak the rest rather than crash */
+                }
+                stack = tmp;
+            }
+            for (i = 0; i < 2; i++) {
+                if (node->child[i] != NULL) {
+                    stack[top++] = node->child[i];
+                }
+            }
+        }
+        if (node != root) {
+            free(node);
+        }
     }
-    printf("\n");
 
+    SAFE_FREE(stack);
     return;
 }
 
-int hs_build(const struct rule_set *rs, void *userdata)
+static int rule_pri_cmp(const void *a, const void *b)
 {
-    int i;
-    struct hs_node *root = calloc(1, sizeof(*root));
+    return ((const struct rng_rule *)a)->pri - ((const struct rng_rule *)b)->pri;
+}
 
-    if (root == NULL || rs->r_rules == NULL) {
-        return -1;
-    }
+static void full_region(struct rng_rule *r)
+{
+    bzero(r, sizeof(*r));
+    r->dim[DIM_SIP][1].u32 = (1UL << 32) - 1;
+    r->dim[DIM_DIP][1].u32 = (1UL << 32) - 1;
+    r->dim[DIM_SPORT][1].u16 = (1U << 16) - 1;
+    r->dim[DIM_DPORT][1].u16 = (1U << 16) - 1;
+    r->dim[DIM_PROTO][1].u8 = 255;
+    r->pri = -1;
+}
 
-    g_statistics.segment_total = 1;
+static int is_overlap(struct rng_rule *a, struct rng_rule *b)
+{
+    int i;
 
-    if (build_hs_tree(rs, root, 0) == 0) {
-        /* rule_set statistics */
-        printf("\nsegment_num = ");
-        for (i = 0; i < DIM_MAX; i++) {
-            printf("%lu ", g_statistics.segment_num[i]);
+    for (i = 0; i < DIM_MAX; i++) {
+        if (is_greater(&a->dim[i][0], &b->dim[i][1]) ||
+            is_less(&a->dim[i][1], &b->dim[i][0])) {
+            return 0;
         }
-        printf("\nsegment_total = %lu", g_statistics.segment_total);
+    }
+
+    return 1;
+}
 
-        printf_stats_nodes();
+/* keep the rule list sorted by priority, equal priorities by arrival */
+/* room for num live rules, under a budget they grow by a sixteenth */
+static int hs_rules_grow(struct hs_tree *tree, int num)
+{
+    struct rng_rule *rules;
+    int cap = tree->rule_cap;
 
-        *(struct hs_node **) userdata = root;
+    while (cap < num) {
+        cap = hs_cfg.mem_budget ? cap + cap / 16 + 1 : cap << 1;
+    }
+    if (cap == tree->rule_cap) {
         return 0;
-    } else {
-        *(struct hs_node **) userdata = NULL;
+    }
+
+    rules = realloc(tree->rules, cap * sizeof(*rules));
+    if (rules == NULL) {
         return -1;
     }
+    tree->rules = rules;
+    tree->mem_used += (cap - tree->rule_cap) * sizeof(*rules);
+    tree->rule_cap = cap;
+
+    return 0;
 }
 
-int hs_insrt_rule(struct rng_rule *p_r, void *userdata)
+static int hs_rules_add(struct hs_tree *tree, const struct rng_rule *r)
 {
-    struct hs_node *p_tnode = *(typeof(p_tnode) *)userdata;
-    struct s_node *p_sn = NULL, *p_tmp_sn = NULL;
-    struct s_head *p_sh = malloc(sizeof *p_sh);
-    int i;
+    int lo = 0, hi = tree->rule_num, mid;
 
-    STAILQ_INIT(p_sh);
+    if (hs_rules_grow(tree, tree->rule_num + 1) != 0) {
+        return -1;
+    }
+
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (tree->rules[mid].pri <= r->pri) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    memmove(&tree->rules[lo + 1], &tree->rules[lo],
+            (tree->rule_num - lo) * sizeof(*tree->rules));
+    tree->rules[lo] = *r;
+    tree->rule_num++;
+
+    return 0;
+}
+
+/* merge a sorted batch into the rule list from the back, in one pass */
+static int hs_rules_merge(struct hs_tree *tree, const struct rng_rule *batch,
+        int num)
+{
+    int i, j, k;
+
+    if (hs_rules_grow(tree, tree->rule_num + num) != 0) {
+        return -1;
+    }
+
+    i = tree->rule_num - 1;
+    j = num - 1;
+    for (k = tree->rule_num + num - 1; j >= 0; k--) {
+        if (i >= 0 && tree->rules[i].pri > batch[j].pri) {
+            tree->rules[k] = tree->rules[i--];
+        } else {
+            tree->rules[k] = batch[j--];
+        }
+    }
+    tree->rule_num += num;
+
+    return 0;
+}
+
+static int hs_rules_del(struct hs_tree *tree, const struct rng_rule *r)
+{
+    int i;
+
+    for (i = 0; i < tree->rule_num; i++) {
+        if (tree->rules[i].pri == r->pri &&
+            memcmp(tree->rules[i].dim, r->dim, sizeof(r->dim)) == 0) {
+            break;
+        }
+    }
+
+    if (i == tree->rule_num) {
+        return -1;
+    }
+
+    memmove(&tree->rules[i], &tree->rules[i + 1],
+            (tree->rule_num - i - 1) * sizeof(*tree->rules));
+    tree->rule_num--;
+
+    return 0;
+}
+
+/* keep the bucket in priority order, the no-match region rule stays last */
+static int bucket_add(struct hs_tree *tree, struct hs_node *leaf,
+        const struct rng_rule *r)
+{
+    struct hs_bucket *bkt;
+    int i;
+
+    if (hs_cfg.mem_budget && tree->mem_used + sizeof(*r) > hs_cfg.mem_budget) {
+        tree->over_budget = 1;
+        return -1;
+    }
+
+    bkt = realloc(leaf->bucket, bucket_bytes(leaf->bucket->num + 1));
+    if (bkt == NULL) {
+        return -1;
+    }
+    leaf->bucket = bkt;
+    tree->mem_used += sizeof(*r);
+
+    for (i = bkt->num; i > 0 && (bkt->rules[i - 1].pri == -1 ||
+                bkt->rules[i - 1].pri > r->pri); i--) {
+        bkt->rules[i] = bkt->rules[i - 1];
+    }
+    bkt->rules[i] = *r;
+    bkt->num++;
+    tree->st.bucket_rules++;
+    tree->st.rule_copies++;
+
+    return 0;
+}
+
+/* first match of rules kept in priority order */
+static int rules_match(const struct rng_rule *rules, int num,
+        const struct packet *pkt)
+{
+    int i, d;
+
+    for (i = 0; i < num; i++) {
+        for (d = 0; d < DIM_MAX; d++) {
+            if (pkt->val[d].u32 < rules[i].dim[d][0].u32 ||
+                pkt->val[d].u32 > rules[i].dim[d][1].u32) {
+                break;
+            }
+        }
+        if (d == DIM_MAX) {
+            return rules[i].pri;
+        }
+    }
+
+    return -1;
+}
+
+static int bucket_match(const struct hs_bucket *bkt, const struct packet *pkt)
+{
+    return rules_match(bkt->rules, bkt->num, pkt);
+}
+
+/* every match of rules kept in priority order, the first max are stored */
+static int rules_all(const struct rng_rule *rules, int num,
+        const struct packet *pkt, int *pri, int max)
+{
+    int i, d, n = 0;
+
+    for (i = 0; i < num && rules[i].pri != -1; i++) {
+        for (d = 0; d < DIM_MAX; d++) {
+            if (pkt->val[d].u32 < rules[i].dim[d][0].u32 ||
+                pkt->val[d].u32 > rules[i].dim[d][1].u32) {
+                break;
+            }
+        }
+        if (d == DIM_MAX) {
+            if (n < max) {
+                pri[n] = rules[i].pri;
+            }
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static int leaf_has_pri(const struct hs_node *leaf, int pri)
+{
+    int i;
+
+    if (leaf->d2s != HS_BUCKET) {
+        return (int)leaf->thresh.u32 == pri;
+    }
+
+    for (i = 0; i < leaf->bucket->num; i++) {
+        if (leaf->bucket->rules[i].pri == pri) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+struct dag_frame {
+    struct hs_node *node;
+    struct hs_node **slot;  /* where the parent points to node */
+    int expanded;
+};
+
+/* height of every node below, the subtree counts as freshly built */
+static int set_heights(struct hs_node *root)
+{
+    struct dag_frame *stack = NULL, *tmp, f;
+    struct hs_node *node;
+    int top = 0, cap = 0, h;
+
+    for (f = (struct dag_frame){root, NULL, 0}; ; f = stack[--top]) {
+        node = f.node;
+        if (node->d2s >= 0 && !f.expanded) {
+            if (top + 3 > cap) {
+                cap = cap ? cap << 1 : 64;
+                tmp = realloc(stack, cap * sizeof(*stack));
+                if (tmp == NULL) {
+                    SAFE_FREE(stack);
+                    return -1;
+                }
+                stack = tmp;
+            }
+            stack[top++] = (struct dag_frame){node, NULL, 1};
+            stack[top++] = (struct dag_frame){node->child[1], NULL, 0};
+            stack[top++] = (struct dag_frame){node->child[0], NULL, 0};
+            continue;
+        }
+
+        h = 0;
+        if (node->d2s >= 0) {
+            h = 1 + (node->child[0]->height > node->child[1]->height ?
+                    node->child[0]->height : node->child[1]->height);
+        }
+        node->height = node->base = h < HS_HEIGHT_MAX ? h : HS_HEIGHT_MAX;
+        if (top == 0) {
+            break;
+        }
+    }
+
+    SAFE_FREE(stack);
+    return 0;
+}
+
+/*
+ * The split copies of a node are the share of the first leaf of its right
+ * subtree, so the first leaf of a subtree holds the shares of the nodes above
+ * it and the other leaves those of the nodes inside it.
+ */
+static void owe_splits(struct hs_node *node, uint32_t splits)
+{
+    while (node->d2s >= 0) {
+        node = node->child[0];
+    }
+    if (node->d2s == -1) {
+        node->splits += splits;
+    } else if (node->d2s == HS_BUCKET) {
+        node->bucket->splits += splits;
+    } else {
+        node->stub->splits += splits;
+    }
+}
+
+/*
+ * free the nodes below a node and take them out of the statistics, the share
+ * of the split copies above it is returned for the new subtree
+ */
+static uint32_t release_subtree(struct hs_tree *tree, struct hs_node *root)
+{
+    struct hs_statistics *st = &tree->st;
+    struct hs_node **stack = NULL, **tmp, *node, *first;
+    int top = 0, cap = 0;
+    uint32_t above = 0, splits;
+
+    for (first = root; first->d2s >= 0; first = first->child[0]);
+
+    for (node = root; node != NULL; node = top ? stack[--top] : NULL) {
+        if (node->d2s >= 0) {
+            st->tree_node_num--;
+            st->depth_node[node->depth][0]--;
+            if (top + 2 > cap) {
+                cap = cap ? cap << 1 : 64;
+                tmp = realloc(stack, cap * sizeof(*stack));
+                if (tmp == NULL) {
+                    break; /* leak the rest rather than crash */
+                }
+                stack = tmp;
+            }
+            stack[top++] = node->child[0];
+            stack[top++] = node->child[1];
+        } else {
+            st->leaf_node_num--;
+            st->depth_node[node->depth][1]--;
+            st->average_depth -= node->depth;
+            splits = 0;
+            if (node->d2s == -1) {
+                st->rule_copies -= node->copies;
+                splits = node->splits;
+            } else if (node->d2s == HS_BUCKET) {
+                st->rule_copies -= node->bucket->num -
+                    (node->bucket->num &&
+                     node->bucket->rules[node->bucket->num - 1].pri == -1);
+                splits = node->bucket->splits;
+                st->bucket_num--;
+                st->bucket_rules -= node->bucket->num;
+                tree->mem_used -= bucket_bytes(node->bucket->num);
+                SAFE_FREE(node->bucket);
+            }
+            if (node == first) {
+                above = splits;
+            } else {
+                st->split_copies -= splits;
+            }
+        }
+        if (node != root) {
+            tree->mem_used -= sizeof(*node);
+            free(node);
+        }
+    }
+
+    SAFE_FREE(stack);
+    root->d2s = -1;
+    root->child[0] = root->child[1] = NULL;
+    return above;
+}
+
+static void clip_rule(struct rng_rule *r, struct rng_rule *region)
+{
+    int d;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (is_less(&r->dim[d][0], &region->dim[d][0])) {
+            r->dim[d][0] = region->dim[d][0];
+        }
+        if (is_greater(&r->dim[d][1], &region->dim[d][1])) {
+            r->dim[d][1] = region->dim[d][1];
+        }
+    }
+}
+
+/* replace the subtree of a node by one built from rules inside its region */
+static int rebuild_rules(struct hs_tree *tree, struct hs_node *node,
+        const struct rule_set *sub, size_t limit)
+{
+    uint32_t above;
+    int ret;
+
+    /* the old subtree is replaced by the new one */
+    above = release_subtree(tree, node);
+
+    ret = build_hs_tree(sub, node, node->depth, tree, NULL, 0, hs_cfg.threads,
+            limit);
+    if (ret == 0) {
+        owe_splits(node, above);
+        ret = set_heights(node);
+    }
+
+    return ret;
+}
+
+/*
+ * rebuild a subtree from the live rules inside its region, the region itself
+ * is appended as a no-match rule so uncovered space still returns -1
+ */
+static int rebuild_subtree(struct hs_tree *tree, struct hs_node *node,
+        struct rng_rule *region, size_t limit)
+{
+    int i, ret;
+    struct rule_set sub;
+
+    sub.p_rules = NULL;
+    sub.r_rules = malloc((tree->rule_num + 1) * sizeof(*sub.r_rules));
+    if (sub.r_rules == NULL) {
+        return -1;
+    }
+    prof_alloc(tree->prof, (tree->rule_num + 1) * sizeof(*sub.r_rules));
+
+    for (i = 0, sub.num = 0; i < tree->rule_num; i++) {
+        if (!is_overlap(&tree->rules[i], region)) {
+            continue;
+        }
+
+        sub.r_rules[sub.num] = tree->rules[i];
+        clip_rule(&sub.r_rules[sub.num++], region);
+    }
+
+    sub.r_rules[sub.num] = *region;
+    sub.r_rules[sub.num++].pri = -1;
+
+    ret = rebuild_rules(tree, node, &sub, limit);
+
+    SAFE_FREE(sub.r_rules);
+    prof_free(tree->prof, (tree->rule_num + 1) * sizeof(*sub.r_rules));
+    return ret;
+}
+
+/*
+ * Split a leaf the rule wins over along the rule's bounds, at most twice per
+ * dimension, the part inside the rule becomes a leaf of the rule
+ */
+static int split_leaf(struct hs_tree *tree, struct hs_node *leaf,
+        struct rng_rule *region, struct rng_rule *p_r)
+{
+    struct rng_rule r = *region;
+    struct hs_node *p_tnode;
+    struct hs_node *top;
+    uint32_t copies, splits;
+    int i;
+
+    /* the leaf splits at most twice per dimension */
+    if (depth_row(&tree->st, leaf->depth + 2 * DIM_MAX) == NULL) {
+        return -1;
+    }
+    /* near the budget, the leaf is rebuilt and may become a bucket */
+    if (hs_cfg.mem_budget && tree->mem_used + 4 * DIM_MAX *
+            sizeof(*leaf) > hs_cfg.mem_budget) {
+        return rebuild_subtree(tree, leaf, region, build_limit());
+    }
+    /* the rule copies go to the leaf of the rule, the splits to the first */
+    copies = leaf->copies;
+    splits = leaf->splits;
+    top = leaf;
+    /* in case that r is "in" p_r */
+    for (i = 0; i < DIM_MAX; i++) {
+        if (is_greater(&p_r->dim[i][0], &r.dim[i][0])) {
+            /* left */
+            p_tnode = calloc(1, sizeof *p_tnode);
+            p_tnode->d2s = -1;
+            p_tnode->depth = leaf->depth + 1;
+            p_tnode->thresh.u32 = leaf->thresh.u32;
+            leaf->child[0] = p_tnode;
+            /* right */
+            p_tnode = calloc(1, sizeof *p_tnode);
+            p_tnode->d2s = -1;
+            p_tnode->depth = leaf->depth + 1;
+            p_tnode->thresh.u32 = leaf->thresh.u32;
+            leaf->child[1] = p_tnode;
+            /* statistics */
+            tree->mem_used += 2 * sizeof(*p_tnode);
+            tree->st.tree_node_num++;
+            tree->st.leaf_node_num++;
+            tree->st.depth_node[leaf->depth][0]++;
+            tree->st.depth_node[leaf->depth][1]--;
+            tree->st.depth_node[p_tnode->depth][1] += 2;
+            tree->st.average_depth += 1 + p_tnode->depth;
+            if (tree->st.worst_depth < p_tnode->depth) {
+                tree->st.worst_depth = p_tnode->depth;
+            }
+            /* itself */
+            leaf->d2s = i;
+            leaf->height = HS_HEIGHT_DIRTY;
+            leaf->thresh = p_r->dim[i][0];
+            point_dec(&leaf->thresh);
+            //printf("d2s:%d; thresh:%u; left_pri:%u\n", i, leaf->thresh.u32, p_tnode->thresh.u32);
+            leaf = leaf->child[1];
+            r.dim[i][0] = p_r->dim[i][0];
+        }
+        if (is_less(&p_r->dim[i][1], &r.dim[i][1])) {
+            /* right */
+            p_tnode = calloc(1, sizeof *p_tnode);
+            p_tnode->d2s = -1;
+            p_tnode->depth = leaf->depth + 1;
+            p_tnode->thresh.u32 = leaf->thresh.u32;
+            leaf->child[1] = p_tnode;
+            /* left */
+            p_tnode = calloc(1, sizeof *p_tnode);
+            p_tnode->d2s = -1;
+            p_tnode->depth = leaf->depth + 1;
+            p_tnode->thresh.u32 = leaf->thresh.u32;
+            leaf->child[0] = p_tnode;
+            /* statistics */
+            tree->mem_used += 2 * sizeof(*p_tnode);
+            tree->st.tree_node_num++;
+            tree->st.leaf_node_num++;
+            tree->st.depth_node[leaf->depth][0]++;
+            tree->st.depth_node[leaf->depth][1]--;
+            tree->st.depth_node[p_tnode->depth][1] += 2;
+            tree->st.average_depth += 1 + p_tnode->depth;
+            if (tree->st.worst_depth < p_tnode->depth) {
+                tree->st.worst_depth = p_tnode->depth;
+            }
+            /* itself */
+            leaf->d2s = i;
+            leaf->height = HS_HEIGHT_DIRTY;
+            leaf->thresh = p_r->dim[i][1];
+            //printf("d2s:%d; thresh:%u; right_pri:%u\n", i, leaf->thresh.u32, p_tnode->thresh.u32);
+            leaf = leaf->child[0];
+        }
+    }
+    leaf->thresh.u32 = p_r->pri;
+    leaf->copies = copies;
+    if (top->d2s >= 0) {
+        owe_splits(top, splits);
+    }
+
+    return 0;
+}
+
+struct batch_frame {
+    struct hs_node *node;
+    struct rng_rule r;      /* region of the node */
+    int *idx;               /* batch rules overlapping the region */
+    int num;
+};
+
+/* insert a rule into the subtree of a node covering the region */
+static int insrt_below(struct hs_tree *tree, struct hs_node *node,
+        const struct rng_rule *region, struct rng_rule *p_r)
+{
+    struct s_node *p_sn = NULL, *p_tmp_sn = NULL;
+    struct s_head *p_sh = malloc(sizeof *p_sh);
+    int ret = 0;
+
+    STAILQ_INIT(p_sh);
     p_sn = calloc(1, sizeof *p_sn);
-    p_sn->r.dim[0][1].u32 = (1UL << 32) - 1;
-    p_sn->r.dim[1][1].u32 = (1UL << 32) - 1;
-    p_sn->r.dim[2][1].u16 = (1U << 16) - 1;
-    p_sn->r.dim[3][1].u16 = (1U << 16) - 1;
-    p_sn->r.dim[4][1].u8 = 255;
-    p_sn->p_tn = p_tnode;
+    p_sn->r = *region;
+    p_sn->p_tn = node;
     STAILQ_INSERT_HEAD(p_sh, p_sn, entry);
 
     while (!STAILQ_EMPTY(p_sh)) {
         p_sn = STAILQ_FIRST(p_sh);
         STAILQ_REMOVE_HEAD(p_sh, entry);
-        while (p_sn->p_tn->d2s != -1) {
+        while (p_sn->p_tn->d2s >= 0) {
+            p_sn->p_tn->height = HS_HEIGHT_DIRTY;
             if (is_less_equal(&p_r->dim[p_sn->p_tn->d2s][1], &p_sn->p_tn->thresh)) {
                 p_sn->r.dim[p_sn->p_tn->d2s][1] = p_sn->p_tn->thresh;
                 p_sn->p_tn = p_sn->p_tn->child[0];
@@ -430,134 +1482,1437 @@ int hs_insrt_rule(struct rng_rule *p_r, void *userdata)
                 p_sn->p_tn = p_sn->p_tn->child[0];
             }
         }
-        if (p_r->pri >= p_sn->p_tn->thresh.u32) {
+        if (p_sn->p_tn->d2s == HS_BUCKET) {
+            if (bucket_add(tree, p_sn->p_tn, p_r) != 0) {
+                ret = -1;
+            }
             SAFE_FREE(p_sn);
             continue;
         }
-        /* in case that p_sn->r is "in" p_r */
-        for (i = 0; i < DIM_MAX; i++) {
-            if (is_greater(&p_r->dim[i][0], &p_sn->r.dim[i][0])) {
-                /* left */
-                p_tnode = calloc(1, sizeof *p_tnode);
-                p_tnode->d2s = -1;
-                p_tnode->depth = p_sn->p_tn->depth + 1;
-                p_tnode->thresh.u32 = p_sn->p_tn->thresh.u32;
-                p_sn->p_tn->child[0] = p_tnode;
-                /* right */
-                p_tnode = calloc(1, sizeof *p_tnode);
-                p_tnode->d2s = -1;
-                p_tnode->depth = p_sn->p_tn->depth + 1;
-                p_tnode->thresh.u32 = p_sn->p_tn->thresh.u32;
-                p_sn->p_tn->child[1] = p_tnode;
-                /* g_statistics */
-                g_statistics.tree_node_num++;
-                g_statistics.leaf_node_num++;
-                g_statistics.depth_node[p_sn->p_tn->depth][0]++;
-                g_statistics.depth_node[p_sn->p_tn->depth][1]--;
-                g_statistics.depth_node[p_tnode->depth][1] += 2;
-                g_statistics.average_depth += 1 + p_tnode->depth;
-                if (g_statistics.worst_depth < p_tnode->depth) {
-                    g_statistics.worst_depth = p_tnode->depth;
-                }
-                /* itself */
-                p_sn->p_tn->d2s = i;
-                p_sn->p_tn->thresh = p_r->dim[i][0];
-                point_dec(&p_sn->p_tn->thresh);
-                //printf("d2s:%d; thresh:%u; left_pri:%u\n", i, p_sn->p_tn->thresh.u32, p_tnode->thresh.u32);
-                p_sn->p_tn = p_sn->p_tn->child[1];
-                p_sn->r.dim[i][0] = p_r->dim[i][0];
-            }
-            if (is_less(&p_r->dim[i][1], &p_sn->r.dim[i][1])) {
-                /* right */
-                p_tnode = calloc(1, sizeof *p_tnode);
-                p_tnode->d2s = -1;
-                p_tnode->depth = p_sn->p_tn->depth + 1;
-                p_tnode->thresh.u32 = p_sn->p_tn->thresh.u32;
-                p_sn->p_tn->child[1] = p_tnode;
-                /* left */
-                p_tnode = calloc(1, sizeof *p_tnode);
-                p_tnode->d2s = -1;
-                p_tnode->depth = p_sn->p_tn->depth + 1;
-                p_tnode->thresh.u32 = p_sn->p_tn->thresh.u32;
-                p_sn->p_tn->child[0] = p_tnode;
-                /* g_statistics */
-                g_statistics.tree_node_num++;
-                g_statistics.leaf_node_num++;
-                g_statistics.depth_node[p_sn->p_tn->depth][0]++;
-                g_statistics.depth_node[p_sn->p_tn->depth][1]--;
-                g_statistics.depth_node[p_tnode->depth][1] += 2;
-                g_statistics.average_depth += 1 + p_tnode->depth;
-                if (g_statistics.worst_depth < p_tnode->depth) {
-                    g_statistics.worst_depth = p_tnode->depth;
-                }
-                /* itself */
-                p_sn->p_tn->d2s = i;
-                p_sn->p_tn->thresh = p_r->dim[i][1];
-                //printf("d2s:%d; thresh:%u; right_pri:%u\n", i, p_sn->p_tn->thresh.u32, p_tnode->thresh.u32);
-                p_sn->p_tn = p_sn->p_tn->child[0];
+        /* lower priority rules are kept too, the leaf becomes a bucket */
+        if (tree->multi) {
+            if (rebuild_subtree(tree, p_sn->p_tn, &p_sn->r,
+                        build_limit()) != 0) {
+                ret = -1;
             }
+            SAFE_FREE(p_sn);
+            continue;
+        }
+        if (p_r->pri >= p_sn->p_tn->thresh.u32) {
+            SAFE_FREE(p_sn);
+            continue;
+        }
+        if (split_leaf(tree, p_sn->p_tn, &p_sn->r, p_r) != 0) {
+            ret = -1;
         }
-        p_sn->p_tn->thresh.u32 = p_r->pri;
         SAFE_FREE(p_sn);
     }
     SAFE_FREE(p_sh);
-    return 0;
+    return ret;
 }
 
-
-int hs_insrt_update(const struct rule_set *rs, void *userdata)
+/*
+ * The rules reaching a leaf are in the live ones already. A leaf more than
+ * one of them wins over is rebuilt once from these and its own rule, which
+ * covers its region, a single one splits it and a bucket takes them in.
+ */
+static int batch_leaf(struct hs_tree *tree, struct hs_node *leaf,
+        const struct rng_rule *region, struct rng_rule *rules,
+        const int *idx, int num)
 {
-    if (!*(void **) userdata || !rs->r_rules) return -1;
-    int i;
+    uint32_t pri = leaf->d2s == HS_BUCKET ? UINT32_MAX : leaf->thresh.u32;
+    struct rng_rule r = *region;
+    struct rule_set sub;
+    int i, win, ret = 0;
+
+    /* multi-match leaves keep the lower priority rules too */
+    if (tree->multi && leaf->d2s != HS_BUCKET) {
+        return rebuild_subtree(tree, leaf, &r, build_limit());
+    }
 
-    for (i = 0; i < rs->num; i++) {
-        if (hs_insrt_rule(&rs->r_rules[i], userdata) != 0) {
-            return -1;
+    /* the batch is sorted, the rest lose to the leaf */
+    for (win = 0; win < num && (uint32_t)rules[idx[win]].pri < pri; win++);
+
+    if (leaf->d2s == HS_BUCKET || win <= 1) {
+        for (i = 0; ret == 0 && i < win; i++) {
+            ret = insrt_below(tree, leaf, region, &rules[idx[i]]);
         }
+        return ret;
+    }
+
+    sub.p_rules = NULL;
+    sub.r_rules = malloc((win + 1) * sizeof(*sub.r_rules));
+    if (sub.r_rules == NULL) {
+        return -1;
+    }
+    prof_alloc(tree->prof, (win + 1) * sizeof(*sub.r_rules));
+
+    for (sub.num = 0; sub.num < win; sub.num++) {
+        sub.r_rules[sub.num] = rules[idx[sub.num]];
+        clip_rule(&sub.r_rules[sub.num], &r);
     }
+    /* a leaf of no rule keeps the region as a no-match rule */
+    sub.r_rules[sub.num] = r;
+    sub.r_rules[sub.num++].pri = (int)pri;
 
-    printf_stats_nodes();
+    ret = rebuild_rules(tree, leaf, &sub, build_limit());
 
-    return 0;
+    SAFE_FREE(sub.r_rules);
+    prof_free(tree->prof, (win + 1) * sizeof(*sub.r_rules));
+    return ret;
 }
 
-int hs_classify(const struct packet *pkt, const void *userdata)
+/*
+ * Insert a batch of rules in one walk: the batch is split at every node it
+ * passes and each leaf it reaches takes all its rules at once.
+ */
+static int hs_insrt_batch(struct hs_tree *tree, const struct rule_set *rs)
 {
-    struct hs_node *node = *(typeof(node) *)userdata;
+    struct batch_frame *stack = NULL, *tmp, f, c;
+    struct rng_rule *rules;
+    struct hs_node *node;
+    int top = 0, cap = 0, i, k, ret = 0;
+
+    rules = malloc(rs->num * sizeof(*rules));
+    f.idx = malloc(rs->num * sizeof(*f.idx));
+    if (rules == NULL || f.idx == NULL) {
+        SAFE_FREE(rules);
+        SAFE_FREE(f.idx);
+        return -1;
+    }
+    memcpy(rules, rs->r_rules, rs->num * sizeof(*rules));
+    qsort(rules, rs->num, sizeof(*rules), rule_pri_cmp);
+    if (hs_rules_merge(tree, rules, rs->num) != 0) {
+        SAFE_FREE(rules);
+        SAFE_FREE(f.idx);
+        return -1;
+    }
+    for (i = 0; i < rs->num; i++) {
+        f.idx[i] = i;
+    }
+    f.num = rs->num;
+    f.node = tree->root;
+    full_region(&f.r);
+
+    for (;;) {
+        node = f.node;
+        if (node->d2s < 0) {
+            if (ret == 0) {
+                ret = batch_leaf(tree, node, &f.r, rules, f.idx, f.num);
+            }
+        } else if (ret == 0) {
+            node->height = HS_HEIGHT_DIRTY;
+            if (top + 2 > cap) {
+                cap = cap ? cap << 1 : 64;
+                tmp = realloc(stack, cap * sizeof(*stack));
+                if (tmp == NULL) {
+                    ret = -1;
+                }
+                stack = tmp ? tmp : stack;
+            }
+            /* the right part first, the left one is walked next */
+            for (k = 1; ret == 0 && k >= 0; k--) {
+                c.node = node->child[k];
+                c.r = f.r;
+                if (k) {
+                    c.r.dim[node->d2s][0] = node->thresh;
+                    point_inc(&c.r.dim[node->d2s][0]);
+                } else {
+                    c.r.dim[node->d2s][1] = node->thresh;
+                }
+                c.idx = malloc(f.num * sizeof(*c.idx));
+                if (c.idx == NULL) {
+                    ret = -1;
+                    break;
+                }
+                for (i = c.num = 0; i < f.num; i++) {
+                    if (k ? is_greater(&rules[f.idx[i]].dim[node->d2s][1],
+                                &node->thresh) :
+                            is_less_equal(&rules[f.idx[i]].dim[node->d2s][0],
+                                &node->thresh)) {
+                        c.idx[c.num++] = f.idx[i];
+                    }
+                }
+                if (c.num > 0) {
+                    stack[top++] = c;
+                } else {
+                    SAFE_FREE(c.idx);
+                }
+            }
+        }
+        SAFE_FREE(f.idx);
 
-    while (node->child[0] != NULL || node->child[1] != NULL) {
-        //printf("d2s:%d; pkt->val[%d].u32:%u; node.thresh.u32:%u\n", node->d2s, node->d2s, pkt->val[node->d2s].u32, node->thresh.u32);
-        if (pkt->val[node->d2s].u32 <= node->thresh.u32) {
-            //printf("left\n");
-            node = node->child[0];
-        } else {
-            //printf("right\n");
-            node = node->child[1];
+        if (top == 0) {
+            break;
         }
+        f = stack[--top];
     }
 
-    return node->thresh.u32;
+    SAFE_FREE(stack);
+    SAFE_FREE(rules);
+    return ret;
 }
 
-int hs_search(const struct trace *t, const void *userdata)
+struct rebalance_frame {
+    struct hs_node *node;
+    struct rng_rule r;      /* region of the node */
+    int expanded;
+};
+
+/*
+ * Updates mark the nodes they pass as dirty. Their heights are recomputed
+ * bottom up and the lowest subtrees grown more than the slack over their
+ * built height are rebuilt from their rules, the rest of the tree is kept.
+ */
+static int hs_rebalance(struct hs_tree *tree)
 {
-    int i, c;
+    struct rebalance_frame *stack = NULL, *tmp, f;
+    struct hs_node *node;
+    int top = 0, cap = 0, i, h, ret = 0;
+
+    f.node = tree->root;
+    full_region(&f.r);
+    f.expanded = 0;
+
+    for (;;) {
+        node = f.node;
+        if (node->d2s >= 0 && node->height == HS_HEIGHT_DIRTY && !f.expanded) {
+            if (top + 3 > cap) {
+                cap = cap ? cap << 1 : 64;
+                tmp = realloc(stack, cap * sizeof(*stack));
+                if (tmp == NULL) {
+                    ret = -1;
+                    break;
+                }
+                stack = tmp;
+            }
+            f.expanded = 1;
+            stack[top++] = f;
+            for (i = 1; i >= 0; i--) {
+                stack[top] = f;
+                stack[top].node = node->child[i];
+                stack[top].expanded = 0;
+                if (i) {
+                    stack[top].r.dim[node->d2s][0] = node->thresh;
+                    point_inc(&stack[top].r.dim[node->d2s][0]);
+                } else {
+                    stack[top].r.dim[node->d2s][1] = node->thresh;
+                }
+                top++;
+            }
+        } else if (node->d2s >= 0 && f.expanded) {
+            h = 1 + (node->child[0]->height > node->child[1]->height ?
+                    node->child[0]->height : node->child[1]->height);
+            node->height = h < HS_HEIGHT_MAX ? h : HS_HEIGHT_MAX;
+            if (node->height > node->base + hs_cfg.rebalance_slack) {
+                if (rebuild_subtree(tree, node, &f.r, build_limit()) != 0) {
+                    ret = -1;
+                    break;
+                }
+                tree->st.rebalance_num++;
+            }
+        } else if (node->height == HS_HEIGHT_DIRTY) {
+            node->height = 0;
+        }
 
-    for (i = 0; i < t->num; i++) {
-        if ((c = hs_classify(&t->pkts[i], userdata)) != t->pkts[i].match) {
-            fprintf(stderr, "pkt[%d] match:%d, classify:%d\n", i+1, t->pkts[i].match+1, c+1);
-            return -1;
+        if (top == 0) {
+            break;
         }
+        f = stack[--top];
+    }
+    SAFE_FREE(stack);
+
+    /* rebuilt subtrees may be shallower */
+    for (i = tree->st.worst_depth; i > 0 && tree->st.depth_node[i][0] +
+            tree->st.depth_node[i][1] == 0; i--);
+    tree->st.worst_depth = i;
+
+    return ret;
+}
+
+/* the built heights are taken before the first update */
+static int hs_track_heights(struct hs_tree *tree)
+{
+    if (!hs_cfg.rebalance_slack || tree->height_ok) {
+        return 0;
+    }
+    if (set_heights(tree->root) != 0) {
+        return -1;
     }
+    tree->height_ok = 1;
 
     return 0;
 }
 
-void hs_cleanup(void *userdata)
+/*
+ * Build the subtree of a stub into its node and publish it through the slot,
+ * lookups that already hold the stub find the new node there. The stub is
+ * kept if the build fails. Called with the lazy lock held.
+ */
+static int expand_stub(struct hs_tree *tree, struct hs_node **slot)
 {
-    struct hs_node *rt = *(typeof(rt) *)userdata;
-    cleanup_hs_tree(rt);
-    SAFE_FREE(rt);
+    struct hs_node *stub_node = *slot, *node;
+    struct hs_stub *stub = stub_node->stub;
+    struct rule_set sub;
+
+    node = stub->node;
+    sub.num = stub->num;
+    sub.r_rules = stub->rules;
+    sub.p_rules = NULL;
+
+    /* the rules of the stub are handed to the build */
+    tree->mem_used -= stub_bytes(stub->num) - sizeof(*node);
+    if (build_hs_tree(&sub, node, stub_node->depth, tree, NULL, 0, 1,
+                build_limit()) != 0) {
+        cleanup_hs_tree(node);
+        bzero(node, sizeof(*node));
+        node->d2s = -1;
+        tree->mem_used += stub_bytes(stub->num) - sizeof(*node);
+        return -1;
+    }
+    owe_splits(node, stub->splits);
+    __atomic_store_n(slot, node, __ATOMIC_RELEASE);
+
+    tree->st.stub_num--;
+    tree->st.stub_rules -= stub->num;
+    SAFE_FREE(stub->rules);
+    SAFE_FREE(stub);
+    stub_node->child[0] = tree->retired;
+    tree->retired = stub_node;
+    tree->retired_num++;
+
+    return 0;
+}
+
+/* a lookup met a stub: build it, or match its rules if it cannot be built */
+static struct hs_node *lazy_lookup(struct hs_tree *tree,
+        struct hs_node **slot, const struct packet *pkt, int *pri)
+{
+    struct hs_node *node;
+
+    pthread_mutex_lock(&tree->lazy_lock);
+    if ((*slot)->d2s == HS_STUB) {
+        expand_stub(tree, slot);
+    }
+    node = *slot;
+    if (node->d2s == HS_STUB) {
+        *pri = rules_match(node->stub->rules, node->stub->num, pkt);
+        node = NULL;
+    }
+    pthread_mutex_unlock(&tree->lazy_lock);
+
+    return node;
+}
+
+static void *hs_lazy_worker(void *arg)
+{
+    struct hs_tree *tree = arg;
+    int i;
+
+    for (i = 0; i < tree->slot_num; i++) {
+        pthread_mutex_lock(&tree->lazy_lock);
+        if (tree->lazy_stop) {
+            pthread_mutex_unlock(&tree->lazy_lock);
+            break;
+        }
+        if ((*tree->stubs[i])->d2s == HS_STUB) {
+            expand_stub(tree, tree->stubs[i]);
+        }
+        pthread_mutex_unlock(&tree->lazy_lock);
+    }
+
+    return NULL;
+}
+
+/* stop the background builder and build every stub left */
+int hs_expand_all(struct hs_tree *tree)
+{
+    int i, ret = 0;
+
+    if (tree->lazy_run) {
+        pthread_mutex_lock(&tree->lazy_lock);
+        tree->lazy_stop = 1;
+        pthread_mutex_unlock(&tree->lazy_lock);
+        pthread_join(tree->lazy_tid, NULL);
+        tree->lazy_run = 0;
+    }
+
+    pthread_mutex_lock(&tree->lazy_lock);
+    for (i = 0; i < tree->slot_num; i++) {
+        if ((*tree->stubs[i])->d2s == HS_STUB &&
+            expand_stub(tree, tree->stubs[i]) != 0) {
+            ret = -1;
+        }
+    }
+    /* the slots are not followed once updates may free their nodes */
+    if (ret == 0) {
+        tree->mem_used -= tree->slot_cap * sizeof(*tree->stubs);
+        SAFE_FREE(tree->stubs);
+        tree->slot_num = tree->slot_cap = 0;
+    }
+    pthread_mutex_unlock(&tree->lazy_lock);
+
+    return ret;
+}
+
+/* node identity for hash-consing, the depth is not part of it */
+struct dag_key {
+    int d2s;
+    uint32_t thresh;
+    void *child[2];     /* canonical children, the bucket of a bucket leaf */
+};
+
+struct dag_entry {
+    struct dag_key key;
+    struct hs_node *node;
+    UT_hash_handle hh;
+};
+
+/*
+ * Share identical subtrees bottom up: a node whose split and canonical
+ * children were already seen is replaced by the first one and freed.
+ * Bucket leaves are never shared. The unique nodes are kept for cleanup.
+ */
+static int hs_compress(struct hs_tree *tree)
+{
+    size_t total = tree->st.tree_node_num + tree->st.leaf_node_num;
+    struct dag_entry *entries, *table = NULL, *e;
+    struct dag_frame *stack, f;
+    struct dag_key key;
+    int top = 0, num = 0;
+    void *p;
+
+    entries = malloc(total * sizeof(*entries));
+    /* a frame per node on the path and one per pending sibling */
+    stack = malloc(2 * (tree->st.worst_depth + 2) * sizeof(*stack));
+    tree->dag_nodes = malloc(total * sizeof(*tree->dag_nodes));
+    if (entries == NULL || stack == NULL || tree->dag_nodes == NULL) {
+        SAFE_FREE(entries);
+        SAFE_FREE(stack);
+        SAFE_FREE(tree->dag_nodes);
+        return -1;
+    }
+
+    stack[top++] = (struct dag_frame){tree->root, &tree->root, 0};
+
+    while (top > 0) {
+        f = stack[--top];
+
+        if (f.node->d2s >= 0 && !f.expanded) {
+            stack[top++] = (struct dag_frame){f.node, f.slot, 1};
+            stack[top++] = (struct dag_frame){f.node->child[1], &f.node->child[1], 0};
+            stack[top++] = (struct dag_frame){f.node->child[0], &f.node->child[0], 0};
+            continue;
+        }
+
+        bzero(&key, sizeof(key));
+        key.d2s = f.node->d2s;
+        key.thresh = f.node->thresh.u32;
+        if (f.node->d2s != -1) {
+            key.child[0] = f.node->child[0];
+            key.child[1] = f.node->d2s >= 0 ? f.node->child[1] : NULL;
+        }
+
+        HASH_FIND(hh, table, &key, sizeof(key), e);
+        if (e != NULL) {
+            *f.slot = e->node;
+            free(f.node);
+            tree->mem_used -= sizeof(struct hs_node);
+            continue;
+        }
+
+        e = &entries[num];
+        e->key = key;
+        e->node = f.node;
+        HASH_ADD(hh, table, key, sizeof(key), e);
+        tree->dag_nodes[num++] = f.node;
+        if (f.node->d2s >= 0) {
+            tree->st.dag_node_num++;
+        } else {
+            tree->st.dag_leaf_num++;
+        }
+    }
+
+    HASH_CLEAR(hh, table);
+    SAFE_FREE(entries);
+    SAFE_FREE(stack);
+    tree->dag_num = num;
+    p = realloc(tree->dag_nodes, num * sizeof(*tree->dag_nodes));
+    if (p != NULL) {
+        tree->dag_nodes = p;
+    }
+    tree->mem_used += num * sizeof(*tree->dag_nodes);
+
+    return 0;
+}
+
+static size_t flat_bytes(const struct hs_tree *tree)
+{
+    size_t bytes = tree->flat_num * sizeof(*tree->flat) +
+        tree->flat_bkt_num * sizeof(*tree->flat_bkt);
+
+    if (tree->top != NULL) {
+        bytes += (1ul << tree->top_levels) *
+            (sizeof(*tree->top) + sizeof(*tree->top_exit));
+    }
+
+    return bytes;
+}
+
+/*
+ * Take the num entries of flat as the compact array, moved to the memory
+ * of hs_cfg.flat_alloc if set. flat is freed if the move fails.
+ */
+static int place_flat(struct hs_tree *tree, struct hs_flat *flat, uint32_t num)
+{
+    tree->flat = flat;
+    tree->flat_free = free;
+    if (hs_cfg.flat_alloc == NULL) {
+        return 0;
+    }
+
+    tree->flat = hs_cfg.flat_alloc(num * sizeof(*flat));
+    if (tree->flat != NULL) {
+        memcpy(tree->flat, flat, num * sizeof(*flat));
+        tree->flat_free = hs_cfg.flat_free;
+    }
+    free(flat);
+    return tree->flat != NULL ? 0 : -1;
+}
+
+static void drop_flat(struct hs_tree *tree)
+{
+    if (tree->flat != NULL) {
+        tree->flat_free(tree->flat);
+        tree->flat = NULL;
+    }
+}
+
+static void hs_unflatten(struct hs_tree *tree)
+{
+    tree->mem_used -= flat_bytes(tree);
+    drop_flat(tree);
+    SAFE_FREE(tree->flat_bkt);
+    SAFE_FREE(tree->top);
+    SAFE_FREE(tree->top_exit);
+    tree->flat_num = tree->flat_bkt_num = tree->top_levels = 0;
+}
+
+/* lay the compact subtree of node i out implicitly from top node j */
+static void fill_top(struct hs_tree *tree, uint32_t j, int depth, uint32_t i)
+{
+    const struct hs_flat *f = &tree->flat[i];
+    uint32_t left, right;
+
+    if (depth == tree->top_levels) {
+        tree->top_exit[j - (1u << depth)] = i;
+        return;
+    }
+
+    if ((f->info & HS_FLAT_TAG) < DIM_MAX) {
+        tree->top[j] = (struct hs_flat){f->thresh, f->info & HS_FLAT_TAG};
+        left = f->info >> 3;
+        right = left + 1;
+    } else {
+        /* no value is greater, the leaf is reached at the last level */
+        tree->top[j] = (struct hs_flat){UINT32_MAX, DIM_SIP};
+        left = right = i;
+    }
+    fill_top(tree, 2 * j, depth + 1, left);
+    fill_top(tree, 2 * j + 1, depth + 1, right);
+}
+
+/* the top levels of the compact tree, no deeper than its leaves */
+static int hs_flatten_top(struct hs_tree *tree)
+{
+    int levels = hs_cfg.flat_top;
+
+    if (levels > (int)tree->st.worst_depth) {
+        levels = tree->st.worst_depth;
+    }
+    if (levels > HS_TOP_MAX) {
+        levels = HS_TOP_MAX;
+    }
+    if (levels <= 0) {
+        return 0;
+    }
+
+    tree->top = aligned_alloc(CACHE_LINE_SIZE, ALIGN((1ul << levels) *
+                sizeof(*tree->top), CACHE_LINE_SIZE));
+    tree->top_exit = malloc((1ul << levels) * sizeof(*tree->top_exit));
+    if (tree->top == NULL || tree->top_exit == NULL) {
+        SAFE_FREE(tree->top);
+        SAFE_FREE(tree->top_exit);
+        return -1;
+    }
+    tree->top[0] = (struct hs_flat){0, 0};
+    tree->top_levels = levels;
+    fill_top(tree, 1, 0, 0);
+    tree->mem_used += (1ul << levels) *
+        (sizeof(*tree->top) + sizeof(*tree->top_exit));
+
+    return 0;
+}
+
+/*
+ * Copy the tree breadth first into the compact array, the children of a
+ * node are taken in pairs from the end. The node of each compact entry is
+ * queued at the same index. Stubs must be built first.
+ */
+static int hs_flatten(struct hs_tree *tree)
+{
+    struct hs_node **queue, *node;
+    struct hs_flat *flat;
+    uint32_t i, num = 1, cap, bkt_cap = 0;
+    void *p;
+
+    hs_unflatten(tree);
+
+    cap = 2 * tree->st.tree_node_num + 1;
+    queue = malloc(cap * sizeof(*queue));
+    flat = malloc(cap * sizeof(*flat));
+    if (queue == NULL || flat == NULL) {
+        goto err;
+    }
+    queue[0] = tree->root;
+
+    for (i = 0; i < num; i++) {
+        node = queue[i];
+        if (node->d2s >= 0) {
+            if (num + 2 > cap) {
+                /* the node counters are behind, grow */
+                if (cap >= HS_FLAT_MAX / 2) {
+                    goto err;
+                }
+                cap *= 2;
+                if ((p = realloc(queue, cap * sizeof(*queue))) == NULL) {
+                    goto err;
+                }
+                queue = p;
+                if ((p = realloc(flat, cap * sizeof(*flat))) == NULL) {
+                    goto err;
+                }
+                flat = p;
+            }
+            flat[i].thresh = node->thresh.u32;
+            flat[i].info = num << 3 | node->d2s;
+            queue[num++] = node->child[0];
+            queue[num++] = node->child[1];
+        } else if (node->d2s == HS_BUCKET) {
+            if (tree->flat_bkt_num == bkt_cap) {
+                bkt_cap = bkt_cap ? 2 * bkt_cap : 64;
+                p = realloc(tree->flat_bkt, bkt_cap * sizeof(*tree->flat_bkt));
+                if (p == NULL) {
+                    goto err;
+                }
+                tree->flat_bkt = p;
+            }
+            flat[i].thresh = tree->flat_bkt_num;
+            flat[i].info = i << 3 | HS_FLAT_BUCKET;
+            tree->flat_bkt[tree->flat_bkt_num++] = node->bucket;
+        } else if (node->d2s == -1) {
+            flat[i].thresh = node->thresh.u32;
+            flat[i].info = i << 3 | HS_FLAT_LEAF;
+        } else {
+            goto err;
+        }
+    }
+
+    SAFE_FREE(queue);
+    /* the copy is charged as it is counted, no spare entries */
+    if ((p = realloc(flat, num * sizeof(*flat))) != NULL) {
+        flat = p;
+    }
+    if (tree->flat_bkt_num > 0 && (p = realloc(tree->flat_bkt,
+                    tree->flat_bkt_num * sizeof(*tree->flat_bkt))) != NULL) {
+        tree->flat_bkt = p;
+    }
+    if (place_flat(tree, flat, num) != 0) {
+        SAFE_FREE(tree->flat_bkt);
+        tree->flat_bkt_num = 0;
+        return -1;
+    }
+    tree->flat_num = num;
+    tree->mem_used += flat_bytes(tree);
+
+    if (hs_flatten_top(tree) != 0) {
+        hs_unflatten(tree);
+        return -1;
+    }
+    if (hs_cfg.mem_budget && tree->mem_used > hs_cfg.mem_budget) {
+        hs_unflatten(tree);
+        tree->over_budget = 1;
+        return -1;
+    }
+
+    return 0;
+
+err:
+    SAFE_FREE(queue);
+    SAFE_FREE(flat);
+    SAFE_FREE(tree->flat_bkt);
+    tree->flat_bkt_num = 0;
+    return -1;
+}
+
+/* the compact copy is dropped during an update and redone after it */
+static int hs_reflatten(struct hs_tree *tree, int ret)
+{
+    /* the copy is left out quietly when only the budget is short */
+    if (ret == 0 && hs_cfg.flat && hs_flatten(tree) != 0 && !tree->over_budget) {
+        fprintf(stderr, "Cannot copy the tree to compact nodes, left as it is\n");
+    }
+    return ret;
+}
+
+int hs_build(const struct rule_set *rs, void *userdata)
+{
+    struct hs_tree *tree;
+
+    if (rs->r_rules == NULL || rs->num <= 0) {
+        return -1;
+    }
+
+    tree = calloc(1, sizeof(*tree));
+    if (tree == NULL) {
+        return -1;
+    }
+
+    tree->root = calloc(1, sizeof(*tree->root));
+    tree->rules = malloc(rs->num * sizeof(*tree->rules));
+    if (tree->root == NULL || tree->rules == NULL) {
+        SAFE_FREE(tree->root);
+        SAFE_FREE(tree->rules);
+        SAFE_FREE(tree);
+        return -1;
+    }
+
+    memcpy(tree->rules, rs->r_rules, rs->num * sizeof(*tree->rules));
+    qsort(tree->rules, rs->num, sizeof(*tree->rules), rule_pri_cmp);
+    tree->rule_num = tree->rule_cap = rs->num;
+
+    tree->st.segment_total = 1;
+    tree->mem_used = sizeof(*tree) + tree->rule_cap * sizeof(*tree->rules) +
+        sizeof(*tree->root);
+    tree->multi = hs_cfg.multi;
+    tree->prof = prof_create(HS_PROF_NUM, hs_prof_phase,
+            HS_DEPTH_LIMIT + 1);
+
+    pthread_mutex_init(&tree->lazy_lock, NULL);
+
+    if (build_hs_tree(rs, tree->root, 0, tree, hs_cfg.sample,
+                hs_cfg.lazy_depth, hs_cfg.threads, build_limit()) == 0) {
+        if (hs_cfg.dag) {
+            if (hs_expand_all(tree) != 0 || hs_compress(tree) != 0) {
+                fprintf(stderr, "Cannot compress the tree, left as it is\n");
+            }
+        } else if (hs_cfg.flat) {
+            if (hs_expand_all(tree) != 0 || hs_flatten(tree) != 0) {
+                fprintf(stderr, "Cannot copy the tree to compact nodes, left as it is\n");
+            }
+        } else if (hs_cfg.lazy_bg && tree->slot_num > 0) {
+            tree->lazy_run = !pthread_create(&tree->lazy_tid, NULL,
+                    hs_lazy_worker, tree);
+        }
+        *(struct hs_tree **) userdata = tree;
+        return 0;
+    } else {
+        if (tree->over_budget) {
+            fprintf(stderr, "Memory budget %lu bytes exceeded\n",
+                    hs_cfg.mem_budget);
+        }
+        /* the nodes built so far go with the tree */
+        hs_cleanup(&tree);
+        *(struct hs_tree **) userdata = NULL;
+        return -1;
+    }
+}
+
+/*
+ * An update that does not fit the budget may have left some leaves behind,
+ * the tree is built again from the live rules within the build share, with
+ * buckets in place of the subtrees that do not fit.
+ */
+static int hs_refit(struct hs_tree *tree)
+{
+    struct hs_statistics *st = &tree->st;
+    struct rng_rule region;
+
+    if (!tree->over_budget) {
+        return -1;
+    }
+    tree->over_budget = 0;
+
+    /* a failed update may have left the counters off, they start over */
+    release_subtree(tree, tree->root);
+    st->tree_node_num = st->bucket_num = st->bucket_rules = 0;
+    st->rule_copies = st->split_copies = 0;
+    st->average_depth = st->worst_depth = 0;
+    bzero(st->depth_node, st->depth_cap * sizeof(*st->depth_node));
+    st->leaf_node_num = st->depth_node[0][1] = 1;
+    st->rebalance_num++;
+    tree->mem_used = sizeof(*tree) + tree->rule_cap * sizeof(*tree->rules) +
+        (1 + tree->retired_num) * sizeof(struct hs_node);
+
+    full_region(&region);
+    if (rebuild_subtree(tree, tree->root, &region, build_limit()) != 0) {
+        fprintf(stderr, "Memory budget %lu bytes exceeded\n", hs_cfg.mem_budget);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the subtrees left too deep are rebuilt once the update is in */
+static int hs_update_done(struct hs_tree *tree)
+{
+    if (!hs_cfg.rebalance_slack || hs_rebalance(tree) == 0) {
+        return 0;
+    }
+
+    return hs_refit(tree);
+}
+
+static int hs_insrt_rule(struct rng_rule *p_r, struct hs_tree *tree)
+{
+    struct rng_rule region;
+
+    full_region(&region);
+    return insrt_below(tree, tree->root, &region, p_r);
+}
+
+
+int hs_insrt_update(const struct rule_set *rs, void *userdata)
+{
+    struct hs_tree *tree = *(typeof(tree) *)userdata;
+    int i;
+
+    if (!tree || !rs->r_rules) return -1;
+
+    /* shared subtrees cannot be changed in place */
+    if (tree->dag_nodes != NULL) {
+        fprintf(stderr, "Compressed tree cannot be updated\n");
+        return -1;
+    }
+    hs_unflatten(tree);
+
+    /* leaves are rebuilt in place, stubs must be built first */
+    if (hs_expand_all(tree) != 0 || hs_track_heights(tree) != 0) {
+        return -1;
+    }
+    tree->over_budget = 0;
+
+    if (hs_cfg.insrt_batch && rs->num > 1) {
+        if (hs_insrt_batch(tree, rs) != 0 && hs_refit(tree) != 0) {
+            return -1;
+        }
+        return hs_reflatten(tree, hs_update_done(tree));
+    }
+
+    for (i = 0; i < rs->num; i++) {
+        if (hs_rules_add(tree, &rs->r_rules[i]) != 0) {
+            return -1;
+        }
+        if (hs_insrt_rule(&rs->r_rules[i], tree) != 0 && hs_refit(tree) != 0) {
+            return -1;
+        }
+    }
+
+    return hs_reflatten(tree, hs_update_done(tree));
+}
+
+/*
+ * The leaves a rule decides are rebuilt from the rules left in their region,
+ * other leaves do not change.
+ */
+static int hs_delete_rule(struct rng_rule *p_r, struct hs_tree *tree)
+{
+    struct s_node *p_sn = NULL, *p_tmp_sn = NULL;
+    struct s_head stack = STAILQ_HEAD_INITIALIZER(stack);
+    struct s_head leaves = STAILQ_HEAD_INITIALIZER(leaves);
+    struct hs_node *p_tn;
+    int ret = 0;
+
+    p_sn = calloc(1, sizeof *p_sn);
+    if (p_sn == NULL) {
+        return -1;
+    }
+    full_region(&p_sn->r);
+    p_sn->p_tn = tree->root;
+    STAILQ_INSERT_HEAD(&stack, p_sn, entry);
+
+    while (!STAILQ_EMPTY(&stack)) {
+        p_sn = STAILQ_FIRST(&stack);
+        STAILQ_REMOVE_HEAD(&stack, entry);
+        p_tn = p_sn->p_tn;
+
+        if (p_tn->d2s < 0) {
+            if (leaf_has_pri(p_tn, p_r->pri)) {
+                STAILQ_INSERT_HEAD(&leaves, p_sn, entry);
+            } else {
+                SAFE_FREE(p_sn);
+            }
+            continue;
+        }
+        p_tn->height = HS_HEIGHT_DIRTY;
+
+        /* right part */
+        if (is_greater(&p_r->dim[p_tn->d2s][1], &p_tn->thresh)) {
+            p_tmp_sn = malloc(sizeof *p_tmp_sn);
+            if (p_tmp_sn == NULL) {
+                SAFE_FREE(p_sn);
+                ret = -1;
+                break;
+            }
+            p_tmp_sn->r = p_sn->r;
+            p_tmp_sn->r.dim[p_tn->d2s][0] = p_tn->thresh;
+            point_inc(&p_tmp_sn->r.dim[p_tn->d2s][0]);
+            p_tmp_sn->p_tn = p_tn->child[1];
+            STAILQ_INSERT_HEAD(&stack, p_tmp_sn, entry);
+        }
+
+        /* left part */
+        if (is_less_equal(&p_r->dim[p_tn->d2s][0], &p_tn->thresh)) {
+            p_sn->r.dim[p_tn->d2s][1] = p_tn->thresh;
+            p_sn->p_tn = p_tn->child[0];
+            STAILQ_INSERT_HEAD(&stack, p_sn, entry);
+        } else {
+            SAFE_FREE(p_sn);
+        }
+    }
+
+    while (!STAILQ_EMPTY(&stack)) {
+        p_sn = STAILQ_FIRST(&stack);
+        STAILQ_REMOVE_HEAD(&stack, entry);
+        SAFE_FREE(p_sn);
+    }
+
+    while (!STAILQ_EMPTY(&leaves)) {
+        p_sn = STAILQ_FIRST(&leaves);
+        STAILQ_REMOVE_HEAD(&leaves, entry);
+        if (ret == 0 && rebuild_subtree(tree, p_sn->p_tn, &p_sn->r,
+                    build_limit()) != 0) {
+            ret = -1;
+        }
+        SAFE_FREE(p_sn);
+    }
+
+    return ret;
+}
+
+int hs_delete_update(const struct rule_set *rs, void *userdata)
+{
+    struct hs_tree *tree = *(typeof(tree) *)userdata;
+    int i;
+
+    if (!tree || !rs->r_rules) return -1;
+
+    /* shared subtrees cannot be changed in place */
+    if (tree->dag_nodes != NULL) {
+        fprintf(stderr, "Compressed tree cannot be updated\n");
+        return -1;
+    }
+    hs_unflatten(tree);
+
+    if (hs_expand_all(tree) != 0 || hs_track_heights(tree) != 0) {
+        return -1;
+    }
+    tree->over_budget = 0;
+
+    for (i = 0; i < rs->num; i++) {
+        if (hs_rules_del(tree, &rs->r_rules[i]) != 0) {
+            return -1;
+        }
+        if (hs_delete_rule(&rs->r_rules[i], tree) != 0 && hs_refit(tree) != 0) {
+            return -1;
+        }
+    }
+
+    return hs_reflatten(tree, hs_update_done(tree));
+}
+
+/*
+ * The top levels are walked by index arithmetic alone, the cache line of
+ * the descendants HS_TOP_AHEAD levels down is prefetched on the way.
+ */
+static uint32_t top_walk(const struct hs_tree *tree, const struct packet *pkt)
+{
+    const struct hs_flat *top = tree->top;
+    uint32_t j = 1;
+    int l;
+
+    for (l = 0; l + HS_TOP_AHEAD < tree->top_levels; l++) {
+        __builtin_prefetch(&top[j << HS_TOP_AHEAD]);
+        j = 2 * j + (pkt->val[top[j].info].u32 > top[j].thresh);
+    }
+    for (; l < tree->top_levels; l++) {
+        j = 2 * j + (pkt->val[top[j].info].u32 > top[j].thresh);
+    }
+
+    return tree->top_exit[j - (1u << tree->top_levels)];
+}
+
+static const struct hs_flat *flat_leaf(const struct hs_tree *tree,
+        const struct packet *pkt)
+{
+    const struct hs_flat *f = tree->flat;
+    uint32_t d2s;
+
+    if (tree->top != NULL) {
+        f = &tree->flat[top_walk(tree, pkt)];
+    }
+
+    while ((d2s = f->info & HS_FLAT_TAG) < DIM_MAX) {
+        f = &tree->flat[(f->info >> 3) + (pkt->val[d2s].u32 > f->thresh)];
+    }
+
+    return f;
+}
+
+static int flat_classify(const struct hs_tree *tree, const struct packet *pkt)
+{
+    const struct hs_flat *f = flat_leaf(tree, pkt);
+
+    if ((f->info & HS_FLAT_TAG) == HS_FLAT_BUCKET) {
+        return bucket_match(tree->flat_bkt[f->thresh], pkt);
+    }
+
+    return f->thresh;
+}
+
+int hs_classify(const struct packet *pkt, const void *userdata)
+{
+    struct hs_tree *tree = *(struct hs_tree **)userdata;
+    struct hs_node *node = tree->root, **slot = &tree->root;
+    int pri;
+
+    if (tree->flat != NULL) {
+        return flat_classify(tree, pkt);
+    }
+
+    for (;;) {
+        while (node->d2s >= 0) {
+            //printf("d2s:%d; pkt->val[%d].u32:%u; node.thresh.u32:%u\n", node->d2s, node->d2s, pkt->val[node->d2s].u32, node->thresh.u32);
+            slot = &node->child[pkt->val[node->d2s].u32 > node->thresh.u32];
+            node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        }
+        if (node->d2s != HS_STUB) {
+            break;
+        }
+        /* go on below the subtree just built */
+        node = lazy_lookup(tree, slot, pkt, &pri);
+        if (node == NULL) {
+            return pri;
+        }
+    }
+
+    if (node->d2s == HS_BUCKET) {
+        return bucket_match(node->bucket, pkt);
+    }
+
+    return node->thresh.u32;
+}
+
+/*
+ * All the rules a packet matches in priority order, the first max of them
+ * are stored. Returns how many matched, -1 if the leaves were built with
+ * their highest priority rule only.
+ */
+int hs_classify_all(const struct packet *pkt, const void *userdata,
+        int *pri, int max)
+{
+    struct hs_tree *tree = *(struct hs_tree **)userdata;
+    struct hs_node *node = tree->root, **slot = &tree->root;
+    const struct hs_bucket *bkt;
+    const struct hs_flat *f;
+    int p;
+
+    if (!tree->multi) {
+        return -1;
+    }
+
+    if (tree->flat != NULL) {
+        f = flat_leaf(tree, pkt);
+        if ((f->info & HS_FLAT_TAG) == HS_FLAT_BUCKET) {
+            bkt = tree->flat_bkt[f->thresh];
+            return rules_all(bkt->rules, bkt->num, pkt, pri, max);
+        }
+        p = f->thresh;
+    } else {
+        for (;;) {
+            while (node->d2s >= 0) {
+                slot = &node->child[pkt->val[node->d2s].u32 > node->thresh.u32];
+                node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+            }
+            if (node->d2s != HS_STUB) {
+                break;
+            }
+            /* a stub that cannot be built knows the first match only */
+            if ((node = lazy_lookup(tree, slot, pkt, &p)) == NULL) {
+                return -1;
+            }
+        }
+        if (node->d2s == HS_BUCKET) {
+            return rules_all(node->bucket->rules, node->bucket->num, pkt,
+                    pri, max);
+        }
+        p = node->thresh.u32;
+    }
+
+    /* a leaf of a single rule, or none */
+    if (p == -1) {
+        return 0;
+    }
+    if (max > 0) {
+        pri[0] = p;
+    }
+    return 1;
+}
+
+/*
+ * The packets walk the compact nodes together, a level of all of them per
+ * round, so the loads of one packet overlap those of the others. A packet
+ * at its leaf stays there: the leaf leads to itself and the values past
+ * the fields compare as 0.
+ */
+static void flat_classify_burst(const struct hs_tree *tree,
+        const struct packet *pkts, int num, int *res)
+{
+    uint32_t val[HS_BURST][HS_FLAT_TAG + 1], idx[HS_BURST], more;
+    const struct hs_flat *f, *top = tree->top;
+    int i, j, l;
+
+    for (i = 0; i < num; i++) {
+        for (j = 0; j < DIM_MAX; j++) {
+            val[i][j] = pkts[i].val[j].u32;
+        }
+        for (; j <= HS_FLAT_TAG; j++) {
+            val[i][j] = 0;
+        }
+        idx[i] = top != NULL;
+    }
+
+    if (top != NULL) {
+        for (l = 0; l < tree->top_levels; l++) {
+            for (i = 0; i < num; i++) {
+                if (l + HS_TOP_AHEAD < tree->top_levels) {
+                    __builtin_prefetch(&top[idx[i] << HS_TOP_AHEAD]);
+                }
+                f = &top[idx[i]];
+                idx[i] = 2 * idx[i] + (val[i][f->info] > f->thresh);
+            }
+        }
+        for (i = 0; i < num; i++) {
+            idx[i] = tree->top_exit[idx[i] - (1u << tree->top_levels)];
+        }
+    }
+
+    do {
+        more = 0;
+        for (i = 0; i < num; i++) {
+            f = &tree->flat[idx[i]];
+            idx[i] = (f->info >> 3) + (val[i][f->info & HS_FLAT_TAG] > f->thresh);
+            more |= (f->info & HS_FLAT_TAG) < DIM_MAX;
+        }
+    } while (more);
+
+    for (i = 0; i < num; i++) {
+        f = &tree->flat[idx[i]];
+        if ((f->info & HS_FLAT_TAG) == HS_FLAT_BUCKET) {
+            res[i] = bucket_match(tree->flat_bkt[f->thresh], &pkts[i]);
+        } else {
+            res[i] = f->thresh;
+        }
+    }
+}
+
+void hs_classify_burst(const struct packet *pkts, int num, int *res,
+        const void *userdata)
+{
+    const struct hs_tree *tree = *(struct hs_tree * const *)userdata;
+    int i;
+
+    if (tree->flat == NULL) {
+        for (i = 0; i < num; i++) {
+            res[i] = hs_classify(&pkts[i], userdata);
+        }
+        return;
+    }
+
+    for (i = 0; i < num; i += HS_BURST) {
+        flat_classify_burst(tree, &pkts[i], num - i < HS_BURST ? num - i : HS_BURST,
+                &res[i]);
+    }
+}
+
+int hs_search(const struct trace *t, const void *userdata)
+{
+    int i, j, n, res[HS_BURST];
+
+    for (i = 0; i < t->num; i += n) {
+        n = t->num - i < HS_BURST ? t->num - i : HS_BURST;
+        hs_classify_burst(&t->pkts[i], n, res, userdata);
+        for (j = 0; j < n; j++) {
+            if (res[j] != t->pkts[i + j].match) {
+                fprintf(stderr, "pkt[%d] match:%d, classify:%d\n", i+j+1, t->pkts[i+j].match+1, res[j]+1);
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Visits of the nodes of the compact copy in breadth first order, the
+ * order it is built in, so a profile fits the same tree built again
+ */
+int hs_heat_export(const struct trace *t, const void *userdata, const char *file)
+{
+    struct hs_tree *tree = *(struct hs_tree **)userdata;
+    const struct hs_flat *f;
+    uint64_t *visits;
+    uint32_t d2s;
+    FILE *fp;
+    int i, ret = 0;
+
+    if (hs_expand_all(tree) != 0 || hs_flatten(tree) != 0) {
+        return -1;
+    }
+    if ((visits = calloc(tree->flat_num, sizeof(*visits))) == NULL) {
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < t->num; i++) {
+        f = tree->flat;
+        visits[0]++;
+        while ((d2s = f->info & HS_FLAT_TAG) < DIM_MAX) {
+            f = &tree->flat[(f->info >> 3) + (t->pkts[i].val[d2s].u32 > f->thresh)];
+            visits[f - tree->flat]++;
+        }
+    }
+
+    if ((fp = fopen(file, "w")) == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", file);
+        ret = -1;
+        goto out;
+    }
+    fprintf(fp, "hs %d\n", tree->flat_num);
+    for (i = 0; i < tree->flat_num; i++) {
+        if (visits[i]) {
+            fprintf(fp, "%d %lu\n", i, visits[i]);
+        }
+    }
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+
+out:
+    SAFE_FREE(visits);
+    if (!hs_cfg.flat) {
+        hs_unflatten(tree);
+    }
+    return ret;
+}
+
+/*
+ * Lay the compact copy out again depth first, the more visited child first,
+ * so the nodes of the hot paths follow each other. The children of a node
+ * stay a pair. Updates lay the copy out breadth first again.
+ */
+int hs_heat_relayout(const char *file, void *userdata)
+{
+    struct hs_tree *tree = *(typeof(tree) *)userdata;
+    struct hs_flat *flat = NULL, *f;
+    uint64_t *visits = NULL, v;
+    uint32_t (*stack)[2] = NULL, old, pos, base, next = 1, hot;
+    int num, top = 0, ret = -1, i;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", file);
+        return -1;
+    }
+    if (hs_expand_all(tree) != 0 || hs_flatten(tree) != 0) {
+        goto out;
+    }
+    if (fscanf(fp, "hs %d\n", &num) != 1 || num != tree->flat_num) {
+        fprintf(stderr, "Profile %s does not fit the tree\n", file);
+        goto out;
+    }
+
+    visits = calloc(num, sizeof(*visits));
+    flat = malloc(num * sizeof(*flat));
+    stack = malloc(num * sizeof(*stack));
+    if (visits == NULL || flat == NULL || stack == NULL) {
+        goto out;
+    }
+    while (fscanf(fp, "%d %lu\n", &i, &v) == 2) {
+        if (i < 0 || i >= num) {
+            fprintf(stderr, "Profile %s does not fit the tree\n", file);
+            goto out;
+        }
+        visits[i] = v;
+    }
+
+    /* old and new index of the nodes to place */
+    stack[top][0] = 0;
+    stack[top++][1] = 0;
+    while (top > 0) {
+        old = stack[--top][0];
+        pos = stack[top][1];
+        f = &tree->flat[old];
+        if ((f->info & HS_FLAT_TAG) >= DIM_MAX) {
+            flat[pos] = (struct hs_flat){f->thresh, pos << 3 | (f->info & HS_FLAT_TAG)};
+            continue;
+        }
+        base = f->info >> 3;
+        flat[pos] = (struct hs_flat){f->thresh, next << 3 | (f->info & HS_FLAT_TAG)};
+        hot = visits[base + 1] > visits[base];
+        stack[top][0] = base + !hot;
+        stack[top++][1] = next + !hot;
+        stack[top][0] = base + hot;
+        stack[top++][1] = next + hot;
+        next += 2;
+    }
+
+    drop_flat(tree);
+    if (place_flat(tree, flat, num) != 0) {
+        flat = NULL;
+        hs_unflatten(tree);
+        goto out;
+    }
+    flat = NULL;
+    SAFE_FREE(tree->top);
+    SAFE_FREE(tree->top_exit);
+    tree->top_levels = 0;
+    if (hs_flatten_top(tree) != 0) {
+        hs_unflatten(tree);
+        goto out;
+    }
+    ret = 0;
+
+out:
+    fclose(fp);
+    SAFE_FREE(visits);
+    SAFE_FREE(flat);
+    SAFE_FREE(stack);
+    return ret;
+}
+
+void hs_stats(const void *userdata, struct pc_stats *st)
+{
+    struct hs_tree *tree = *(struct hs_tree * const *)userdata;
+    const struct hs_statistics *hst = &tree->st;
+    int i;
+
+    bzero(st, sizeof(*st));
+
+    /* the background builder changes the counters */
+    pthread_mutex_lock(&tree->lazy_lock);
+
+    st->rule_num = tree->rule_num;
+    st->node_num = hst->tree_node_num;
+    st->leaf_num = hst->leaf_node_num;
+    st->bytes = sizeof(*tree) + tree->rule_cap * sizeof(*tree->rules);
+    if (tree->dag_nodes != NULL) {
+        st->dag_node_num = hst->dag_node_num;
+        st->dag_leaf_num = hst->dag_leaf_num;
+        st->bytes += tree->dag_num * (sizeof(struct hs_node) +
+                sizeof(*tree->dag_nodes));
+    } else {
+        st->bytes += (hst->tree_node_num + hst->leaf_node_num) *
+            sizeof(struct hs_node);
+    }
+
+    for (i = 0; i < DIM_MAX; i++) {
+        st->segment_num[i] = hst->segment_num[i];
+    }
+
+    st->worst_depth = hst->worst_depth;
+    if (hst->leaf_node_num) {
+        st->average_depth = (double)hst->average_depth / hst->leaf_node_num;
+    }
+    if (tree->rule_num) {
+        st->replication = (double)hst->rule_copies / tree->rule_num;
+    }
+
+    st->bucket_num = hst->bucket_num;
+    st->bytes += hst->bucket_num * sizeof(struct hs_bucket) +
+        hst->bucket_rules * sizeof(struct rng_rule);
+    /* the background builder may still grow the depth table */
+    if (!tree->lazy_run || hst->stub_num == 0) {
+        st->depth_node = (const size_t (*)[2])hst->depth_node;
+        st->depth_num = hst->leaf_node_num ? hst->worst_depth + 1 : 0;
+    }
+    if (hst->sample_num) {
+        st->sample_depth = (double)hst->sample_depth / hst->sample_num;
+    }
+
+    st->stub_num = hst->stub_num;
+    st->rebuild_num = hst->rebalance_num;
+    st->split_copies = hst->split_copies;
+    /* the node of a stub and the one it is built into */
+    st->bytes += hst->stub_num * (sizeof(struct hs_stub) +
+            2 * sizeof(struct hs_node)) +
+        hst->stub_rules * sizeof(struct rng_rule);
+    st->bytes += tree->slot_cap * sizeof(*tree->stubs) +
+        tree->retired_num * sizeof(struct hs_node);
+    st->flat_num = tree->flat_num;
+    st->bytes += tree->flat_num * sizeof(*tree->flat) +
+        tree->flat_bkt_num * sizeof(*tree->flat_bkt);
+    if (tree->top != NULL) {
+        st->flat_top = tree->top_levels;
+        st->bytes += (1ul << tree->top_levels) *
+            (sizeof(*tree->top) + sizeof(*tree->top_exit));
+    }
+    st->prof = tree->prof;
+    pthread_mutex_unlock(&tree->lazy_lock);
+
+    return;
+}
+
+void hs_cleanup(void *userdata)
+{
+    struct hs_tree *tree = *(typeof(tree) *)userdata;
+    struct hs_node *node;
+
+    int i;
+
+    if (tree->lazy_run) {
+        pthread_mutex_lock(&tree->lazy_lock);
+        tree->lazy_stop = 1;
+        pthread_mutex_unlock(&tree->lazy_lock);
+        pthread_join(tree->lazy_tid, NULL);
+    }
+    while ((node = tree->retired) != NULL) {
+        tree->retired = node->child[0];
+        free(node);
+    }
+
+    if (tree->dag_nodes != NULL) {
+        /* every node once, the root included */
+        for (i = 0; i < tree->dag_num; i++) {
+            if (tree->dag_nodes[i]->d2s == HS_BUCKET) {
+                SAFE_FREE(tree->dag_nodes[i]->bucket);
+            }
+            free(tree->dag_nodes[i]);
+        }
+        SAFE_FREE(tree->dag_nodes);
+        tree->root = NULL;
+    }
+    if (tree->root != NULL) {
+        cleanup_hs_tree(tree->root);
+        SAFE_FREE(tree->root);
+    }
+    SAFE_FREE(tree->rules);
+    prof_destroy(tree->prof);
+    SAFE_FREE(tree->st.depth_node);
+    SAFE_FREE(tree->stubs);
+    hs_unflatten(tree);
+    pthread_mutex_destroy(&tree->lazy_lock);
+    SAFE_FREE(tree);
 
     return;
 }
@@ -15,22 +15,193 @@
 #ifndef __HS_H__
 #define __HS_H__
 
+#include <pthread.h>
+
 #include "pc_eval.h"
 
+#define HS_BUCKET (-2)              /* d2s of a rule bucket leaf */
+#define HS_STUB (-3)                /* d2s of a subtree not built yet */
+#define HS_DEPTH_LIMIT UINT16_MAX   /* the depth field of a node */
+#define HS_HEIGHT_MAX 254           /* heights saturate here */
+#define HS_HEIGHT_DIRTY 255         /* passed by an update since */
+#define HS_FLAT_BUCKET 6            /* tags of the compact leaves */
+#define HS_FLAT_LEAF 7
+#define HS_FLAT_TAG 7               /* d2s or leaf tag bits of hs_flat.info */
+#define HS_FLAT_MAX (1u << 29)      /* nodes a compact tree can index */
+#define HS_BURST 16                 /* packets walked together */
+#define HS_TOP_MAX 20               /* implicit levels of the compact tree */
+#define HS_TOP_AHEAD 3              /* levels prefetched ahead, a cache line */
+#define HS_BUDGET_SPARE 8           /* 1/8 of the budget is left to updates */
+
+/* rules of a leaf past the depth limit, searched linearly */
+struct hs_bucket {
+    int num;
+    uint32_t splits;        /* its share of split_copies */
+    struct rng_rule rules[];
+};
+
+/* rules of a subtree built on first use */
+struct hs_stub {
+    struct rng_rule *rules;
+    struct hs_node *node;   /* the subtree is built into it */
+    int num;
+    uint32_t splits;        /* share of split_copies of its first leaf */
+};
+
 /*
  * k-d tree
  */
 struct hs_node {
-    int d2s;
-    uint8_t depth;
+    int d2s;                        /* -1 for a leaf */
+    uint16_t depth;
+    uint8_t height;                 /* of the subtree, 0 for a leaf */
+    uint8_t base;                   /* height when the subtree was built */
     union point thresh;
-    struct hs_node *child[2];
+    union {
+        struct hs_node *child[2];
+        struct {                    /* d2s == -1, its shares of */
+            uint32_t copies;        /* rule_copies */
+            uint32_t splits;        /* split_copies */
+        };
+        struct hs_bucket *bucket;   /* d2s == HS_BUCKET */
+        struct hs_stub *stub;       /* d2s == HS_STUB */
+    };
+};
+
+/*
+ * compact copy of the tree for lookups, the children of a node are adjacent
+ * so the one taken is computed, a leaf leads to itself
+ */
+struct hs_flat {
+    uint32_t thresh;    /* priority of a leaf, bucket index of a bucket leaf */
+    uint32_t info;      /* d2s or leaf tag, and the children above it */
+};
+
+struct hs_statistics {
+    size_t segment_num[DIM_MAX];
+    size_t segment_total;
+
+    size_t worst_depth;
+    size_t average_depth;
+
+    size_t tree_node_num;
+    size_t leaf_node_num;
+
+    /*
+     * rules reaching the leaves when they were built, and copied to both
+     * children by the splits, each leaf keeps its share for a rebuild
+     */
+    size_t rule_copies;
+    size_t split_copies;
+
+    size_t bucket_num;
+    size_t bucket_rules;
+
+    /* subtrees left to be built on first use */
+    size_t stub_num;
+    size_t stub_rules;
+
+    /* subtrees rebuilt because updates made them too deep */
+    size_t rebalance_num;
+
+    /* unique nodes once identical subtrees are shared */
+    size_t dag_node_num;
+    size_t dag_leaf_num;
+
+    /* depth of the sample packets when their leaves were built */
+    size_t sample_depth;
+    size_t sample_num;
+
+    /* internal & leaf nodes per depth, grows with the tree */
+    size_t (*depth_node)[2];
+    int depth_cap;
 };
 
+/*
+ * classifier instance
+ */
+struct hs_tree {
+    struct hs_node *root;
+    struct hs_statistics st;
+    struct pc_prof *prof;   /* NULL if not profiled */
+    size_t mem_used;        /* bytes of the instance, checked against the budget */
+    int over_budget;        /* an update did not fit the budget */
+
+    /* unique nodes of a compressed tree, NULL if not compressed */
+    struct hs_node **dag_nodes;
+    int dag_num;
+
+    /* live rules sorted by priority, leaves are rebuilt from them */
+    struct rng_rule *rules;
+    int rule_num;
+    int rule_cap;
+    int height_ok;          /* node heights are kept up to date */
+    int multi;              /* leaves keep every rule covering them */
+
+    /* compact copy in breadth first order, NULL if lookups walk the nodes */
+    struct hs_flat *flat;
+    struct hs_bucket **flat_bkt;    /* buckets of the compact leaves */
+    void (*flat_free)(void *p);     /* frees flat, as it was allocated */
+    int flat_num;
+    int flat_bkt_num;
+
+    /*
+     * top levels in breadth first (Eytzinger) order from index 1, the
+     * children of node j are 2j and 2j + 1, leaves above the last level
+     * are padded with splits always going left
+     */
+    struct hs_flat *top;
+    uint32_t *top_exit;     /* compact node below each last level child */
+    int top_levels;
+
+    /* stubs are built under the lock and published through their slots */
+    pthread_mutex_t lazy_lock;
+    struct hs_node ***stubs;    /* slots of the stubs left by the build */
+    int slot_num;
+    int slot_cap;
+    struct hs_node *retired;    /* replaced stubs, lookups may still hold them */
+    int retired_num;
+    pthread_t lazy_tid;
+    int lazy_run;               /* the background builder was started */
+    int lazy_stop;
+};
+
+/* builder settings */
+struct hs_cfg {
+    int max_depth;      /* deeper nodes become rule buckets, 0 for no limit */
+    int threads;        /* builder threads */
+    size_t mem_budget;  /* bytes of the instance, 0 for no budget */
+    const struct trace *sample; /* traffic the splits are fitted to, or NULL */
+    int dag;            /* share identical subtrees after the build */
+    int lazy_depth;     /* deeper subtrees are built on first use, 0 for all */
+    int lazy_bg;        /* build the stubs in the background as well */
+    int rebalance_slack; /* rebuild subtrees grown this much, 0 for never */
+    int insrt_batch;    /* insert several rules in one walk of the tree */
+    double copy_weight; /* cost of a rule copied by a split, 0 for weights */
+    int flat;           /* look up in a compact copy, redone after updates */
+    int flat_top;       /* levels of it laid out implicitly, 0 for none */
+    int multi;          /* leaves keep all their rules, for hs_classify_all */
+    /* memory of the compact array, NULL for malloc and free */
+    void *(*flat_alloc)(size_t bytes);
+    void (*flat_free)(void *p);
+};
+
+extern struct hs_cfg hs_cfg;
+
 int hs_build(const struct rule_set *rs, void *userdata);
 int hs_insrt_update(const struct rule_set *rs, void *userdata);
+int hs_delete_update(const struct rule_set *rs, void *userdata);
 int hs_classify(const struct packet *pkt, const void *userdata);
+void hs_classify_burst(const struct packet *pkts, int num, int *res,
+        const void *userdata);
+int hs_classify_all(const struct packet *pkt, const void *userdata,
+        int *pri, int max);
 int hs_search(const struct trace *t, const void *userdata);
+void hs_stats(const void *userdata, struct pc_stats *st);
 void hs_cleanup(void *userdata);
+int hs_heat_export(const struct trace *t, const void *userdata, const char *file);
+int hs_heat_relayout(const char *file, void *userdata);
+
+int hs_expand_all(struct hs_tree *tree);
 
 #endif /* __HS_H__ */
@@ -0,0 +1,509 @@
+/*
+ *     Filename: hs_gen.c
+ *  Description: Source file for HyperSplit compiled to C, the tree is
+ *               emitted as compares with constants and loaded as a
+ *               shared object
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include "hs_gen.h"
+#include "uthash.h"
+
+#define GEN_FUNC "hs_gen_tree"
+#define GEN_FUNC_DEPTH 8    /* tree levels of a generated function */
+#define GEN_ARGS "uint32_t v0, uint32_t v1, uint32_t v2, uint32_t v3, uint32_t v4"
+#define GEN_CALL "v0, v1, v2, v3, v4"
+
+struct hs_gen_cfg hs_gen_cfg = {
+    .max_nodes = 1 << 16,
+    .batch = 1024,
+};
+
+/* label or function of a node, shared subtrees are emitted once */
+struct gen_label {
+    const struct hs_node *node;
+    uint32_t id;
+    int done;
+    UT_hash_handle hh;
+};
+
+/* a node to emit, reached by falling through or by a goto */
+struct gen_frame {
+    const struct hs_node *node;
+    int fall;
+    int depth;          /* below the root of the function */
+};
+
+/* functions to emit, their roots in order */
+struct gen_funcs {
+    struct gen_label *map;
+    const struct hs_node **roots;
+    uint32_t num;
+    uint32_t cap;
+};
+
+static struct gen_label *gen_label(struct gen_label **labels,
+        const struct hs_node *node, uint32_t *num)
+{
+    struct gen_label *l;
+
+    HASH_FIND_PTR(*labels, &node, l);
+    if (l != NULL) {
+        return l;
+    }
+    if ((l = calloc(1, sizeof(*l))) == NULL) {
+        return NULL;
+    }
+    l->node = node;
+    l->id = (*num)++;
+    HASH_ADD_PTR(*labels, node, l);
+
+    return l;
+}
+
+static void gen_clear(struct gen_label **labels)
+{
+    struct gen_label *l, *tmp;
+
+    HASH_ITER(hh, *labels, l, tmp) {
+        HASH_DEL(*labels, l);
+        free(l);
+    }
+}
+
+/* id of the function of a subtree, queued when first seen */
+static int gen_func(struct gen_funcs *funcs, const struct hs_node *node)
+{
+    struct gen_label *l;
+    void *p;
+
+    if ((l = gen_label(&funcs->map, node, &funcs->num)) == NULL) {
+        return -1;
+    }
+    if (l->id + 1 == funcs->num && !l->done) {
+        if (funcs->num > funcs->cap) {
+            funcs->cap = funcs->cap ? 2 * funcs->cap : 64;
+            p = realloc(funcs->roots, funcs->cap * sizeof(*funcs->roots));
+            if (p == NULL) {
+                return -1;
+            }
+            funcs->roots = p;
+        }
+        funcs->roots[l->id] = node;
+        l->done = 1;
+    }
+
+    return l->id;
+}
+
+static void gen_bucket(FILE *fp, const struct hs_bucket *bkt)
+{
+    const struct rng_rule *r;
+    int i, d;
+
+    for (i = 0; i < bkt->num; i++) {
+        r = &bkt->rules[i];
+        fprintf(fp, "    if (");
+        for (d = 0; d < DIM_MAX; d++) {
+            fprintf(fp, "%s(uint32_t)(v%d - %uu) <= %uu", d ? " && " : "", d,
+                    r->dim[d][0].u32, r->dim[d][1].u32 - r->dim[d][0].u32);
+        }
+        fprintf(fp, ") return %d;\n", r->pri);
+    }
+    fprintf(fp, "    return -1;\n");
+}
+
+/*
+ * A function holds GEN_FUNC_DEPTH levels of a subtree, deeper subtrees are
+ * called, so the compiler never sees one huge function. Inside, the left
+ * child of a node follows it and the right one is jumped to. Every node
+ * ends with a return or a goto, so a right child emitted later does not
+ * need a jump over it.
+ */
+static int gen_func_body(FILE *fp, struct gen_funcs *funcs, uint32_t fid)
+{
+    struct gen_label *labels = NULL, *l;
+    struct gen_frame *stack, *p, f;
+    const struct hs_node *node, *child;
+    uint32_t num = 0;
+    int i, id, top = 0, cap = 64, ret = 0;
+
+    if ((stack = malloc(cap * sizeof(*stack))) == NULL) {
+        return -1;
+    }
+
+    fprintf(fp, "static int f%u(" GEN_ARGS ")\n{\n", fid);
+    stack[top++] = (struct gen_frame){funcs->roots[fid], 1, 0};
+
+    while (top > 0 && ret == 0) {
+        f = stack[--top];
+        node = f.node;
+
+        if ((l = gen_label(&labels, node, &num)) == NULL) {
+            ret = -1;
+            break;
+        }
+        if (l->done) {
+            if (f.fall) {
+                fprintf(fp, "    goto n%u;\n", l->id);
+            }
+            continue;
+        }
+        l->done = 1;
+        fprintf(fp, "n%u:\n", l->id);
+
+        if (node->d2s == HS_BUCKET) {
+            gen_bucket(fp, node->bucket);
+            continue;
+        }
+        if (node->d2s < 0) {
+            fprintf(fp, "    return %d;\n", (int)node->thresh.u32);
+            continue;
+        }
+
+        if (top + 2 > cap) {
+            cap *= 2;
+            if ((p = realloc(stack, cap * sizeof(*stack))) == NULL) {
+                ret = -1;
+                break;
+            }
+            stack = p;
+        }
+
+        /* the right child, then the left one falling through */
+        for (i = 1; i >= 0 && ret == 0; i--) {
+            child = node->child[i];
+            if (child->d2s >= 0 && f.depth + 1 == GEN_FUNC_DEPTH) {
+                if ((id = gen_func(funcs, child)) < 0) {
+                    ret = -1;
+                    break;
+                }
+                if (i) {
+                    fprintf(fp, "    if (v%d > %uu) return f%d(" GEN_CALL ");\n",
+                            node->d2s, node->thresh.u32, id);
+                } else {
+                    fprintf(fp, "    return f%d(" GEN_CALL ");\n", id);
+                }
+                continue;
+            }
+            if (i) {
+                if ((l = gen_label(&labels, child, &num)) == NULL) {
+                    ret = -1;
+                    break;
+                }
+                fprintf(fp, "    if (v%d > %uu) goto n%u;\n", node->d2s,
+                        node->thresh.u32, l->id);
+            }
+            stack[top++] = (struct gen_frame){child, !i, f.depth + 1};
+        }
+    }
+
+    fprintf(fp, "}\n\n");
+
+    gen_clear(&labels);
+    SAFE_FREE(stack);
+
+    return ret;
+}
+
+static int gen_source(FILE *fp, const struct hs_tree *tree)
+{
+    struct gen_funcs funcs = {NULL, NULL, 0, 0};
+    char *body = NULL;
+    size_t len = 0;
+    FILE *bp;
+    uint32_t i;
+    int d, ret = 0;
+
+    /* the functions are declared before their bodies */
+    if ((bp = open_memstream(&body, &len)) == NULL) {
+        return -1;
+    }
+    if (gen_func(&funcs, tree->root) < 0) {
+        ret = -1;
+    }
+    for (i = 0; i < funcs.num && ret == 0; i++) {
+        ret = gen_func_body(bp, &funcs, i);
+    }
+    fclose(bp);
+
+    if (ret == 0) {
+        fprintf(fp, "/* generated from a HyperSplit tree */\n"
+                "#include <stdint.h>\n\n");
+        for (i = 0; i < funcs.num; i++) {
+            fprintf(fp, "static int f%u(" GEN_ARGS ");\n", i);
+        }
+        fprintf(fp, "\n");
+        fwrite(body, 1, len, fp);
+        fprintf(fp, "int " GEN_FUNC "(const void *pkt)\n{\n"
+                "    const char *p = pkt;\n");
+        for (d = 0; d < DIM_MAX; d++) {
+            fprintf(fp, "    const uint32_t v%d = *(const uint32_t *)(p + %zu);\n",
+                    d, offsetof(struct packet, val) + d * sizeof(union point));
+        }
+        fprintf(fp, "\n    return f0(" GEN_CALL ");\n}\n");
+    }
+
+    SAFE_FREE(body);
+    gen_clear(&funcs.map);
+    SAFE_FREE(funcs.roots);
+
+    return ret;
+}
+
+static void gen_unload(struct hs_gen *gen)
+{
+    if (gen->dl != NULL) {
+        dlclose(gen->dl);
+        gen->dl = NULL;
+    }
+    gen->classify = NULL;
+    gen->code_bytes = 0;
+}
+
+/* size of the .text section of a shared object, 0 if not found */
+static size_t gen_text_bytes(const char *path)
+{
+    ElfW(Ehdr) eh;
+    ElfW(Shdr) *sh = NULL;
+    char *names = NULL;
+    size_t size = 0, len;
+    FILE *fp;
+    int i;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        return 0;
+    }
+    if (fread(&eh, sizeof(eh), 1, fp) != 1 ||
+        memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0 ||
+        eh.e_shentsize != sizeof(*sh) || eh.e_shstrndx >= eh.e_shnum) {
+        goto out;
+    }
+    if ((sh = malloc(eh.e_shnum * sizeof(*sh))) == NULL ||
+        fseek(fp, eh.e_shoff, SEEK_SET) != 0 ||
+        fread(sh, sizeof(*sh), eh.e_shnum, fp) != eh.e_shnum) {
+        goto out;
+    }
+    len = sh[eh.e_shstrndx].sh_size;
+    if ((names = malloc(len)) == NULL ||
+        fseek(fp, sh[eh.e_shstrndx].sh_offset, SEEK_SET) != 0 ||
+        fread(names, 1, len, fp) != len) {
+        goto out;
+    }
+    for (i = 0; i < eh.e_shnum; i++) {
+        if (sh[i].sh_name + sizeof(".text") <= len &&
+            memcmp(names + sh[i].sh_name, ".text", sizeof(".text")) == 0) {
+            size = sh[i].sh_size;
+            break;
+        }
+    }
+
+out:
+    SAFE_FREE(names);
+    SAFE_FREE(sh);
+    fclose(fp);
+
+    return size;
+}
+
+/*
+ * Emit the tree, compile it with $CC (cc by default) and load it. The
+ * files are removed once loaded. Lookups walk the tree if any step fails.
+ */
+static int gen_load(struct hs_gen *gen)
+{
+    struct hs_tree *tree = gen->tree;
+    char dir[] = "/tmp/hs_gen.XXXXXX", src[64], obj[64], cmd[256];
+    const char *cc = getenv("CC");
+    size_t size;
+    FILE *fp;
+    int ret = -1;
+
+    gen_unload(gen);
+
+    if (hs_expand_all(tree) != 0) {
+        return -1;
+    }
+
+    size = tree->st.bucket_rules + (tree->dag_nodes != NULL ? tree->dag_num :
+            tree->st.tree_node_num + tree->st.leaf_node_num);
+    if (size > (size_t)hs_gen_cfg.max_nodes) {
+        fprintf(stderr, "Tree of %lu nodes and bucket rules is not compiled, "
+                "over %d\n", size, hs_gen_cfg.max_nodes);
+        return -1;
+    }
+
+    if (mkdtemp(dir) == NULL) {
+        perror("Cannot create the directory of the generated code");
+        return -1;
+    }
+    snprintf(src, sizeof(src), "%s/gen.c", dir);
+    snprintf(obj, sizeof(obj), "%s/gen.so", dir);
+    snprintf(cmd, sizeof(cmd), "%s -O2 -shared -fPIC -o %s %s",
+            cc != NULL ? cc : "cc", obj, src);
+
+    if ((fp = fopen(src, "w")) == NULL) {
+        perror("Cannot write the generated code");
+        rmdir(dir);
+        return -1;
+    }
+    if (gen_source(fp, tree) != 0) {
+        fclose(fp);
+        goto out;
+    }
+    if (fclose(fp) != 0 || system(cmd) != 0) {
+        fprintf(stderr, "Cannot compile the generated code\n");
+        goto out;
+    }
+
+    if ((gen->dl = dlopen(obj, RTLD_NOW | RTLD_LOCAL)) == NULL ||
+        (gen->classify = (int (*)(const void *))dlsym(gen->dl, GEN_FUNC)) == NULL) {
+        fprintf(stderr, "Cannot load the generated code: %s\n", dlerror());
+        gen_unload(gen);
+        goto out;
+    }
+    gen->code_bytes = gen_text_bytes(obj);
+    ret = 0;
+
+out:
+    unlink(src);
+    unlink(obj);
+    rmdir(dir);
+
+    return ret;
+}
+
+int hs_gen_build(const struct rule_set *rs, void *userdata)
+{
+    struct hs_gen *gen;
+
+    gen = calloc(1, sizeof(*gen));
+    if (gen == NULL) {
+        return -1;
+    }
+
+    if (hs_build(rs, &gen->tree) != 0) {
+        SAFE_FREE(gen);
+        return -1;
+    }
+    if (gen_load(gen) != 0) {
+        fprintf(stderr, "Tree not compiled, lookups walk it\n");
+    }
+
+    *(struct hs_gen **)userdata = gen;
+
+    return 0;
+}
+
+/*
+ * The code of the old tree is dropped at once and lookups walk the tree,
+ * it is compiled again when hs_gen_cfg.batch rules have been updated
+ */
+static void gen_update(struct hs_gen *gen, int num)
+{
+    gen->stale += num;
+    if (gen->stale < hs_gen_cfg.batch) {
+        return;
+    }
+    gen->stale = 0;
+    if (gen_load(gen) != 0) {
+        fprintf(stderr, "Tree not compiled, lookups walk it\n");
+    }
+}
+
+int hs_gen_insrt_update(const struct rule_set *rs, void *userdata)
+{
+    struct hs_gen *gen = *(typeof(gen) *)userdata;
+
+    if (!gen) return -1;
+
+    gen_unload(gen);
+    if (hs_insrt_update(rs, &gen->tree) != 0) {
+        return -1;
+    }
+    gen_update(gen, rs->num);
+
+    return 0;
+}
+
+int hs_gen_delete_update(const struct rule_set *rs, void *userdata)
+{
+    struct hs_gen *gen = *(typeof(gen) *)userdata;
+
+    if (!gen) return -1;
+
+    gen_unload(gen);
+    if (hs_delete_update(rs, &gen->tree) != 0) {
+        return -1;
+    }
+    gen_update(gen, rs->num);
+
+    return 0;
+}
+
+int hs_gen_classify(const struct packet *pkt, const void *userdata)
+{
+    const struct hs_gen *gen = *(const struct hs_gen * const *)userdata;
+
+    if (gen->classify == NULL) {
+        return hs_classify(pkt, &gen->tree);
+    }
+
+    return gen->classify(pkt);
+}
+
+/* the generated code returns the first match only, the tree is walked */
+int hs_gen_classify_all(const struct packet *pkt, const void *userdata,
+        int *pri, int max)
+{
+    const struct hs_gen *gen = *(const struct hs_gen * const *)userdata;
+
+    return hs_classify_all(pkt, &gen->tree, pri, max);
+}
+
+int hs_gen_search(const struct trace *t, const void *userdata)
+{
+    int i, c;
+
+    for (i = 0; i < t->num; i++) {
+        if ((c = hs_gen_classify(&t->pkts[i], userdata)) != t->pkts[i].match) {
+            fprintf(stderr, "pkt[%d] match:%d, classify:%d\n", i+1, t->pkts[i].match+1, c+1);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void hs_gen_stats(const void *userdata, struct pc_stats *st)
+{
+    const struct hs_gen *gen = *(const struct hs_gen * const *)userdata;
+
+    hs_stats(&gen->tree, st);
+    st->bytes += sizeof(*gen);
+    st->code_bytes = gen->code_bytes;
+
+    return;
+}
+
+void hs_gen_cleanup(void *userdata)
+{
+    struct hs_gen *gen = *(typeof(gen) *)userdata;
+
+    gen_unload(gen);
+    hs_cleanup(&gen->tree);
+    SAFE_FREE(gen);
+    *(struct hs_gen **)userdata = NULL;
+
+    return;
+}
@@ -0,0 +1,44 @@
+/*
+ *     Filename: hs_gen.h
+ *  Description: Header file for HyperSplit compiled to C, the tree is
+ *               emitted as compares with constants and loaded as a
+ *               shared object
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __HS_GEN_H__
+#define __HS_GEN_H__
+
+#include "pc_eval.h"
+#include "hs.h"
+
+/* classifier instance, the tree is kept for updates and statistics */
+struct hs_gen {
+    struct hs_tree *tree;
+    void *dl;                       /* NULL if lookups walk the tree */
+    int (*classify)(const void *);  /* generated, takes a struct packet */
+    size_t code_bytes;              /* text size of the generated code */
+    int stale;                      /* rules updated since the last compile */
+};
+
+struct hs_gen_cfg {
+    int max_nodes;      /* larger trees are walked, not compiled */
+    int batch;          /* updated rules before the tree is compiled again */
+};
+
+extern struct hs_gen_cfg hs_gen_cfg;
+
+int hs_gen_build(const struct rule_set *rs, void *userdata);
+int hs_gen_insrt_update(const struct rule_set *rs, void *userdata);
+int hs_gen_delete_update(const struct rule_set *rs, void *userdata);
+int hs_gen_classify(const struct packet *pkt, const void *userdata);
+int hs_gen_classify_all(const struct packet *pkt, const void *userdata,
+        int *pri, int max);
+int hs_gen_search(const struct trace *t, const void *userdata);
+void hs_gen_stats(const void *userdata, struct pc_stats *st);
+void hs_gen_cleanup(void *userdata);
+
+#endif /* __HS_GEN_H__ */
@@ -9,6 +9,40 @@
  *               Tsinghua University (THU)
  *
  *      History:  1. main file
+ *
+ *                2. Add mixed insert/delete/lookup update workload
+ *
+ *                3. Add build profiler option
+ *
+ *                4. Add builder threads and depth limit of HyperSplit
+ *
+ *                5. Add memory budget of HyperSplit
+ *
+ *                6. Add build sample trace of HyperSplit
+ *
+ *                7. Add subtree sharing of HyperSplit
+ *
+ *                8. Add lazy subtree building of HyperSplit
+ *
+ *                9. Add subtree rebalancing of HyperSplit updates
+ *
+ *               10. Add batch insertion of HyperSplit
+ *
+ *               11. Add shadowed rule removal
+ *
+ *               12. Add copy-weighted splits of HyperSplit
+ *
+ *               13. Add protocol dispatch
+ *
+ *               14. Add compact lookup nodes of HyperSplit
+ *
+ *               15. Add HyperSplit compiled to C
+ *
+ *               16. Add implicit top levels of the compact HyperSplit nodes
+ *
+ *               17. Add traffic profile export and relayout
+ *
+ *               18. Add multi-match searching
  */
 
 #include <stdio.h>
@@ -18,19 +52,55 @@
 #include <unistd.h>
 #include <assert.h>
 #include "pc_eval.h"
+#include "hs.h"
+#include "tss.h"
+#include "proto.h"
+#include "hs_gen.h"
+#include "utils.h"
 
 static struct {
     char *rule_file;
     char *u_rule_file;
     char *trace_file;
+    char *sample_file;
+    char *heat_out;     /* traffic profile of the trace written to */
+    char *heat_in;      /* traffic profile the classifier is laid out by */
     int algrthm_id;
+    int mixed_ops;
+    int ratio[3];       /* insert : delete : lookup */
+    uint64_t seed;
+    int shadow;         /* 0: keep shadowed rules, else 1 + rm_shadow_rules flags */
+    int multi;          /* search all the matches of each packet as well */
 } cfg = {
     NULL,
     NULL,
     NULL,
+    NULL,
+    NULL,
+    NULL,
+    0,
+    0,
+    {1, 1, 8},
+    1,
+    0,
     0
 };
 
+enum {
+    OP_INSERT = 0,
+    OP_DELETE = 1,
+    OP_LOOKUP = 2,
+    OP_NUM = 3
+};
+
+/* a rule of the rule file: consecutive entries sharing its priority */
+struct rule_unit {
+    struct rule_set rs;
+    int pos;            /* index in the live or dead list */
+};
+
+#define VERIFY_PKT_MAX 8192
+
 static void print_help(void)
 {
     static const char *help =
@@ -40,23 +110,136 @@ static void print_help(void)
         "  -r, --rule FILE    specify a rule file for building\n"
         "  -t, --trace FILE   specify a trace file for searching\n"
         "  -u, --update FILE  specify a update rule file for searching\n"
-        "  -a, --algorithm ID specify an algorithm, 0:HyperSplit, 1:TSS\n"
+        "  -a, --algorithm ID specify an algorithm, 0:HyperSplit, 1:TSS,\n"
+        "                     2:protocol dispatch, 3:HyperSplit compiled to C\n"
+        "  -i, --inner ID     algorithm of the per protocol classifiers of\n"
+        "                     protocol dispatch, 0:HyperSplit, 1:TSS,\n"
+        "                     3:HyperSplit compiled to C\n"
+        "  -g, --gen-max N    trees of more nodes and bucket rules are walked,\n"
+        "                     not compiled, default 65536 (HyperSplit\n"
+        "                     compiled to C, by $CC or cc)\n"
+        "  -b, --gen-batch N  lookups walk the tree after an update until N\n"
+        "                     rules are updated and it is compiled again,\n"
+        "                     default 1024 (HyperSplit compiled to C)\n"
+        "  -e, --encode       range encode port ranges of range rules, the\n"
+        "                     classes fit the rules and the -u rules, other\n"
+        "                     inserts with new port bounds fail (TSS)\n"
+        "  -D, --dedup        drop duplicated prefix rules of range rules,\n"
+        "                     keeping the highest priority, not with -A or\n"
+        "                     -m (TSS)\n"
+        "  -j, --threads N    threads for tree building (HyperSplit) and\n"
+        "                     range to prefix conversion (TSS)\n"
+        "  -d, --depth N      tree depth limit, deeper rules are searched\n"
+        "                     linearly in leaf buckets (HyperSplit)\n"
+        "  -S, --sample FILE  fit the splits to the traffic of a sample trace\n"
+        "                     for a lower expected depth (HyperSplit)\n"
+        "  -C, --copy-weight W split for the smaller side plus W times the rules\n"
+        "                     copied to both sides, for smaller trees\n"
+        "                     (HyperSplit)\n"
+        "  -G, --dag          share identical subtrees of the tree, the tree\n"
+        "                     cannot be updated then (HyperSplit)\n"
+        "  -L, --lazy N       build the subtrees from depth N on at their first\n"
+        "                     lookup (HyperSplit)\n"
+        "  -B, --background   build the lazy subtrees in the background too\n"
+        "  -R, --rebalance N  rebuild the subtrees updates made N levels deeper\n"
+        "                     than they were built (HyperSplit)\n"
+        "  -F, --flat         look up in a compact copy of the tree, several\n"
+        "                     packets at a time, redone after each update,\n"
+        "                     not with -G (HyperSplit)\n"
+        "  -K, --top N        lay the top N levels of the compact tree out in\n"
+        "                     breadth first (Eytzinger) order, walked without\n"
+        "                     child indices and prefetched ahead, implies -F\n"
+        "                     (HyperSplit)\n"
+        "  -I, --per-rule     insert the update rules one by one instead of\n"
+        "                     as a batch (HyperSplit)\n"
+        "  -X, --shadow       drop the rules covered by a higher priority rule\n"
+        "                     before building, not with -A or -m\n"
+        "  -E, --shadow-exact drop the rules covered by higher priority rules\n"
+        "                     together as well, quadratic in the rule number,\n"
+        "                     not with -A or -m\n"
+        "  -M, --budget N[KMG] memory budget of a tree with its rules, the\n"
+        "                     build takes 7/8 of it and turns subtrees over\n"
+        "                     that into leaf buckets, an update over the\n"
+        "                     budget builds the tree again (HyperSplit, per\n"
+        "                     tree with protocol dispatch)\n"
+        "  -H, --heat-out FILE write the visits of the trace to the tree nodes\n"
+        "                     or tuples to FILE (HyperSplit, TSS)\n"
+        "  -Y, --heat-in FILE lay the compact tree out hot path first by the\n"
+        "                     visits in FILE, until the next update\n"
+        "                     (HyperSplit)\n"
+        "  -A, --all          search every rule each packet matches as well,\n"
+        "                     timed on its own, the leaves keep all their\n"
+        "                     rules (HyperSplit, TSS)\n"
+        "  -m, --mixed N      run N mixed insert/delete/lookup operations,\n"
+        "                     inserts are drawn from the update file and\n"
+        "                     deleted rules, lookups from the trace\n"
+        "  -x, --ratio I:D:L  operation ratio of the mixed run, default 1:1:8\n"
+        "  -s, --seed N       random seed of the mixed run, default 1\n"
+        "  -P, --profile      report build phase times per depth and the\n"
+        "                     peak transient memory\n"
         "\n";
 
     printf("%s", help);
     return;
 }
 
+/* bytes with an optional K, M or G suffix */
+static size_t parse_size(const char *arg)
+{
+    char *end;
+    size_t size = strtoull(arg, &end, 10);
+
+    switch (*end) {
+    case 'G': case 'g': size <<= 10; /* fall through */
+    case 'M': case 'm': size <<= 10; /* fall through */
+    case 'K': case 'k': size <<= 10;
+        end++;
+    }
+
+    if (end == arg || *end != '\0' || size == 0) {
+        fprintf(stderr, "Illegal size %s\n", arg);
+        exit(-1);
+    }
+
+    return size;
+}
+
 static void parse_args(int argc, char *argv[])
 {
     int option;
-    static const char *optstr = "hr:t:u:a:";
+    static const char *optstr = "hr:t:u:a:i:g:b:eDj:d:M:S:C:GL:BR:FK:IXEH:Y:Am:x:s:P";
     static struct option longopts[] = {
         {"help", no_argument, NULL, 'h'},
         {"rule", required_argument, NULL, 'r'},
         {"trace", required_argument, NULL, 't'},
         {"update", required_argument, NULL, 'u'},
         {"algorithm", required_argument, NULL, 'a'},
+        {"inner", required_argument, NULL, 'i'},
+        {"gen-max", required_argument, NULL, 'g'},
+        {"gen-batch", required_argument, NULL, 'b'},
+        {"encode", no_argument, NULL, 'e'},
+        {"dedup", no_argument, NULL, 'D'},
+        {"threads", required_argument, NULL, 'j'},
+        {"depth", required_argument, NULL, 'd'},
+        {"budget", required_argument, NULL, 'M'},
+        {"sample", required_argument, NULL, 'S'},
+        {"copy-weight", required_argument, NULL, 'C'},
+        {"dag", no_argument, NULL, 'G'},
+        {"lazy", required_argument, NULL, 'L'},
+        {"background", no_argument, NULL, 'B'},
+        {"rebalance", required_argument, NULL, 'R'},
+        {"flat", no_argument, NULL, 'F'},
+        {"top", required_argument, NULL, 'K'},
+        {"per-rule", no_argument, NULL, 'I'},
+        {"shadow", no_argument, NULL, 'X'},
+        {"shadow-exact", no_argument, NULL, 'E'},
+        {"heat-out", required_argument, NULL, 'H'},
+        {"heat-in", required_argument, NULL, 'Y'},
+        {"all", no_argument, NULL, 'A'},
+        {"mixed", required_argument, NULL, 'm'},
+        {"ratio", required_argument, NULL, 'x'},
+        {"seed", required_argument, NULL, 's'},
+        {"profile", no_argument, NULL, 'P'},
         {NULL, 0, NULL, 0}
     };
 
@@ -71,9 +254,131 @@ static void parse_args(int argc, char *argv[])
             assert(cfg.algrthm_id >= 0 && cfg.algrthm_id < ALGO_NUM);
             break;
 
+        case 'i':
+            proto_cfg.algo = atoi(optarg);
+            assert(proto_cfg.algo >= 0 && proto_cfg.algo < ALGO_NUM &&
+                    proto_cfg.algo != ALGO_PROTO);
+            break;
+
+        case 'g':
+            hs_gen_cfg.max_nodes = atoi(optarg);
+            assert(hs_gen_cfg.max_nodes > 0);
+            break;
+
+        case 'b':
+            hs_gen_cfg.batch = atoi(optarg);
+            assert(hs_gen_cfg.batch > 0);
+            break;
+
+        case 'e':
+            tss_cfg.cvt_flags |= RNG2PRFX_ENCODE;
+            break;
+
+        case 'D':
+            tss_cfg.cvt_flags |= RNG2PRFX_DEDUP;
+            break;
+
+        case 'j':
+            tss_cfg.cvt_threads = atoi(optarg);
+            assert(tss_cfg.cvt_threads > 0);
+            hs_cfg.threads = tss_cfg.cvt_threads;
+            break;
+
+        case 'd':
+            hs_cfg.max_depth = atoi(optarg);
+            assert(hs_cfg.max_depth > 0);
+            break;
+
+        case 'C':
+            hs_cfg.copy_weight = atof(optarg);
+            assert(hs_cfg.copy_weight >= 0);
+            break;
+
+        case 'G':
+            hs_cfg.dag = 1;
+            break;
+
+        case 'L':
+            hs_cfg.lazy_depth = atoi(optarg);
+            assert(hs_cfg.lazy_depth > 0);
+            break;
+
+        case 'B':
+            hs_cfg.lazy_bg = 1;
+            break;
+
+        case 'R':
+            hs_cfg.rebalance_slack = atoi(optarg);
+            assert(hs_cfg.rebalance_slack > 0);
+            break;
+
+        case 'F':
+            hs_cfg.flat = 1;
+            break;
+
+        case 'K':
+            hs_cfg.flat_top = atoi(optarg);
+            assert(hs_cfg.flat_top > 0 && hs_cfg.flat_top <= HS_TOP_MAX);
+            hs_cfg.flat = 1;
+            break;
+
+        case 'I':
+            hs_cfg.insrt_batch = 0;
+            break;
+
+        case 'X':
+            cfg.shadow = 1;
+            break;
+
+        case 'E':
+            cfg.shadow = 1 + SHADOW_EXACT;
+            break;
+
+        case 'M':
+            hs_cfg.mem_budget = parse_size(optarg);
+            break;
+
+        case 'H':
+            cfg.heat_out = optarg;
+            break;
+
+        case 'Y':
+            cfg.heat_in = optarg;
+            break;
+
+        case 'A':
+            cfg.multi = 1;
+            hs_cfg.multi = 1;
+            break;
+
+        case 'm':
+            cfg.mixed_ops = atoi(optarg);
+            assert(cfg.mixed_ops > 0);
+            break;
+
+        case 'x':
+            if (sscanf(optarg, "%d:%d:%d", &cfg.ratio[OP_INSERT],
+                &cfg.ratio[OP_DELETE], &cfg.ratio[OP_LOOKUP]) != 3 ||
+                cfg.ratio[OP_INSERT] < 0 || cfg.ratio[OP_DELETE] < 0 ||
+                cfg.ratio[OP_LOOKUP] < 0 || cfg.ratio[OP_INSERT] +
+                cfg.ratio[OP_DELETE] + cfg.ratio[OP_LOOKUP] == 0) {
+                fprintf(stderr, "Illegal ratio %s\n", optarg);
+                exit(-1);
+            }
+            break;
+
+        case 's':
+            cfg.seed = strtoull(optarg, NULL, 0);
+            break;
+
+        case 'P':
+            pc_prof_enable = 1;
+            break;
+
         case 'r':
         case 't':
         case 'u':
+        case 'S':
             if (access(optarg, F_OK) == -1) {
                 perror(optarg);
                 exit(-1);
@@ -84,6 +389,8 @@ static void parse_args(int argc, char *argv[])
                     cfg.trace_file = optarg;
                 } else if (option == 'u') {
                     cfg.u_rule_file = optarg;
+                } else if (option == 'S') {
+                    cfg.sample_file = optarg;
                 }
                 break;
             }
@@ -94,17 +401,319 @@ static void parse_args(int argc, char *argv[])
         }
     }
 
+    /* a merged prefix rule keeps the highest priority of its duplicates */
+    if ((tss_cfg.cvt_flags & RNG2PRFX_DEDUP) &&
+            (cfg.multi || cfg.mixed_ops > 0)) {
+        fprintf(stderr, "Deduplicated rules cannot report all matches "
+                "or be deleted, -D does not go with -A or -m\n");
+        exit(-1);
+    }
+
+    /* a shadowed rule still matches, and a delete can uncover it */
+    if (cfg.shadow && (cfg.multi || cfg.mixed_ops > 0)) {
+        fprintf(stderr, "Shadowed rules are needed by all matches and "
+                "deletes, -X and -E do not go with -A or -m\n");
+        exit(-1);
+    }
+
     return;
 }
 
+/* xorshift64*, the sequence only depends on the seed */
+static uint64_t rand_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static int make_units(struct rule_unit *units, const struct rule_set *rs)
+{
+    int i, n = 0;
+
+    for (i = 0; i < rs->num; i++) {
+        if (i == 0 || (rs->r_rules && rs->r_rules[i].pri != rs->r_rules[i - 1].pri) ||
+            (rs->p_rules && rs->p_rules[i].pri != rs->p_rules[i - 1].pri)) {
+            units[n].rs.r_rules = rs->r_rules ? &rs->r_rules[i] : NULL;
+            units[n].rs.p_rules = rs->p_rules ? &rs->p_rules[i] : NULL;
+            units[n].rs.num = 0;
+            n++;
+        }
+        units[n - 1].rs.num++;
+    }
+
+    return n;
+}
+
+static int unit_match(const struct rule_unit *u, const struct packet *pkt)
+{
+    static const int bits[DIM_MAX] = {32, 32, 16, 16, 8};
+    int i, d;
+    uint32_t v;
+
+    for (i = 0; i < u->rs.num; i++) {
+        for (d = 0; d < DIM_MAX; d++) {
+            v = pkt->val[d].u32;
+            if (u->rs.r_rules) {
+                if (v < u->rs.r_rules[i].dim[d][0].u32 ||
+                    v > u->rs.r_rules[i].dim[d][1].u32) {
+                    break;
+                }
+            } else if (u->rs.p_rules[i].len[d] != 0 &&
+                ((v ^ u->rs.p_rules[i].dim[d].u32) >>
+                 (bits[d] - u->rs.p_rules[i].len[d])) != 0) {
+                break;
+            }
+        }
+        if (d == DIM_MAX) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t percentile(uint64_t *lat, int num, double pct)
+{
+    int i = (int)(num * pct / 100);
+
+    return num == 0 ? 0 : lat[i < num ? i : num - 1];
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+    uint64_t la = *(const uint64_t *)a, lb = *(const uint64_t *)b;
+
+    return la < lb ? -1 : la > lb;
+}
+
+static void print_latency(const char *name, uint64_t *lat, int num)
+{
+    qsort(lat, num, sizeof(*lat), lat_cmp);
+    printf("%s latency(ns): p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+            name, percentile(lat, num, 50), percentile(lat, num, 90),
+            percentile(lat, num, 99), percentile(lat, num, 99.9),
+            percentile(lat, num, 100));
+}
+
+/*
+ * Interleave inserts, deletes and lookups in a seeded order. Each update is
+ * timed on its own, a run of consecutive lookups is timed as a whole.
+ */
+static int run_mixed(void **rt, const struct rule_set *rs,
+        const struct rule_set *u_rs, const struct trace *t)
+{
+    struct algo_t *algo = &algrthms[cfg.algrthm_id];
+    struct rule_unit *units, *u;
+    struct timespec starttime, stoptime;
+    uint64_t state = cfg.seed ? cfg.seed : 1;
+    uint64_t *lat[OP_LOOKUP], lkup_time = 0;
+    int *live, *dead, live_num, dead_num, unit_num, base_num;
+    int cnt[OP_NUM] = {0}, ratio_all, op, run, i, j, k, best, c, miss;
+    int skip = 0, ret = 0;
+    uint8_t *ops;
+    volatile int sink = 0;
+
+    ratio_all = cfg.ratio[OP_INSERT] + cfg.ratio[OP_DELETE] + cfg.ratio[OP_LOOKUP];
+    if (cfg.ratio[OP_LOOKUP] && t == NULL) {
+        fprintf(stderr, "Lookups need a trace\n");
+        return -1;
+    }
+
+    units = calloc(rs->num + u_rs->num, sizeof(*units));
+    live = malloc((rs->num + u_rs->num) * sizeof(*live));
+    dead = malloc((rs->num + u_rs->num) * sizeof(*dead));
+    ops = malloc(cfg.mixed_ops * sizeof(*ops));
+    lat[OP_INSERT] = malloc(cfg.mixed_ops * sizeof(**lat));
+    lat[OP_DELETE] = malloc(cfg.mixed_ops * sizeof(**lat));
+    if (!units || !live || !dead || !ops || !lat[OP_INSERT] || !lat[OP_DELETE]) {
+        perror("Cannot allocate memory for mixed run");
+        exit(-1);
+    }
+
+    base_num = make_units(units, rs);
+    unit_num = base_num + make_units(units + base_num, u_rs);
+
+    for (live_num = dead_num = 0, i = 0; i < unit_num; i++) {
+        if (i < base_num) {
+            units[i].pos = live_num;
+            live[live_num++] = i;
+        } else {
+            units[i].pos = dead_num;
+            dead[dead_num++] = i;
+        }
+    }
+
+    for (i = 0; i < cfg.mixed_ops; i++) {
+        k = rand_next(&state) % ratio_all;
+        ops[i] = k < cfg.ratio[OP_INSERT] ? OP_INSERT :
+            k < cfg.ratio[OP_INSERT] + cfg.ratio[OP_DELETE] ? OP_DELETE : OP_LOOKUP;
+    }
+
+    printf("Mixed run: %d ops, ratio %d:%d:%d, seed %lu\n", cfg.mixed_ops,
+            cfg.ratio[OP_INSERT], cfg.ratio[OP_DELETE], cfg.ratio[OP_LOOKUP],
+            cfg.seed);
+
+    for (i = 0; i < cfg.mixed_ops; i += run) {
+        op = ops[i];
+        run = 1;
+
+        if (op == OP_LOOKUP) {
+            for (; i + run < cfg.mixed_ops && ops[i + run] == OP_LOOKUP; run++);
+
+            clock_gettime(CLOCK_MONOTONIC, &starttime);
+            for (j = 0; j < run; j++) {
+                k = rand_next(&state) % t->num;
+                sink += algo->classify(&t->pkts[k], rt);
+            }
+            clock_gettime(CLOCK_MONOTONIC, &stoptime);
+            lkup_time += make_timediff_ns(&starttime, &stoptime);
+            cnt[OP_LOOKUP] += run;
+            continue;
+        }
+
+        /* nothing to insert or delete, flip the operation */
+        if ((op == OP_INSERT && dead_num == 0) || (op == OP_DELETE && live_num <= 1)) {
+            op = OP_INSERT + OP_DELETE - op;
+        }
+        /* nor the other way, e.g. one base rule and no update rules */
+        if ((op == OP_INSERT && dead_num == 0) || (op == OP_DELETE && live_num <= 1)) {
+            skip++;
+            continue;
+        }
+
+        if (op == OP_INSERT) {
+            k = rand_next(&state) % dead_num;
+            u = &units[dead[k]];
+            dead[k] = dead[--dead_num];
+            units[dead[k]].pos = k;
+            u->pos = live_num;
+            live[live_num++] = u - units;
+        } else {
+            k = rand_next(&state) % live_num;
+            u = &units[live[k]];
+            live[k] = live[--live_num];
+            units[live[k]].pos = k;
+            u->pos = dead_num;
+            dead[dead_num++] = u - units;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &starttime);
+        if ((op == OP_INSERT ? algo->insrt_update : algo->delete_update)(&u->rs, rt) != 0) {
+            fprintf(stderr, "%s failed\n", op == OP_INSERT ? "Inserting" : "Deleting");
+            ret = -1;
+            goto out;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stoptime);
+        lat[op][cnt[op]++] = make_timediff_ns(&starttime, &stoptime);
+    }
+
+    printf("Inserts: %d, Deletes: %d, Lookups: %d, Live rules: %d\n",
+            cnt[OP_INSERT], cnt[OP_DELETE], cnt[OP_LOOKUP], live_num);
+    if (skip) {
+        printf("Skipped updates: %d, no rule to insert or delete\n", skip);
+    }
+    print_latency("Insert", lat[OP_INSERT], cnt[OP_INSERT]);
+    print_latency("Delete", lat[OP_DELETE], cnt[OP_DELETE]);
+    if (cnt[OP_LOOKUP] && lkup_time) {
+        printf("Lookup speed under updates: %lld(pps)\n",
+                (cnt[OP_LOOKUP] * 1000000000ULL) / lkup_time);
+    }
+
+    /* check against a linear search of the live rules */
+    if (t != NULL) {
+        for (miss = 0, i = 0; i < t->num && i < VERIFY_PKT_MAX; i++) {
+            for (best = -1, j = 0; j < live_num; j++) {
+                u = &units[live[j]];
+                c = u->rs.r_rules ? u->rs.r_rules[0].pri : u->rs.p_rules[0].pri;
+                if ((best == -1 || c < best) && unit_match(u, &t->pkts[i])) {
+                    best = c;
+                }
+            }
+            if (algo->classify(&t->pkts[i], rt) != best) {
+                miss++;
+            }
+        }
+        printf("Verified %d packets, %d mismatched\n", i, miss);
+        if (miss) {
+            ret = -1;
+        }
+    }
+
+out:
+    free(units);
+    free(live);
+    free(dead);
+    free(ops);
+    free(lat[OP_INSERT]);
+    free(lat[OP_DELETE]);
+
+    return ret;
+}
+
+/*
+ * Every match of each packet, timed apart from the first match searching.
+ * The highest priority one must be the match of the trace.
+ */
+static int search_all(void **rt, const struct trace *t)
+{
+    struct algo_t *algo = &algrthms[cfg.algrthm_id];
+    struct timeval starttime, stoptime;
+    uint64_t timediff, total = 0;
+    int *pri, i, n, miss = 0;
+
+    if (algo->classify_all == NULL) {
+        fprintf(stderr, "Multi-match is not supported by the algorithm\n");
+        return -1;
+    }
+
+    pri = malloc(RULE_MAX * sizeof(*pri));
+    if (pri == NULL) {
+        perror("Cannot allocate memory for matches");
+        exit(-1);
+    }
+
+    printf("Multi-match searching\n");
+
+    gettimeofday(&starttime, NULL);
+    for (i = 0; i < t->num; i++) {
+        if ((n = algo->classify_all(&t->pkts[i], rt, pri, RULE_MAX)) < 0) {
+            break;
+        }
+        total += n;
+        if ((n ? pri[0] : -1) != t->pkts[i].match) {
+            miss++;
+        }
+    }
+    gettimeofday(&stoptime, NULL);
+    timediff = make_timediff(&starttime, &stoptime);
+    free(pri);
+
+    if (i < t->num || miss) {
+        fprintf(stderr, "Multi-match searching failed, %d mismatched\n", miss);
+        return -1;
+    }
+
+    printf("Multi-match searching pass\n");
+    printf("Time for multi-match searching: %ld(us)\n", timediff);
+    printf("Multi-match searching speed: %lld(pps)\n",
+            (t->num * 1000000ULL) / (timediff ? timediff : 1));
+    printf("Matches per packet: %.2f\n", (double)total / t->num);
+
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     uint64_t timediff;
     struct timeval starttime, stoptime;
     struct rule_set rs = {NULL, NULL, 0};
     struct rule_set u_rs = {NULL, NULL, 0};
-    struct trace t;
+    struct trace t, sample = {NULL, 0};
+    struct pc_stats st;
     void *rt = NULL;
+    int removed;
 
     if (argc < 2) {
         print_help();
@@ -121,13 +730,39 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
-    algrthms[cfg.algrthm_id].load_rules(&rs, cfg.rule_file);
+    if (algrthms[cfg.algrthm_id].load_rules(&rs, cfg.rule_file) != 0) {
+        exit(-1);
+    }
+    if (cfg.shadow) {
+        gettimeofday(&starttime, NULL);
+        removed = rm_shadow_rules(&rs, cfg.shadow - 1);
+        gettimeofday(&stoptime, NULL);
+        if (removed < 0) {
+            fprintf(stderr, "Cannot remove shadowed rules\n");
+            unload_rules(&rs);
+            exit(-1);
+        }
+        printf("Removed %d shadowed rules in %lu(us), %d left\n", removed,
+                make_timediff(&starttime, &stoptime), rs.num);
+    }
+    if (cfg.u_rule_file != NULL) {
+        if (algrthms[cfg.algrthm_id].load_rules(&u_rs, cfg.u_rule_file) != 0) {
+            unload_rules(&rs);
+            exit(-1);
+        }
+        tss_cfg.enc_more = &u_rs;
+    }
+    if (cfg.sample_file != NULL) {
+        load_trace(&sample, cfg.sample_file);
+        hs_cfg.sample = &sample;
+    }
 
     printf("Building\n");
 
     gettimeofday(&starttime, NULL);
     if (algrthms[cfg.algrthm_id].build(&rs, &rt) != 0) {
         fprintf(stderr, "Building failed\n");
+        unload_rules(&u_rs);
         unload_rules(&rs);
         exit(-1);
     }
@@ -137,6 +772,40 @@ int main(int argc, char *argv[])
     printf("Building pass\n");
     printf("Time for building: %ld(us)\n", timediff);
 
+    if (cfg.sample_file != NULL) {
+        hs_cfg.sample = NULL;
+        unload_trace(&sample);
+    }
+
+    algrthms[cfg.algrthm_id].stats(&rt, &st);
+    print_pc_stats(&st);
+
+    /*
+     * Mixed updating and searching
+     */
+    if (cfg.mixed_ops > 0) {
+        if (cfg.trace_file != NULL) {
+            load_trace(&t, cfg.trace_file);
+        }
+
+        if (run_mixed(&rt, &rs, &u_rs, cfg.trace_file ? &t : NULL) != 0) {
+            fprintf(stderr, "Mixed run failed\n");
+            exit(-1);
+        }
+        printf("Mixed run pass\n");
+
+        algrthms[cfg.algrthm_id].stats(&rt, &st);
+        print_pc_stats(&st);
+
+        unload_rules(&u_rs);
+        unload_rules(&rs);
+        if (cfg.trace_file != NULL) {
+            unload_trace(&t);
+        }
+        algrthms[cfg.algrthm_id].cleanup(&rt);
+        return 0;
+    }
+
     unload_rules(&rs);
 
     /*
@@ -145,8 +814,6 @@ int main(int argc, char *argv[])
     if (cfg.u_rule_file != NULL) {
         printf("Updating\n");
 
-        algrthms[cfg.algrthm_id].load_rules(&u_rs, cfg.u_rule_file);
-
         gettimeofday(&starttime, NULL);
         if (algrthms[cfg.algrthm_id].insrt_update(&u_rs, &rt) != 0) {
             fprintf(stderr, "Updating failed\n");
@@ -159,6 +826,9 @@ int main(int argc, char *argv[])
         printf("Updating pass\n");
         printf("Time for updating: %ld(us)\n", timediff);
 
+        algrthms[cfg.algrthm_id].stats(&rt, &st);
+        print_pc_stats(&st);
+
         unload_rules(&u_rs);
     }
 
@@ -172,6 +842,35 @@ int main(int argc, char *argv[])
 
     load_trace(&t, cfg.trace_file);
 
+    /*
+     * Traffic profile
+     */
+    if (cfg.heat_out && !algrthms[cfg.algrthm_id].heat_export) {
+        fprintf(stderr, "Traffic profiles are not supported by the algorithm\n");
+        cfg.heat_out = NULL;
+    }
+    if (cfg.heat_in && !algrthms[cfg.algrthm_id].heat_relayout) {
+        fprintf(stderr, "Traffic profile layouts are not supported by the algorithm\n");
+        cfg.heat_in = NULL;
+    }
+    if (cfg.heat_out != NULL) {
+        if (algrthms[cfg.algrthm_id].heat_export(&t, &rt, cfg.heat_out) != 0) {
+            fprintf(stderr, "Cannot write the traffic profile\n");
+        } else {
+            printf("Traffic profile of %d packets written to %s\n", t.num, cfg.heat_out);
+        }
+    }
+    if (cfg.heat_in != NULL) {
+        gettimeofday(&starttime, NULL);
+        if (algrthms[cfg.algrthm_id].heat_relayout(cfg.heat_in, &rt) != 0) {
+            fprintf(stderr, "Cannot lay out by the traffic profile\n");
+        } else {
+            gettimeofday(&stoptime, NULL);
+            printf("Laid out by %s in %lu(us)\n", cfg.heat_in,
+                    make_timediff(&starttime, &stoptime));
+        }
+    }
+
     printf("Searching\n");
 
     gettimeofday(&starttime, NULL);
@@ -188,6 +887,12 @@ int main(int argc, char *argv[])
     printf("Time for searching: %ld(us)\n", timediff);
     printf("Searching speed: %lld(pps)\n", (t.num * 1000000ULL) / timediff);
 
+    if (cfg.multi && search_all(&rt, &t) != 0) {
+        unload_trace(&t);
+        algrthms[cfg.algrthm_id].cleanup(&rt);
+        exit(-1);
+    }
+
     unload_trace(&t);
     algrthms[cfg.algrthm_id].cleanup(&rt);
 
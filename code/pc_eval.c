@@ -23,12 +23,28 @@
  *                5. Support multi algorithms (Xiaohe Hu)
  *
  *                6. Move logic to *_sim.c
+ *
+ *                7. Add print_pc_stats for algo_t.stats
+ *
+ *                8. Add build profiler
+ *
+ *                9. Add protocol dispatch algorithm
+ *
+ *               10. Add HyperSplit compiled to C
+ *
+ *               11. Add traffic profiles of HyperSplit and TSS
+ *
+ *               12. Add multi-match classification
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "pc_eval.h"
 #include "hs.h"
 #include "tss.h"
+#include "proto.h"
+#include "hs_gen.h"
 
 #define swap(a, b) \
     do { typeof(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
@@ -38,27 +54,252 @@ struct algo_t algrthms[ALGO_NUM] = {
         load_cb_rules,
         hs_build,
         hs_insrt_update,
+        hs_delete_update,
         hs_classify,
         hs_search,
-        hs_cleanup
+        hs_stats,
+        hs_cleanup,
+        hs_heat_export,
+        hs_heat_relayout,
+        hs_classify_all
     },
     {
         load_prfx_rules,
         tss_build,
-        tss_build,
+        tss_insrt_update,
+        tss_delete_update,
         tss_classify,
         tss_search,
-        tss_cleanup
+        tss_stats,
+        tss_cleanup,
+        tss_heat_export,
+        NULL,   /* hot first loses the priority early exit, about 2x slower */
+        tss_classify_all
+    },
+    {
+        proto_load_rules,
+        proto_build,
+        proto_insrt_update,
+        proto_delete_update,
+        proto_classify,
+        proto_search,
+        proto_stats,
+        proto_cleanup,
+        NULL,
+        NULL,
+        proto_classify_all
+    },
+    {
+        load_cb_rules,
+        hs_gen_build,
+        hs_gen_insrt_update,
+        hs_gen_delete_update,
+        hs_gen_classify,
+        hs_gen_search,
+        hs_gen_stats,
+        hs_gen_cleanup,
+        NULL,
+        NULL,
+        hs_gen_classify_all
     }
 };
 
+int pc_prof_enable = 0;
+
 uint64_t make_timediff(struct timeval *start, struct timeval *stop)
 {
     return (1000000ULL * stop->tv_sec + stop->tv_usec) -
         (1000000ULL * start->tv_sec + start->tv_usec);
 }
 
-void load_cb_rules(struct rule_set *rs, const char *rf)
+uint64_t make_timediff_ns(struct timespec *start, struct timespec *stop)
+{
+    return (1000000000ULL * stop->tv_sec + stop->tv_nsec) -
+        (1000000000ULL * start->tv_sec + start->tv_nsec);
+}
+
+struct pc_prof *prof_create(int phase_num, const char * const *phase, int depth_num)
+{
+    struct pc_prof *prof;
+    int i;
+
+    if (!pc_prof_enable) {
+        return NULL;
+    }
+
+    prof = calloc(1, sizeof(*prof));
+    if (prof == NULL) {
+        return NULL;
+    }
+
+    prof->phase_num = phase_num < PROF_PHASE_MAX ? phase_num : PROF_PHASE_MAX;
+    for (i = 0; i < prof->phase_num; i++) {
+        prof->phase[i] = phase[i];
+    }
+    prof->depth_num = depth_num > 0 ? depth_num : 1;
+
+    return prof;
+}
+
+/* a thread losing the race for a chunk takes the one of the winner */
+prof_row_t *prof_grow(struct pc_prof *prof, int chunk)
+{
+    prof_row_t *rows, *cur = NULL;
+
+    rows = calloc(PROF_ROWS_MIN << chunk, sizeof(*rows));
+    if (rows == NULL) {
+        return NULL;
+    }
+    if (!__atomic_compare_exchange_n(&prof->ns[chunk], &cur, rows, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(rows);
+        return cur;
+    }
+
+    return rows;
+}
+
+void prof_destroy(struct pc_prof *prof)
+{
+    int c;
+
+    if (prof == NULL) {
+        return;
+    }
+    for (c = 0; c < PROF_CHUNK_MAX; c++) {
+        SAFE_FREE(prof->ns[c]);
+    }
+    free(prof);
+}
+
+static uint64_t prof_ns(const struct pc_prof *prof, int depth, int phase)
+{
+    int c = prof_chunk(depth);
+
+    if (prof->ns[c] == NULL) {
+        return 0;
+    }
+
+    return prof->ns[c][depth - PROF_ROWS_MIN * ((1 << c) - 1)][phase];
+}
+
+static void print_pc_prof(const struct pc_prof *prof)
+{
+    uint64_t sum[PROF_PHASE_MAX] = {0}, row;
+    int c, i, j, end, last;
+
+    /* deepest depth with any time charged, up to the last chunk */
+    for (c = PROF_CHUNK_MAX - 1; c > 0 && prof->ns[c] == NULL; c--);
+    end = PROF_ROWS_MIN * ((1 << (c + 1)) - 1);
+    if (end > prof->depth_num) {
+        end = prof->depth_num;
+    }
+    for (last = -1, i = 0; i < end; i++) {
+        for (j = 0; j < prof->phase_num; j++) {
+            if (prof_ns(prof, i, j)) {
+                last = i;
+            }
+        }
+    }
+
+    printf("build profile (us)\ndepth   ");
+    for (j = 0; j < prof->phase_num; j++) {
+        printf("%-10s", prof->phase[j]);
+    }
+    printf("total\n");
+
+    for (i = 0; i <= last; i++) {
+        printf("%-8d", i);
+        for (row = 0, j = 0; j < prof->phase_num; j++) {
+            printf("%-10lu", prof_ns(prof, i, j) / 1000);
+            sum[j] += prof_ns(prof, i, j);
+            row += prof_ns(prof, i, j);
+        }
+        printf("%lu\n", row / 1000);
+    }
+
+    printf("all     ");
+    for (row = 0, j = 0; j < prof->phase_num; j++) {
+        printf("%-10lu", sum[j] / 1000);
+        row += sum[j];
+    }
+    printf("%lu\n", row / 1000);
+    printf("peak_transient_memory = %lu bytes\n", prof->peak_bytes);
+
+    return;
+}
+
+void print_pc_stats(const struct pc_stats *st)
+{
+    int i;
+
+    printf("rule_num = %lu\n", st->rule_num);
+    printf("total_memory = %lu bytes\n", st->bytes);
+    if (st->sub_num) {
+        printf("sub_classifiers = %lu\n", st->sub_num);
+    }
+
+    if (st->tuple_num) {
+        printf("tuple_num = %lu\n", st->tuple_num);
+        printf("hash_items = %lu\n", st->item_num);
+    }
+    if (st->node_num + st->leaf_num) {
+        printf("segment_num = ");
+        for (i = 0; i < DIM_MAX; i++) {
+            printf("%lu ", st->segment_num[i]);
+        }
+        printf("\nworst_depth = %lu\n", st->worst_depth);
+        printf("average_depth = %f\n", st->average_depth);
+        if (st->sample_depth > 0) {
+            printf("sample_average_depth = %f\n", st->sample_depth);
+        }
+        printf("tree_node_num = %lu\n", st->node_num);
+        printf("leaf_node_num = %lu\n", st->leaf_num);
+        if (st->bucket_num) {
+            printf("bucket_num = %lu\n", st->bucket_num);
+        }
+        if (st->dag_node_num + st->dag_leaf_num) {
+            printf("dag_node_num = %lu\n", st->dag_node_num);
+            printf("dag_leaf_num = %lu\n", st->dag_leaf_num);
+        }
+        if (st->stub_num) {
+            printf("stub_num = %lu\n", st->stub_num);
+        }
+        if (st->rebuild_num) {
+            printf("subtree_rebuilds = %lu\n", st->rebuild_num);
+        }
+        if (st->flat_num) {
+            printf("flat_node_num = %lu\n", st->flat_num);
+        }
+        if (st->flat_top) {
+            printf("flat_top_levels = %lu\n", st->flat_top);
+        }
+    }
+    printf("replication = %f\n", st->replication);
+    if (st->code_bytes) {
+        printf("code_bytes = %lu\n", st->code_bytes);
+    }
+    if (st->split_copies) {
+        printf("split_copies = %lu\n", st->split_copies);
+    }
+
+    if (st->node_num + st->leaf_num) {
+        printf("depth   node    intrnl  leaf\n");
+        for (i = 0; i < st->depth_num; i++) {
+            printf("%-8d%-8lu%-8lu%-8lu\n", i, st->depth_node[i][0] +
+                st->depth_node[i][1], st->depth_node[i][0],
+                st->depth_node[i][1]);
+        }
+    }
+    if (st->prof != NULL) {
+        print_pc_prof(st->prof);
+    }
+    printf("\n");
+
+    return;
+}
+
+int load_cb_rules(struct rule_set *rs, const char *rf)
 {
     FILE *rule_fp;
     uint32_t src_ip, src_ip_0, src_ip_1, src_ip_2, src_ip_3, src_ip_mask;
@@ -71,21 +312,21 @@ void load_cb_rules(struct rule_set *rs, const char *rf)
     printf("Loading rules from %s\n", rf);
 
     if ((rule_fp = fopen(rf, "r")) == NULL) {
-        fprintf(stderr, "Cannot open file %s", rf);
-        exit(-1);
+        fprintf(stderr, "Cannot open file %s\n", rf);
+        return -1;
     }
 
     rs->r_rules = calloc(RULE_MAX, sizeof(*rs->r_rules));
     if (rs->r_rules == NULL) {
         perror("Cannot allocate memory for rules");
-        exit(-1);
+        goto err;
     }
     rs->num = 0;
 
     while (!feof(rule_fp)) {
         if (i >= RULE_MAX) {
             fprintf(stderr, "Too many rules\n");
-            exit(-1);
+            goto err;
         }
 
         if (fscanf(rule_fp, CB_RULE_FMT,
@@ -94,7 +335,7 @@ void load_cb_rules(struct rule_set *rs, const char *rf)
             &src_port_begin, &src_port_end, &dst_port_begin, &dst_port_end,
             &proto, &proto_mask, &rule_id) != 17) {
             fprintf(stderr, "Illegal rule format\n");
-            exit(-1);
+            goto err;
         }
 
         /* src ip */
@@ -140,7 +381,7 @@ void load_cb_rules(struct rule_set *rs, const char *rf)
             rs->r_rules[i].dim[DIM_PROTO][1].u8 = 0xff;
         } else {
             fprintf(stderr, "Protocol mask error: %02x\n", proto_mask);
-            exit(-1);
+            goto err;
         }
 
         rs->r_rules[i].pri = rule_id - 1;
@@ -153,10 +394,30 @@ void load_cb_rules(struct rule_set *rs, const char *rf)
 
     printf("%d rules loaded\n", rs->num);
 
-    return;
+    return 0;
+
+err:
+    fclose(rule_fp);
+    unload_rules(rs);
+    rs->num = 0;
+    return -1;
 }
 
-void load_prfx_rules(struct rule_set *rs, const char *rf)
+/* classbench port ranges are "begin : end", prefix rules are "port/len" */
+static int is_cb_rule_file(FILE *rule_fp)
+{
+    char line[256];
+    int ret = 0;
+
+    if (fgets(line, sizeof(line), rule_fp) != NULL) {
+        ret = strstr(line, " : ") != NULL;
+    }
+    rewind(rule_fp);
+
+    return ret;
+}
+
+int load_prfx_rules(struct rule_set *rs, const char *rf)
 {
     FILE *rule_fp;
     uint32_t src_ip, src_ip_0, src_ip_1, src_ip_2, src_ip_3, src_ip_mask;
@@ -166,24 +427,30 @@ void load_prfx_rules(struct rule_set *rs, const char *rf)
     uint32_t rule_id;
     unsigned int i = 0;
 
-    printf("Loading rules from %s\n", rf);
-
     if ((rule_fp = fopen(rf, "r")) == NULL) {
-        fprintf(stderr, "Cannot open file %s", rf);
-        exit(-1);
+        fprintf(stderr, "Cannot open file %s\n", rf);
+        return -1;
+    }
+
+    /* range rules are split into prefix rules by the engine */
+    if (is_cb_rule_file(rule_fp)) {
+        fclose(rule_fp);
+        return load_cb_rules(rs, rf);
     }
 
+    printf("Loading rules from %s\n", rf);
+
     rs->p_rules = calloc(RULE_MAX, sizeof(*rs->p_rules));
     if (rs->p_rules == NULL) {
         perror("Cannot allocate memory for rules");
-        exit(-1);
+        goto err;
     }
     rs->num = 0;
 
     while (!feof(rule_fp)) {
         if (i >= RULE_MAX) {
             fprintf(stderr, "Too many rules\n");
-            exit(-1);
+            goto err;
         }
 
         if (fscanf(rule_fp, PRFX_RULE_FMT,
@@ -192,7 +459,7 @@ void load_prfx_rules(struct rule_set *rs, const char *rf)
             &src_port, &src_port_mask, &dst_port, &dst_port_mask,
             &proto, &proto_mask, &rule_id) != 17) {
             fprintf(stderr, "Illegal rule format\n");
-            exit(-1);
+            goto err;
         }
 
         /* src ip */
@@ -228,7 +495,7 @@ void load_prfx_rules(struct rule_set *rs, const char *rf)
             rs->p_rules[i].len[DIM_PROTO] = 0;
         } else {
             fprintf(stderr, "Protocol mask error: %02x\n", proto_mask);
-            exit(-1);
+            goto err;
         }
 
         rs->p_rules[i].pri = rule_id - 1;
@@ -241,7 +508,13 @@ void load_prfx_rules(struct rule_set *rs, const char *rf)
 
     printf("%d rules loaded\n", rs->num);
 
-    return;
+    return 0;
+
+err:
+    fclose(rule_fp);
+    unload_rules(rs);
+    rs->num = 0;
+    return -1;
 }
 
 void unload_rules(struct rule_set *rs)
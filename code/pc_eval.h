@@ -21,12 +21,25 @@
  *                4. Add split_range_rule function (Xiang Wang)
  *
  *                5. Support multi algorithms (Xiaohe Hu)
+ *
+ *                6. Per-instance statistics through algo_t.stats
+ *
+ *                7. Build profiler
+ *
+ *                8. Protocol dispatch to per protocol classifiers
+ *
+ *                9. HyperSplit compiled to C
+ *
+ *               10. Traffic profile export and relayout through algo_t
+ *
+ *               11. Multi-match classification through algo_t
  */
 
 #ifndef __PC_EVAL_H__
 #define __PC_EVAL_H__
 
 #include <stdint.h>
+#include <time.h>
 #include <sys/time.h>
 
 #define RULE_MAX (1 << 19)  /* 512K */
@@ -51,7 +64,9 @@ enum {
     ALGO_INV = -1,
     ALGO_HS = 0,
     ALGO_TSS = 1,
-    ALGO_NUM = 2
+    ALGO_PROTO = 2,
+    ALGO_HS_GEN = 3,
+    ALGO_NUM = 4
 };
 
 enum {
@@ -101,21 +116,148 @@ struct trace {
     int num;
 };
 
+#define PROF_PHASE_MAX 8
+#define PROF_ROWS_MIN 32    /* rows of the first chunk, each next one doubles */
+#define PROF_CHUNK_MAX 27   /* chunks to cover any int depth */
+
+typedef uint64_t prof_row_t[PROF_PHASE_MAX];
+
+/*
+ * build profiler: phase times per tree depth and the high-water mark of
+ * the transient memory, accumulated over build and updates, safe to update
+ * from several builder threads. The depth rows grow with the tree in
+ * chunks that never move once allocated.
+ */
+struct pc_prof {
+    int phase_num;
+    const char *phase[PROF_PHASE_MAX];
+    int depth_num;          /* depth limit, 1 for flat structures */
+    prof_row_t *ns[PROF_CHUNK_MAX];
+    size_t cur_bytes;
+    size_t peak_bytes;
+};
+
+/* instances built while set carry a profiler */
+extern int pc_prof_enable;
+
+/* classifier statistics, filled by algo_t.stats at any time */
+struct pc_stats {
+    size_t rule_num;        /* live rules */
+    size_t bytes;           /* memory actually allocated */
+    size_t node_num;        /* internal nodes */
+    size_t leaf_num;        /* leaf nodes */
+    size_t tuple_num;       /* tuples */
+    size_t item_num;        /* hash items, including duplicated keys */
+    size_t worst_depth;
+    double average_depth;
+    double sample_depth;    /* average depth of the build sample packets */
+    double replication;     /* rule copies per live rule */
+    size_t split_copies;    /* rules copied to both sides of splits */
+    size_t segment_num[DIM_MAX];
+    size_t bucket_num;      /* leaves holding several rules */
+    size_t dag_node_num;    /* unique internal nodes if subtrees are shared */
+    size_t dag_leaf_num;
+    size_t stub_num;        /* subtrees not built yet */
+    size_t rebuild_num;     /* subtrees rebuilt after updates */
+    size_t sub_num;         /* per protocol classifiers */
+    size_t flat_num;        /* nodes of the compact lookup copy */
+    size_t flat_top;        /* implicit top levels of it */
+    size_t code_bytes;      /* generated lookup code */
+    const size_t (*depth_node)[2];  /* internal & leaf per depth */
+    size_t depth_num;
+    const struct pc_prof *prof;             /* NULL if not profiled */
+};
+
 struct algo_t {
-    void (*load_rules)(struct rule_set *, const char *);
+    int (*load_rules)(struct rule_set *, const char *);
     int (*build)(const struct rule_set *, void *);
     int (*insrt_update)(const struct rule_set *, void *);
+    int (*delete_update)(const struct rule_set *, void *);
     int (*classify)(const struct packet *, const void *);
     int (*search)(const struct trace *, const void *);
+    void (*stats)(const void *, struct pc_stats *);
     void (*cleanup)(void *);
+    /* traffic profiles, NULL if not supported */
+    int (*heat_export)(const struct trace *, const void *, const char *);
+    int (*heat_relayout)(const char *, void *);
+    /* every rule a packet matches, NULL if not supported */
+    int (*classify_all)(const struct packet *, const void *, int *, int);
 };
 
 extern struct algo_t algrthms[ALGO_NUM];
 
 uint64_t make_timediff(struct timeval *start, struct timeval *stop);
+uint64_t make_timediff_ns(struct timespec *start, struct timespec *stop);
+
+void print_pc_stats(const struct pc_stats *st);
+
+struct pc_prof *prof_create(int phase_num, const char * const *phase, int depth_num);
+prof_row_t *prof_grow(struct pc_prof *prof, int chunk);
+void prof_destroy(struct pc_prof *prof);
+
+/* chunk of a depth row, its first row at PROF_ROWS_MIN * ((1 << chunk) - 1) */
+static inline int prof_chunk(int depth)
+{
+    return 31 - __builtin_clz(depth / PROF_ROWS_MIN + 1);
+}
+
+static inline uint64_t prof_now(const struct pc_prof *prof)
+{
+    struct timespec ts;
+
+    if (prof == NULL) {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return 1000000000ULL * ts.tv_sec + ts.tv_nsec;
+}
+
+/* charge the time since *t to a phase, *t restarts from now */
+static inline void prof_phase(struct pc_prof *prof, int depth, int phase, uint64_t *t)
+{
+    prof_row_t *rows;
+    uint64_t now;
+    int c;
+
+    if (prof == NULL) {
+        return;
+    }
+    now = prof_now(prof);
+    if (depth >= prof->depth_num) {
+        depth = prof->depth_num - 1;
+    }
+    c = prof_chunk(depth);
+    rows = __atomic_load_n(&prof->ns[c], __ATOMIC_ACQUIRE);
+    if (rows != NULL || (rows = prof_grow(prof, c)) != NULL) {
+        depth -= PROF_ROWS_MIN * ((1 << c) - 1);
+        __atomic_add_fetch(&rows[depth][phase], now - *t, __ATOMIC_RELAXED);
+    }
+    *t = now;
+}
+
+static inline void prof_alloc(struct pc_prof *prof, size_t bytes)
+{
+    size_t cur, peak;
+
+    if (prof == NULL) {
+        return;
+    }
+    cur = __atomic_add_fetch(&prof->cur_bytes, bytes, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&prof->peak_bytes, __ATOMIC_RELAXED);
+    while (peak < cur && !__atomic_compare_exchange_n(&prof->peak_bytes,
+                &peak, cur, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static inline void prof_free(struct pc_prof *prof, size_t bytes)
+{
+    if (prof != NULL) {
+        __atomic_sub_fetch(&prof->cur_bytes, bytes, __ATOMIC_RELAXED);
+    }
+}
 
-void load_cb_rules(struct rule_set *rs, const char *rf);     // classbench rule format
-void load_prfx_rules(struct rule_set *rs, const char *rf);   // prefix rule format
+/* -1 on a malformed file, nothing is left loaded */
+int load_cb_rules(struct rule_set *rs, const char *rf);     // classbench rule format
+int load_prfx_rules(struct rule_set *rs, const char *rf);   // prefix rule format, or classbench
 void unload_rules(struct rule_set *rs);
 
 void load_trace(struct trace *t, const char *tf);
@@ -0,0 +1,364 @@
+/*
+ *     Filename: proto.c
+ *  Description: Source file for protocol dispatch of packet classification,
+ *               a classifier of any algorithm per protocol
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "proto.h"
+
+struct proto_cfg proto_cfg = {
+    .algo = ALGO_HS,
+};
+
+/* protocol range of rule i of rs */
+static void rule_proto(const struct rule_set *rs, int i, int *lo, int *hi)
+{
+    const struct prfx_rule *p_r;
+
+    if (rs->r_rules != NULL) {
+        *lo = rs->r_rules[i].dim[DIM_PROTO][0].u8;
+        *hi = rs->r_rules[i].dim[DIM_PROTO][1].u8;
+    } else {
+        p_r = &rs->p_rules[i];
+        *lo = p_r->dim[DIM_PROTO].u8 & ~(0xff >> p_r->len[DIM_PROTO]);
+        *hi = *lo | (0xff >> p_r->len[DIM_PROTO]);
+    }
+}
+
+/* calls f(rs, i, sub, arg) for each sub-classifier rule i of rs goes to */
+static void route_rules(const struct proto_cls *pc, const struct rule_set *rs,
+        void (*f)(const struct rule_set *, int, int, void *), void *arg)
+{
+    int i, v, lo, hi;
+
+    for (i = 0; i < rs->num; i++) {
+        rule_proto(rs, i, &lo, &hi);
+        if (lo == hi) {
+            f(rs, i, pc->tbl[lo], arg);
+            continue;
+        }
+        f(rs, i, PROTO_OTHER, arg);
+        for (v = lo; v <= hi; v++) {
+            if (pc->tbl[v] != PROTO_OTHER) {
+                f(rs, i, pc->tbl[v], arg);
+            }
+        }
+    }
+}
+
+static void count_rule(const struct rule_set *rs, int i, int sub, void *arg)
+{
+    ((struct rule_set *)arg)[sub].num++;
+}
+
+static void copy_rule(const struct rule_set *rs, int i, int sub, void *arg)
+{
+    struct rule_set *s = &((struct rule_set *)arg)[sub];
+
+    if (rs->r_rules != NULL) {
+        s->r_rules[s->num] = rs->r_rules[i];
+    }
+    if (rs->p_rules != NULL) {
+        s->p_rules[s->num] = rs->p_rules[i];
+    }
+    s->num++;
+}
+
+static void free_subsets(struct rule_set *subs)
+{
+    int i;
+
+    for (i = 0; i <= PROTO_OTHER; i++) {
+        SAFE_FREE(subs[i].r_rules);
+        SAFE_FREE(subs[i].p_rules);
+    }
+    free(subs);
+}
+
+/* the rules of rs for each sub-classifier, NULL if out of memory */
+static struct rule_set *make_subsets(const struct proto_cls *pc,
+        const struct rule_set *rs)
+{
+    struct rule_set *subs;
+    int i;
+
+    subs = calloc(PROTO_OTHER + 1, sizeof(*subs));
+    if (subs == NULL) {
+        return NULL;
+    }
+
+    route_rules(pc, rs, count_rule, subs);
+
+    for (i = 0; i <= PROTO_OTHER; i++) {
+        if (subs[i].num == 0) {
+            continue;
+        }
+        if (rs->r_rules != NULL) {
+            subs[i].r_rules = malloc(subs[i].num * sizeof(*rs->r_rules));
+        }
+        if (rs->p_rules != NULL) {
+            subs[i].p_rules = malloc(subs[i].num * sizeof(*rs->p_rules));
+        }
+        if ((rs->r_rules != NULL && subs[i].r_rules == NULL) ||
+            (rs->p_rules != NULL && subs[i].p_rules == NULL)) {
+            free_subsets(subs);
+            return NULL;
+        }
+        subs[i].num = 0;
+    }
+
+    route_rules(pc, rs, copy_rule, subs);
+
+    return subs;
+}
+
+/* inserts the subsets, sub-classifiers without rules yet are built */
+static int insrt_subsets(struct proto_cls *pc, const struct rule_set *subs)
+{
+    struct algo_t *algo = &algrthms[pc->algo];
+    int i;
+
+    for (i = 0; i <= PROTO_OTHER; i++) {
+        if (subs[i].num == 0) {
+            continue;
+        }
+        if (pc->sub[i] != NULL) {
+            if (algo->insrt_update(&subs[i], &pc->sub[i]) != 0) {
+                return -1;
+            }
+        } else {
+            if (algo->build(&subs[i], &pc->sub[i]) != 0) {
+                return -1;
+            }
+            pc->sub_num++;
+        }
+    }
+
+    return 0;
+}
+
+int proto_load_rules(struct rule_set *rs, const char *rf)
+{
+    return algrthms[proto_cfg.algo].load_rules(rs, rf);
+}
+
+int proto_build(const struct rule_set *rs, void *userdata)
+{
+    struct proto_cls *pc;
+    struct rule_set *subs;
+    int i, lo, hi, ret;
+
+    if ((rs->r_rules == NULL && rs->p_rules == NULL) || rs->num <= 0) {
+        return -1;
+    }
+    assert(proto_cfg.algo != ALGO_PROTO);
+
+    pc = calloc(1, sizeof(*pc));
+    if (pc == NULL) {
+        return -1;
+    }
+    pc->algo = proto_cfg.algo;
+
+    /* a sub-classifier per protocol value of the rules */
+    for (i = 0; i < PROTO_VAL_NUM; i++) {
+        pc->tbl[i] = PROTO_OTHER;
+    }
+    for (i = 0; i < rs->num; i++) {
+        rule_proto(rs, i, &lo, &hi);
+        if (lo == hi) {
+            pc->tbl[lo] = lo;
+        }
+    }
+
+    if ((subs = make_subsets(pc, rs)) == NULL) {
+        SAFE_FREE(pc);
+        return -1;
+    }
+    ret = insrt_subsets(pc, subs);
+    free_subsets(subs);
+
+    *(struct proto_cls **)userdata = pc;
+    if (ret != 0) {
+        proto_cleanup(userdata);
+        *(struct proto_cls **)userdata = NULL;
+        return -1;
+    }
+    pc->rule_num = rs->num;
+
+    return 0;
+}
+
+int proto_insrt_update(const struct rule_set *rs, void *userdata)
+{
+    struct proto_cls *pc = *(typeof(pc) *)userdata;
+    struct rule_set *subs;
+    int ret;
+
+    if (!pc) return -1;
+
+    /* new protocol values go to the "other" sub-classifier */
+    if ((subs = make_subsets(pc, rs)) == NULL) {
+        return -1;
+    }
+    if ((ret = insrt_subsets(pc, subs)) == 0) {
+        pc->rule_num += rs->num;
+    }
+    free_subsets(subs);
+
+    return ret;
+}
+
+int proto_delete_update(const struct rule_set *rs, void *userdata)
+{
+    struct proto_cls *pc = *(typeof(pc) *)userdata;
+    struct algo_t *algo;
+    struct rule_set *subs;
+    int i, ret = 0;
+
+    if (!pc) return -1;
+    algo = &algrthms[pc->algo];
+
+    if ((subs = make_subsets(pc, rs)) == NULL) {
+        return -1;
+    }
+    for (i = 0; i <= PROTO_OTHER && ret == 0; i++) {
+        if (subs[i].num == 0) {
+            continue;
+        }
+        /* never built, the rules cannot be there */
+        if (pc->sub[i] == NULL ||
+            algo->delete_update(&subs[i], &pc->sub[i]) != 0) {
+            ret = -1;
+        }
+    }
+    if (ret == 0) {
+        pc->rule_num -= rs->num;
+    }
+    free_subsets(subs);
+
+    return ret;
+}
+
+int proto_classify(const struct packet *pkt, const void *userdata)
+{
+    const struct proto_cls *pc = *(const struct proto_cls * const *)userdata;
+    void * const *sub = &pc->sub[pc->tbl[pkt->val[DIM_PROTO].u8]];
+
+    if (*sub == NULL) {
+        return -1;
+    }
+
+    return algrthms[pc->algo].classify(pkt, sub);
+}
+
+/* the sub-classifier of the protocol has every rule matching it */
+int proto_classify_all(const struct packet *pkt, const void *userdata,
+        int *pri, int max)
+{
+    const struct proto_cls *pc = *(const struct proto_cls * const *)userdata;
+    void * const *sub = &pc->sub[pc->tbl[pkt->val[DIM_PROTO].u8]];
+
+    if (algrthms[pc->algo].classify_all == NULL) {
+        return -1;
+    }
+    if (*sub == NULL) {
+        return 0;
+    }
+
+    return algrthms[pc->algo].classify_all(pkt, sub, pri, max);
+}
+
+int proto_search(const struct trace *t, const void *userdata)
+{
+    int i, c;
+
+    for (i = 0; i < t->num; i++) {
+        if ((c = proto_classify(&t->pkts[i], userdata)) != t->pkts[i].match) {
+            fprintf(stderr, "pkt[%d] match:%d, classify:%d\n", i+1, t->pkts[i].match+1, c+1);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void proto_stats(const void *userdata, struct pc_stats *st)
+{
+    const struct proto_cls *pc = *(const struct proto_cls * const *)userdata;
+    struct pc_stats sub_st;
+    double copies = 0, depth = 0;
+    int i, j;
+
+    memset(st, 0, sizeof(*st));
+
+    st->rule_num = pc->rule_num;
+    st->bytes = sizeof(*pc);
+    st->sub_num = pc->sub_num;
+
+    for (i = 0; i <= PROTO_OTHER; i++) {
+        if (pc->sub[i] == NULL) {
+            continue;
+        }
+        algrthms[pc->algo].stats(&pc->sub[i], &sub_st);
+
+        st->bytes += sub_st.bytes;
+        st->node_num += sub_st.node_num;
+        st->leaf_num += sub_st.leaf_num;
+        st->tuple_num += sub_st.tuple_num;
+        st->item_num += sub_st.item_num;
+        st->split_copies += sub_st.split_copies;
+        st->bucket_num += sub_st.bucket_num;
+        st->dag_node_num += sub_st.dag_node_num;
+        st->dag_leaf_num += sub_st.dag_leaf_num;
+        st->stub_num += sub_st.stub_num;
+        st->rebuild_num += sub_st.rebuild_num;
+        st->flat_num += sub_st.flat_num;
+        st->code_bytes += sub_st.code_bytes;
+        for (j = 0; j < DIM_MAX; j++) {
+            st->segment_num[j] += sub_st.segment_num[j];
+        }
+        if (st->flat_top < sub_st.flat_top) {
+            st->flat_top = sub_st.flat_top;
+        }
+        if (st->worst_depth < sub_st.worst_depth) {
+            st->worst_depth = sub_st.worst_depth;
+        }
+        depth += sub_st.average_depth * sub_st.leaf_num;
+        copies += sub_st.replication * sub_st.rule_num;
+    }
+
+    /* per sub-classifier depth tables are not merged */
+    if (st->leaf_num) {
+        st->average_depth = depth / st->leaf_num;
+    }
+    /* rules of protocol ranges count once per sub-classifier */
+    if (pc->rule_num) {
+        st->replication = copies / pc->rule_num;
+    }
+
+    return;
+}
+
+void proto_cleanup(void *userdata)
+{
+    struct proto_cls *pc = *(typeof(pc) *)userdata;
+    int i;
+
+    for (i = 0; i <= PROTO_OTHER; i++) {
+        if (pc->sub[i] != NULL) {
+            algrthms[pc->algo].cleanup(&pc->sub[i]);
+        }
+    }
+    SAFE_FREE(pc);
+    *(struct proto_cls **)userdata = NULL;
+
+    return;
+}
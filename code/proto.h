@@ -0,0 +1,50 @@
+/*
+ *     Filename: proto.h
+ *  Description: Header file for protocol dispatch of packet classification,
+ *               a classifier of any algorithm per protocol
+ *
+ * Organization: Network Security Laboratory (NSLab),
+ *               Research Institute of Information Technology (RIIT),
+ *               Tsinghua University (THU)
+ */
+
+#ifndef __PROTO_H__
+#define __PROTO_H__
+
+#include "pc_eval.h"
+
+#define PROTO_VAL_NUM 256           /* values of the protocol field */
+#define PROTO_OTHER PROTO_VAL_NUM   /* sub-classifier of unlisted values */
+
+/*
+ * Rules of a protocol value go to its own sub-classifier, rules of a
+ * protocol range go to every sub-classifier of a value in the range.
+ * The values without exact rules at build time share the "other"
+ * sub-classifier with the range rules.
+ */
+struct proto_cls {
+    uint16_t tbl[PROTO_VAL_NUM];    /* sub-classifier of each value */
+    void *sub[PROTO_VAL_NUM + 1];   /* NULL until it gets rules */
+    int algo;                       /* ALGO_* of the sub-classifiers */
+    int sub_num;                    /* built ones */
+    int rule_num;
+};
+
+struct proto_cfg {
+    int algo;                       /* ALGO_* of the sub-classifiers */
+};
+
+extern struct proto_cfg proto_cfg;
+
+int proto_load_rules(struct rule_set *rs, const char *rf);
+int proto_build(const struct rule_set *rs, void *userdata);
+int proto_insrt_update(const struct rule_set *rs, void *userdata);
+int proto_delete_update(const struct rule_set *rs, void *userdata);
+int proto_classify(const struct packet *pkt, const void *userdata);
+int proto_classify_all(const struct packet *pkt, const void *userdata,
+        int *pri, int max);
+int proto_search(const struct trace *t, const void *userdata);
+void proto_stats(const void *userdata, struct pc_stats *st);
+void proto_cleanup(void *userdata);
+
+#endif /* __PROTO_H__ */
@@ -11,13 +11,35 @@
  */
 
 #include <stdio.h>
+#include <limits.h>
 #include <assert.h>
 #include "tss.h"
+#include "utils.h"
 #include "uthash.h"
 
 int field_widths[DIM_MAX] = {4, 4, 2, 2, 1};    /* bytes */
 
-static int tpl_is_equal(int *t1, int *t2, int num)
+/* build profiler phases */
+enum {
+    TSS_PROF_CONVERT,
+    TSS_PROF_TUPLE,
+    TSS_PROF_KEY,
+    TSS_PROF_HASH,
+    TSS_PROF_SORT,
+    TSS_PROF_NUM
+};
+
+static const char * const tss_prof_phase[TSS_PROF_NUM] = {
+    "convert", "tuple", "key", "hash", "sort"
+};
+
+struct tss_cfg tss_cfg = {
+    .cvt_flags = 0,
+    .cvt_threads = 1,
+    .enc_more = NULL,
+};
+
+static int tpl_is_equal(const int *t1, const int *t2, int num)
 {
     int i;
     for (i = 0; i < num; i++) {
@@ -29,16 +51,17 @@ static int tpl_is_equal(int *t1, int *t2, int num)
 }
 
 
-static char *create_key(int key_bytes, const union point *dim, int *tuple)
+static char *create_key(int key_bytes, const union point *dim, const int *tuple,
+        const int *widths)
 {
     int j, offset = 0;
     union point p;
     char *key = calloc(key_bytes, sizeof *key);
     for (j = 0; j < DIM_MAX; j++) {
         if (!tuple[j]) continue;
-        p.u32 = dim[j].u32 & ~((1U << (field_widths[j] * 8 - tuple[j])) - 1);
-        memcpy(key + offset, &p, field_widths[j]);
-        offset += field_widths[j];
+        p.u32 = dim[j].u32 & ~((1ULL << (widths[j] * 8 - tuple[j])) - 1);
+        memcpy(key + offset, &p, widths[j]);
+        offset += widths[j];
     }
     assert(offset == key_bytes);
     return key;
@@ -92,105 +115,321 @@ void sort_tss_list(struct tss_head *p_th, struct tss_node *p_l_tn, struct tss_no
     sort_tss_list(p_th, TAILQ_NEXT(p_pivot_tn, entry), p_r_tn);
 }
 
-int tss_build(const struct rule_set *rs, void *userdata)
+/*
+ * Tuples are probed by priority, a lookup stops at a tuple whose rest_pri
+ * its match already beats.
+ */
+static void order_tss_list(struct tss_space *ts)
 {
-    int i, j, tpl_exist = 0, tpl_num = 0, bytes = 0, hash_overhead = 0, nodes = 0;
-    struct tss_head *p_th = NULL;
+    struct tss_node *p_tn;
+    int pri = INT_MAX;
+
+    sort_tss_list(&ts->head, TAILQ_FIRST(&ts->head), TAILQ_LAST(&ts->head, tss_head));
+
+    TAILQ_FOREACH_REVERSE(p_tn, &ts->head, tss_head, entry) {
+        if (p_tn->highest_pri < pri) {
+            pri = p_tn->highest_pri;
+        }
+        p_tn->rest_pri = pri;
+    }
+}
+
+/* keep the key's priorities sorted, the head one is in the hash table */
+static int push_pri(struct hash_entry *p_he, int pri)
+{
+    struct hash_entry *p_new = malloc(sizeof *p_new), **pp;
+    if (!p_new) return -1;
+    p_new->key = NULL;
+    if (pri < p_he->pri) {
+        p_new->pri = p_he->pri;
+        p_he->pri = pri;
+        pp = &p_he->next;
+    } else {
+        p_new->pri = pri;
+        for (pp = &p_he->next; *pp && (*pp)->pri <= pri; pp = &(*pp)->next);
+    }
+    p_new->next = *pp;
+    *pp = p_new;
+    return 0;
+}
+
+/* prefix rules of rs, converted from its range rules if needed */
+static int get_prfx_rules(struct tss_space *ts, const struct rule_set *rs,
+        struct prfx_rule **rules, struct prfx_rule **cvt)
+{
+    uint64_t t = prof_now(ts->prof);
+    int num;
+
+    *cvt = NULL;
+    if (rs->p_rules != NULL && ts->enc == NULL) {
+        *rules = rs->p_rules;
+        return rs->num;
+    }
+    if (rs->r_rules != NULL && (num = rng2prfx_rules(cvt, rs, ts->enc,
+                    tss_cfg.cvt_flags, tss_cfg.cvt_threads)) >= 0) {
+        *rules = *cvt;
+        prof_alloc(ts->prof, num * sizeof(**cvt));
+        prof_phase(ts->prof, 0, TSS_PROF_CONVERT, &t);
+        return num;
+    }
+    /* port bounds off the encoding classes, the space is left as is */
+    fprintf(stderr, "Rules do not fit the tuple space encoding, "
+            "their port ranges must be known at build time\n");
+    return -1;
+}
+
+/* the conversion buffer of get_prfx_rules is released */
+static void put_prfx_rules(struct tss_space *ts, struct prfx_rule **cvt, int num)
+{
+    if (*cvt != NULL) {
+        prof_free(ts->prof, num * sizeof(**cvt));
+    }
+    SAFE_FREE(*cvt);
+}
+
+static int insert_rules(struct tss_space *ts, const struct prfx_rule *rules, int num)
+{
+    int i, j, tpl_exist = 0, tpl_num = 0;
+    struct tss_head *p_th = &ts->head;
     struct tss_node *p_trav_tn = NULL, *p_tmp_tn = NULL;
     struct hash_entry *p_he = NULL;
+    struct pc_prof *prof = ts->prof;
+    uint64_t t = prof_now(prof);
     char *key;
-    if (rs->p_rules == NULL) return -1;
 
-    if (*(void **) userdata == NULL) {
-        p_th = malloc(sizeof *p_th);
-        TAILQ_INIT(p_th);
-    } else {
-        p_th = *(typeof(p_th) *) userdata;
+    if (!TAILQ_EMPTY(p_th)) {
         tpl_num = TAILQ_LAST(p_th, tss_head)->tpl_id;
         tpl_num++;
     }
 
-    for (i = 0; i < rs->num; i++) {
+    for (i = 0; i < num; i++) {
         /* traverse current tss hash_table list */
         tpl_exist = 0;
         TAILQ_FOREACH(p_trav_tn, p_th, entry) {
-            if (!tpl_is_equal(p_trav_tn->tuple, rs->p_rules[i].len, DIM_MAX)) continue;
+            if (!tpl_is_equal(p_trav_tn->tuple, rules[i].len, DIM_MAX)) continue;
             tpl_exist = 1;
+            prof_phase(prof, 0, TSS_PROF_TUPLE, &t);
             /* hash table operation */
-            key = create_key(p_trav_tn->key_bytes, rs->p_rules[i].dim, rs->p_rules[i].len);
+            key = create_key(p_trav_tn->key_bytes, rules[i].dim, rules[i].len, ts->widths);
+            prof_phase(prof, 0, TSS_PROF_KEY, &t);
             HASH_FIND(hh, p_trav_tn->ht, key, p_trav_tn->key_bytes, p_he);
             if (p_he) {
                 SAFE_FREE(key);
-                if (rs->p_rules[i].pri < p_he->pri) {
-                    p_he->pri = rs->p_rules[i].pri;
-                }
+                if (push_pri(p_he, rules[i].pri) != 0) return -1;
             } else {
                 p_he = malloc(sizeof *p_he);
                 p_he->key = key;
-                p_he->pri = rs->p_rules[i].pri;
+                p_he->pri = rules[i].pri;
+                p_he->next = NULL;
                 HASH_ADD_KEYPTR(hh, p_trav_tn->ht, p_he->key, p_trav_tn->key_bytes, p_he);
             }
             /* update highest priority */
-            if (p_trav_tn->highest_pri > rs->p_rules[i].pri) {
-                p_trav_tn->highest_pri = rs->p_rules[i].pri;
+            if (p_trav_tn->highest_pri > rules[i].pri) {
+                p_trav_tn->highest_pri = rules[i].pri;
             }
+            prof_phase(prof, 0, TSS_PROF_HASH, &t);
             break;
         }
         if (tpl_exist) continue;
         /* new tss list node */
         p_tmp_tn = malloc(sizeof *p_tmp_tn);
-        p_tmp_tn->highest_pri = rs->p_rules[i].pri;
+        p_tmp_tn->highest_pri = rules[i].pri;
         p_tmp_tn->ht = NULL;
         p_tmp_tn->tpl_id = tpl_num;
         tpl_num++;
         /* new tuple */
         p_tmp_tn->key_bytes = 0;
         for (j = 0; j < DIM_MAX; j++) {
-            p_tmp_tn->tuple[j] = rs->p_rules[i].len[j];
-            if (rs->p_rules[i].len[j] == 0) continue;
-            p_tmp_tn->key_bytes += field_widths[j];
+            p_tmp_tn->tuple[j] = rules[i].len[j];
+            if (rules[i].len[j] == 0) continue;
+            p_tmp_tn->key_bytes += ts->widths[j];
         }
+        prof_phase(prof, 0, TSS_PROF_TUPLE, &t);
         /* hash table operation */
         p_he = malloc(sizeof *p_he);
-        p_he->key = create_key(p_tmp_tn->key_bytes, rs->p_rules[i].dim, rs->p_rules[i].len);
-        p_he->pri = rs->p_rules[i].pri;
+        p_he->key = create_key(p_tmp_tn->key_bytes, rules[i].dim, rules[i].len, ts->widths);
+        prof_phase(prof, 0, TSS_PROF_KEY, &t);
+        p_he->pri = rules[i].pri;
+        p_he->next = NULL;
         HASH_ADD_KEYPTR(hh, p_tmp_tn->ht, p_he->key, p_tmp_tn->key_bytes, p_he);
         /* insert the new node to tss list tail */
         TAILQ_INSERT_TAIL(p_th, p_tmp_tn, entry);
+        prof_phase(prof, 0, TSS_PROF_HASH, &t);
     }
 
     /* sort tss list by the highest_pri of node */
-    sort_tss_list(p_th, TAILQ_FIRST(p_th), TAILQ_LAST(p_th, tss_head));
+    order_tss_list(ts);
+    prof_phase(prof, 0, TSS_PROF_SORT, &t);
 
-    /* statistical numbers */
-    printf("tuple num = %d\n", tpl_num);
-    *(struct tss_head **) userdata = p_th;
-    TAILQ_FOREACH(p_trav_tn, p_th, entry) {
-        hash_overhead += HASH_OVERHEAD(hh, p_trav_tn->ht);
-        nodes += HASH_COUNT(p_trav_tn->ht);
-        bytes += HASH_COUNT(p_trav_tn->ht) * (4 + p_trav_tn->key_bytes);
-        //printf("tuple_id:%d, hash_overhead:%lu bytes\n", p_trav_tn->tpl_id, HASH_OVERHEAD(hh, p_trav_tn->ht));
+    return 0;
+}
+
+static int remove_rule(struct tss_space *ts, const struct prfx_rule *rule)
+{
+    struct tss_node *p_trav_tn = NULL;
+    struct hash_entry *p_he = NULL, *p_tmp_he = NULL, **pp;
+    char *key;
+
+    TAILQ_FOREACH(p_trav_tn, &ts->head, entry) {
+        if (tpl_is_equal(p_trav_tn->tuple, rule->len, DIM_MAX)) break;
     }
-    printf("hash items:%d\n", nodes);
-    printf("hash_overhead:%d bytes; total memory:%d bytes\n", hash_overhead, bytes + hash_overhead);
+    if (!p_trav_tn) return -1;
+
+    key = create_key(p_trav_tn->key_bytes, rule->dim, rule->len, ts->widths);
+    HASH_FIND(hh, p_trav_tn->ht, key, p_trav_tn->key_bytes, p_he);
+    SAFE_FREE(key);
+    if (!p_he) return -1;
+
+    if (p_he->pri == rule->pri) {
+        if (p_he->next) {
+            /* the next priority moves up */
+            p_tmp_he = p_he->next;
+            p_he->pri = p_tmp_he->pri;
+            p_he->next = p_tmp_he->next;
+            SAFE_FREE(p_tmp_he);
+        } else {
+            HASH_DEL(p_trav_tn->ht, p_he);
+            SAFE_FREE(p_he->key);
+            SAFE_FREE(p_he);
+        }
+    } else {
+        for (pp = &p_he->next; *pp && (*pp)->pri != rule->pri; pp = &(*pp)->next);
+        if (!*pp) return -1;
+        p_tmp_he = *pp;
+        *pp = p_tmp_he->next;
+        SAFE_FREE(p_tmp_he);
+        return 0;
+    }
+
+    if (HASH_COUNT(p_trav_tn->ht) == 0) {
+        TAILQ_REMOVE(&ts->head, p_trav_tn, entry);
+        SAFE_FREE(p_trav_tn);
+    } else if (p_trav_tn->highest_pri == rule->pri) {
+        p_trav_tn->highest_pri = p_trav_tn->ht->pri;
+        HASH_ITER(hh, p_trav_tn->ht, p_he, p_tmp_he) {
+            if (p_he->pri < p_trav_tn->highest_pri) {
+                p_trav_tn->highest_pri = p_he->pri;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int tss_build(const struct rule_set *rs, void *userdata)
+{
+    int j, num;
+    uint64_t t;
+    struct tss_space *ts = NULL;
+    struct prfx_rule *rules, *cvt;
+
+    if (*(void **) userdata != NULL) {
+        return tss_insrt_update(rs, userdata);
+    }
+    if (rs->p_rules == NULL && rs->r_rules == NULL) return -1;
+
+    ts = calloc(1, sizeof *ts);
+    if (!ts) return -1;
+    TAILQ_INIT(&ts->head);
+    ts->prof = prof_create(TSS_PROF_NUM, tss_prof_phase, 1);
+    t = prof_now(ts->prof);
+    if (rs->p_rules == NULL && (tss_cfg.cvt_flags & RNG2PRFX_ENCODE)) {
+        ts->enc = rng_enc_create(rs, tss_cfg.enc_more);
+    }
+    prof_phase(ts->prof, 0, TSS_PROF_CONVERT, &t);
+    for (j = 0; j < DIM_MAX; j++) {
+        ts->widths[j] = ts->enc && ts->enc->cls_bits[j] ? 4 : field_widths[j];
+    }
+
+    /* range rules are split into prefix rules natively */
+    if ((num = get_prfx_rules(ts, rs, &rules, &cvt)) < 0 ||
+        insert_rules(ts, rules, num) != 0) {
+        put_prfx_rules(ts, &cvt, num);
+        *(struct tss_space **) userdata = ts;
+        tss_cleanup(userdata);
+        *(struct tss_space **) userdata = NULL;
+        return -1;
+    }
+    put_prfx_rules(ts, &cvt, num);
+
+    ts->rule_num = rs->num;
+    *(struct tss_space **) userdata = ts;
 
     return 0;
 }
 
+int tss_insrt_update(const struct rule_set *rs, void *userdata)
+{
+    struct tss_space *ts = *(typeof(ts) *) userdata;
+    struct prfx_rule *rules, *cvt;
+    int num, ret;
+
+    if (!ts) return -1;
+    if ((num = get_prfx_rules(ts, rs, &rules, &cvt)) < 0) return -1;
+    if ((ret = insert_rules(ts, rules, num)) == 0) {
+        ts->rule_num += rs->num;
+    }
+    put_prfx_rules(ts, &cvt, num);
+
+    return ret;
+}
+
+int tss_delete_update(const struct rule_set *rs, void *userdata)
+{
+    struct tss_space *ts = *(typeof(ts) *) userdata;
+    struct prfx_rule *rules, *cvt;
+    int i, num, ret = 0;
+
+    if (!ts) return -1;
+    if ((num = get_prfx_rules(ts, rs, &rules, &cvt)) < 0) return -1;
+    for (i = 0; i < num && ret == 0; i++) {
+        ret = remove_rule(ts, &rules[i]);
+    }
+    put_prfx_rules(ts, &cvt, num);
+    if (ret == 0) {
+        ts->rule_num -= rs->num;
+    }
+
+    /* highest priorities may have dropped */
+    order_tss_list(ts);
+
+    return ret;
+}
+
+/* the packet fields as the keys are made of, encoded into enc_val if needed */
+static const union point *key_vals(const struct tss_space *ts,
+        const struct packet *pkt, union point *enc_val)
+{
+    int j;
+
+    if (ts->enc == NULL) {
+        return pkt->val;
+    }
+
+    memcpy(enc_val, pkt->val, DIM_MAX * sizeof(*enc_val));
+    for (j = 0; j < DIM_MAX; j++) {
+        if (ts->enc->cls_bits[j] == 0) continue;
+        enc_val[j].u32 = rng_enc_point(ts->enc, j, pkt->val[j].u16);
+    }
+    return enc_val;
+}
+
 int tss_classify(const struct packet *pkt, const void *userdata)
 {
-    struct tss_head *p_th = *(typeof(p_th) *) userdata;
+    struct tss_space *ts = *(typeof(ts) *) userdata;
     struct tss_node *p_trav_tn = NULL;
     struct hash_entry *p_he = NULL;
+    union point enc_val[DIM_MAX];
+    const union point *val = key_vals(ts, pkt, enc_val);
     char *key;
     int ret = -1;
 
-    TAILQ_FOREACH(p_trav_tn, p_th, entry) {
+    TAILQ_FOREACH(p_trav_tn, &ts->head, entry) {
         //printf("\ntuple id:%d, current highest_pri:%d\n", p_trav_tn->tpl_id, p_trav_tn->highest_pri);
-        if (ret != -1 && ret <= p_trav_tn->highest_pri) {
+        if (ret != -1 && ret <= p_trav_tn->rest_pri) {
             return ret;
         }
-        key = create_key(p_trav_tn->key_bytes, pkt->val, p_trav_tn->tuple);
+        key = create_key(p_trav_tn->key_bytes, val, p_trav_tn->tuple, ts->widths);
         HASH_FIND(hh, p_trav_tn->ht, key, p_trav_tn->key_bytes, p_he);
         SAFE_FREE(key);
         if (!p_he) continue;
@@ -202,6 +441,51 @@ int tss_classify(const struct packet *pkt, const void *userdata)
     return ret;
 }
 
+/* pri is kept sorted, matches past the first max fall off its end */
+static int add_match(int *pri, int n, int max, int p)
+{
+    int i;
+
+    for (i = n < max ? n : max; i > 0 && pri[i - 1] > p; i--) {
+        if (i < max) {
+            pri[i] = pri[i - 1];
+        }
+    }
+    if (i < max) {
+        pri[i] = p;
+    }
+
+    return n + 1;
+}
+
+/*
+ * All the rules a packet matches in priority order, the first max of them
+ * are stored, returns how many matched. Every tuple is probed, there is no
+ * early exit.
+ */
+int tss_classify_all(const struct packet *pkt, const void *userdata,
+        int *pri, int max)
+{
+    struct tss_space *ts = *(typeof(ts) *) userdata;
+    struct tss_node *p_trav_tn = NULL;
+    struct hash_entry *p_he = NULL;
+    union point enc_val[DIM_MAX];
+    const union point *val = key_vals(ts, pkt, enc_val);
+    char *key;
+    int n = 0;
+
+    TAILQ_FOREACH(p_trav_tn, &ts->head, entry) {
+        key = create_key(p_trav_tn->key_bytes, val, p_trav_tn->tuple, ts->widths);
+        HASH_FIND(hh, p_trav_tn->ht, key, p_trav_tn->key_bytes, p_he);
+        SAFE_FREE(key);
+        for (; p_he != NULL; p_he = p_he->next) {
+            n = add_match(pri, n, max, p_he->pri);
+        }
+    }
+
+    return n;
+}
+
 int tss_search(const struct trace *t, const void *userdata)
 {
     int i, c;
@@ -216,11 +500,130 @@ int tss_search(const struct trace *t, const void *userdata)
     return 0;
 }
 
+/*
+ * Probes and hits of each tuple over a trace, as tss_classify makes them.
+ * Tuples are named by their prefix lengths, which do not change with the
+ * probing order.
+ */
+int tss_heat_export(const struct trace *t, const void *userdata, const char *file)
+{
+    struct tss_space *ts = *(typeof(ts) *) userdata;
+    struct tss_node *p_trav_tn;
+    struct hash_entry *p_he;
+    union point enc_val[DIM_MAX];
+    const union point *val;
+    uint64_t *probes, *hits, *wins;
+    int i, j, num = 0, ids = 0, ret, win;
+    char *key;
+    FILE *fp;
+
+    /* ids are positions, with gaps once tuples are removed */
+    TAILQ_FOREACH(p_trav_tn, &ts->head, entry) {
+        num++;
+        if (p_trav_tn->tpl_id >= ids) {
+            ids = p_trav_tn->tpl_id + 1;
+        }
+    }
+    probes = calloc(ids + 1, sizeof(*probes));
+    hits = calloc(ids + 1, sizeof(*hits));
+    wins = calloc(ids + 1, sizeof(*wins));
+    if (!probes || !hits || !wins) {
+        SAFE_FREE(probes);
+        SAFE_FREE(hits);
+        SAFE_FREE(wins);
+        return -1;
+    }
+
+    for (i = 0; i < t->num; i++) {
+        val = key_vals(ts, &t->pkts[i], enc_val);
+        ret = win = -1;
+        TAILQ_FOREACH(p_trav_tn, &ts->head, entry) {
+            if (ret != -1 && ret <= p_trav_tn->rest_pri) break;
+            probes[p_trav_tn->tpl_id]++;
+            key = create_key(p_trav_tn->key_bytes, val, p_trav_tn->tuple, ts->widths);
+            HASH_FIND(hh, p_trav_tn->ht, key, p_trav_tn->key_bytes, p_he);
+            SAFE_FREE(key);
+            if (!p_he) continue;
+            hits[p_trav_tn->tpl_id]++;
+            if (ret == -1 || p_he->pri < ret) {
+                ret = p_he->pri;
+                win = p_trav_tn->tpl_id;
+            }
+        }
+        if (win != -1) {
+            wins[win]++;
+        }
+    }
+
+    ret = -1;
+    if ((fp = fopen(file, "w")) == NULL) {
+        fprintf(stderr, "Cannot open file %s\n", file);
+    } else {
+        fprintf(fp, "tss %d\n", num);
+        TAILQ_FOREACH(p_trav_tn, &ts->head, entry) {
+            for (j = 0; j < DIM_MAX; j++) {
+                fprintf(fp, "%d ", p_trav_tn->tuple[j]);
+            }
+            fprintf(fp, "%lu %lu %lu\n", probes[p_trav_tn->tpl_id],
+                    hits[p_trav_tn->tpl_id], wins[p_trav_tn->tpl_id]);
+        }
+        ret = fclose(fp) == 0 ? 0 : -1;
+    }
+
+    SAFE_FREE(probes);
+    SAFE_FREE(hits);
+    SAFE_FREE(wins);
+    return ret;
+}
+
+void tss_stats(const void *userdata, struct pc_stats *st)
+{
+    const struct tss_space *ts = *(struct tss_space * const *)userdata;
+    struct tss_node *p_trav_tn;
+    struct hash_entry *p_he, *p_tmp_he, *p_dup_he;
+    int j;
+
+    memset(st, 0, sizeof(*st));
+
+    st->rule_num = ts->rule_num;
+    st->bytes = sizeof(*ts);
+
+    TAILQ_FOREACH(p_trav_tn, &ts->head, entry) {
+        st->tuple_num++;
+        st->bytes += sizeof(*p_trav_tn) + HASH_OVERHEAD(hh, p_trav_tn->ht);
+        HASH_ITER(hh, p_trav_tn->ht, p_he, p_tmp_he) {
+            st->bytes += p_trav_tn->key_bytes;
+            for (p_dup_he = p_he; p_dup_he; p_dup_he = p_dup_he->next) {
+                st->item_num++;
+                st->bytes += sizeof(*p_dup_he);
+            }
+        }
+    }
+
+    if (ts->enc != NULL) {
+        st->bytes += sizeof(*ts->enc);
+        for (j = 0; j < DIM_MAX; j++) {
+            if (ts->enc->cls[j] == NULL) continue;
+            /* one class id per port value */
+            st->bytes += (1 << field_widths[j] * 8) * sizeof(*ts->enc->cls[j]);
+        }
+    }
+
+    if (ts->rule_num) {
+        st->replication = (double)st->item_num / ts->rule_num;
+    }
+
+    st->prof = ts->prof;
+
+    return;
+}
+
 void tss_cleanup(void *userdata)
 {
-    struct tss_head *p_th = *(typeof(p_th) *) userdata;
+    struct tss_space *ts = *(typeof(ts) *) userdata;
+    struct tss_head *p_th = &ts->head;
     struct tss_node *p_trav_tn;
-    struct hash_entry *p_he, *p_tmp_he;
+    struct hash_entry *p_he, *p_tmp_he, *p_dup_he;
 
     while (!TAILQ_EMPTY(p_th)) {
         p_trav_tn = TAILQ_FIRST(p_th);
@@ -228,11 +631,17 @@ void tss_cleanup(void *userdata)
         HASH_ITER(hh, p_trav_tn->ht, p_he, p_tmp_he) {
             HASH_DEL(p_trav_tn->ht, p_he);
             SAFE_FREE(p_he->key);
-            SAFE_FREE(p_he);
+            while (p_he) {
+                p_dup_he = p_he->next;
+                SAFE_FREE(p_he);
+                p_he = p_dup_he;
+            }
         }
         SAFE_FREE(p_trav_tn);
     }
-    SAFE_FREE(p_th);
+    rng_enc_free(ts->enc);
+    prof_destroy(ts->prof);
+    SAFE_FREE(ts);
 
     return;
 }
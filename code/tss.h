@@ -20,6 +20,7 @@
 struct hash_entry {
     char *key;
     int pri;
+    struct hash_entry *next;    /* lower priority rules with the same key */
     UT_hash_handle hh;
 };
 
@@ -28,16 +29,43 @@ struct tss_node {
     int tuple[DIM_MAX];
     int key_bytes;
     int highest_pri;
+    int rest_pri;           /* highest priority of it and the tuples after */
     int tpl_id;
     TAILQ_ENTRY(tss_node) entry;
 };
 
 TAILQ_HEAD(tss_head, tss_node);
 
+struct rng_enc;
+
+/* tuple space, the classifier instance */
+struct tss_space {
+    struct tss_head head;
+    struct rng_enc *enc;    /* port range encoding, NULL if not used */
+    int widths[DIM_MAX];    /* key bytes of each field */
+    int rule_num;           /* live rules */
+    struct pc_prof *prof;   /* NULL if not profiled */
+};
+
+/* range rule input, converted to prefix rules at build time */
+struct tss_cfg {
+    int cvt_flags;          /* RNG2PRFX_* */
+    int cvt_threads;
+    const struct rule_set *enc_more;    /* updates the encoding must fit */
+};
+
+extern struct tss_cfg tss_cfg;
+
 void sort_tss_list(struct tss_head *p_th, struct tss_node *p_l_tn, struct tss_node *p_r_tn);
 int tss_build(const struct rule_set *rs, void *userdata);
+int tss_insrt_update(const struct rule_set *rs, void *userdata);
+int tss_delete_update(const struct rule_set *rs, void *userdata);
 int tss_classify(const struct packet *pkt, const void *userdata);
+int tss_classify_all(const struct packet *pkt, const void *userdata,
+        int *pri, int max);
 int tss_search(const struct trace *t, const void *userdata);
+void tss_stats(const void *userdata, struct pc_stats *st);
 void tss_cleanup(void *userdata);
+int tss_heat_export(const struct trace *t, const void *userdata, const char *file);
 
 #endif /* __TSS_H__ */
@@ -9,13 +9,23 @@
  *               Tsinghua University (THU)
  *
  *      History: 1. move point operation code here (Xiaohe Hu)
+ *
+ *               2. Add native range rule to prefix rule conversion
+ *
+ *               3. Add shadowed rule removal
  */
 
 #include <stdio.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <pthread.h>
 #include <sys/queue.h>
 #include "utils.h"
+#include "uthash.h"
+
+static const unsigned int dim_bits[DIM_MAX] = {32, 32, 16, 16, 8};
 
 int is_equal(union point *left, union point *right)
 {
@@ -360,3 +370,700 @@ done:
 
     return;
 }
+
+/*
+ * The same greedy split as range2prefix, the largest aligned block at the
+ * range begin each round, but written into a caller array of at least
+ * PRFX_PER_RNG_MAX entries. Returns the number of prefixes.
+ */
+int range2prefix_arr(struct prefix *out, const struct range *range,
+        unsigned int bits)
+{
+    uint64_t begin = range->begin.u64, end = range->end.u64;
+    unsigned int k;
+    int n = 0;
+
+    while (begin <= end) {
+        for (k = 0; k < bits; k++) {
+            if ((begin & ((2ULL << k) - 1)) != 0 ||
+                begin + (2ULL << k) - 1 > end) {
+                break;
+            }
+        }
+
+        out[n].value.u128.high = 0;
+        out[n].value.u128.low = begin;
+        out[n].prefix_len = bits - k;
+        n++;
+
+        begin += 1ULL << k;
+    }
+
+    return n;
+}
+
+/* class boundaries: begin and end + 1 of each non-exact range */
+static void mark_enc_bnd(uint8_t *bnd, const struct rule_set *rs, int d,
+        uint32_t max)
+{
+    uint32_t begin, end;
+    int i;
+
+    for (i = 0; i < rs->num; i++) {
+        begin = rs->r_rules[i].dim[d][0].u32;
+        end = rs->r_rules[i].dim[d][1].u32;
+        if (begin == end || (begin == 0 && end == max)) {
+            continue;
+        }
+        bnd[begin] = 1;
+        if (end < max) {
+            bnd[end + 1] = 1;
+        }
+    }
+}
+
+/* more, if not NULL, holds rules to be inserted later, the classes fit them */
+struct rng_enc *rng_enc_create(const struct rule_set *rs,
+        const struct rule_set *more)
+{
+    int d, num;
+    uint32_t v, max;
+    struct rng_enc *enc;
+    uint8_t *bnd;
+
+    enc = calloc(1, sizeof(*enc));
+    bnd = malloc(1 << 16);
+    if (enc == NULL || bnd == NULL) {
+        SAFE_FREE(enc);
+        SAFE_FREE(bnd);
+        return NULL;
+    }
+
+    for (d = DIM_SPORT; d <= DIM_DPORT; d++) {
+        max = (1U << dim_bits[d]) - 1;
+
+        bzero(bnd, max + 1);
+        bnd[0] = 1;
+        mark_enc_bnd(bnd, rs, d, max);
+        if (more != NULL && more->r_rules != NULL) {
+            mark_enc_bnd(bnd, more, d, max);
+        }
+
+        for (num = 0, v = 0; v <= max; v++) {
+            num += bnd[v];
+        }
+
+        /* a single class is the plain field */
+        if (num < 2) {
+            continue;
+        }
+
+        enc->cls[d] = malloc((max + 1) * sizeof(*enc->cls[d]));
+        if (enc->cls[d] == NULL) {
+            SAFE_FREE(bnd);
+            rng_enc_free(enc);
+            return NULL;
+        }
+
+        for (num = -1, v = 0; v <= max; v++) {
+            num += bnd[v];
+            enc->cls[d][v] = num;
+        }
+
+        enc->cls_num[d] = num + 1;
+        for (enc->cls_bits[d] = 1; (1 << enc->cls_bits[d]) < num + 1;
+            enc->cls_bits[d]++);
+    }
+
+    SAFE_FREE(bnd);
+
+    return enc;
+}
+
+void rng_enc_free(struct rng_enc *enc)
+{
+    int d;
+
+    if (enc == NULL) {
+        return;
+    }
+
+    for (d = 0; d < DIM_MAX; d++) {
+        SAFE_FREE(enc->cls[d]);
+    }
+    free(enc);
+
+    return;
+}
+
+uint32_t rng_enc_point(const struct rng_enc *enc, int dim, uint32_t val)
+{
+    unsigned int w = dim_bits[dim];
+
+    return (((uint32_t)enc->cls[dim][val] << w) | val) <<
+        (32 - w - enc->cls_bits[dim]);
+}
+
+/*
+ * split the range on one dimension, returns the number of prefixes or -1
+ * if the range does not fall on the class boundaries of enc
+ */
+static int split_range_dim(struct prefix *out, const struct rng_rule *r,
+        int d, const struct rng_enc *enc)
+{
+    int i, n, shift;
+    unsigned int w = dim_bits[d], cb;
+    uint32_t begin = r->dim[d][0].u32, end = r->dim[d][1].u32;
+    uint32_t max = (1ULL << w) - 1;
+    struct range rng;
+
+    if (enc == NULL || enc->cls_bits[d] == 0) {
+        rng.begin = r->dim[d][0];
+        rng.end = r->dim[d][1];
+        return range2prefix_arr(out, &rng, w);
+    }
+
+    cb = enc->cls_bits[d];
+    shift = 32 - w - cb;
+
+    bzero(out, sizeof(*out));
+
+    if (begin == 0 && end == max) {
+        return 1;
+    }
+
+    if (begin == end) {
+        out->value.u32 = rng_enc_point(enc, d, begin);
+        out->prefix_len = cb + w;
+        return 1;
+    }
+
+    if ((begin != 0 && enc->cls[d][begin - 1] == enc->cls[d][begin]) ||
+        (end != max && enc->cls[d][end + 1] == enc->cls[d][end])) {
+        return -1;
+    }
+
+    bzero(&rng, sizeof(rng));
+    rng.begin.u32 = enc->cls[d][begin];
+    rng.end.u32 = enc->cls[d][end];
+
+    /* unused class ids behind the last class are free to cover */
+    if (rng.end.u32 == enc->cls_num[d] - 1) {
+        rng.end.u32 = (1U << cb) - 1;
+    }
+
+    n = range2prefix_arr(out, &rng, cb);
+    for (i = 0; i < n; i++) {
+        out[i].value.u128.low = (out[i].value.u128.low << w) << shift;
+    }
+
+    return n;
+}
+
+/* expand one range rule, out == NULL only counts the prefix rules */
+static int split_range_rule_arr(struct prfx_rule *out,
+        const struct rng_rule *r, const struct rng_enc *enc)
+{
+    int d, i, n, cur[DIM_MAX], num[DIM_MAX];
+    struct prefix prfx[DIM_MAX][PRFX_PER_RNG_MAX];
+
+    for (n = 1, d = 0; d < DIM_MAX; d++) {
+        if ((num[d] = split_range_dim(prfx[d], r, d, enc)) < 0) {
+            return -1;
+        }
+        n *= num[d];
+        cur[d] = 0;
+    }
+
+    if (out == NULL) {
+        return n;
+    }
+
+    /* cross product, the last dimension runs fastest */
+    for (i = 0; i < n; i++) {
+        bzero(&out[i], sizeof(out[i]));
+        for (d = 0; d < DIM_MAX; d++) {
+            out[i].dim[d] = prfx[d][cur[d]].value;
+            out[i].len[d] = prfx[d][cur[d]].prefix_len;
+        }
+        out[i].pri = r->pri;
+
+        for (d = DIM_MAX - 1; d >= 0 && ++cur[d] == num[d]; d--) {
+            cur[d] = 0;
+        }
+    }
+
+    return n;
+}
+
+struct rng2prfx_job {
+    const struct rule_set *rs;
+    const struct rng_enc *enc;
+    struct prfx_rule *out;
+    int *off;
+    int begin, end;
+    int err;
+};
+
+/* pass 1 (out == NULL): count into off[], pass 2: fill at off[] */
+static void *rng2prfx_worker(void *arg)
+{
+    struct rng2prfx_job *job = arg;
+    int i, n;
+
+    for (i = job->begin; i < job->end; i++) {
+        n = split_range_rule_arr(job->out ? job->out + job->off[i] : NULL,
+                &job->rs->r_rules[i], job->enc);
+        if (n < 0) {
+            job->err = -1;
+            break;
+        }
+        if (job->out == NULL) {
+            job->off[i] = n;
+        }
+    }
+
+    return NULL;
+}
+
+static int rng2prfx_run(struct rng2prfx_job *jobs, int threads)
+{
+    int i, err = 0;
+    pthread_t tid[threads];
+
+    for (i = 1; i < threads; i++) {
+        if (pthread_create(&tid[i], NULL, rng2prfx_worker, &jobs[i]) != 0) {
+            /* run it inline instead */
+            tid[i] = 0;
+            rng2prfx_worker(&jobs[i]);
+        }
+    }
+
+    rng2prfx_worker(&jobs[0]);
+
+    for (i = 1; i < threads; i++) {
+        if (tid[i] != 0) {
+            pthread_join(tid[i], NULL);
+        }
+    }
+
+    for (i = 0; i < threads; i++) {
+        err |= jobs[i].err;
+    }
+
+    return err;
+}
+
+struct prfx_dedup {
+    struct prfx_rule *r;
+    UT_hash_handle hh;
+};
+
+/* keep the first copy of each prefix rule with the highest priority */
+static int dedup_prfx_rules(struct prfx_rule *rules, int num)
+{
+    int i, n;
+    struct prfx_dedup *ht = NULL, *e, *tmp;
+    struct prfx_dedup *pool = malloc(num * sizeof(*pool));
+    const size_t klen = offsetof(struct prfx_rule, pri);
+
+    if (pool == NULL) {
+        return num;
+    }
+
+    for (i = 0, n = 0; i < num; i++) {
+        HASH_FIND(hh, ht, &rules[i], klen, e);
+        if (e != NULL) {
+            if (rules[i].pri < e->r->pri) {
+                e->r->pri = rules[i].pri;
+            }
+            continue;
+        }
+
+        /* compact in place, entries behind n are not hashed yet */
+        rules[n] = rules[i];
+        pool[n].r = &rules[n];
+        HASH_ADD_KEYPTR(hh, ht, pool[n].r, klen, &pool[n]);
+        n++;
+    }
+
+    HASH_ITER(hh, ht, e, tmp) {
+        HASH_DEL(ht, e);
+    }
+    SAFE_FREE(pool);
+
+    return n;
+}
+
+/*
+ * Convert the range rules of rs into prefix rules, all of them in one
+ * allocation. With threads > 1 the rules are cut into chunks converted in
+ * parallel: a counting pass sizes the array, a filling pass writes each
+ * rule at its offset, so the output order matches the input order.
+ *
+ * Returns the number of prefix rules, or -1 if a rule can not be expressed
+ * under enc or out of memory.
+ */
+int rng2prfx_rules(struct prfx_rule **out, const struct rule_set *rs,
+        const struct rng_enc *enc, int flags, int threads)
+{
+    int i, n, chunk, total;
+    int *off;
+    struct rng2prfx_job *jobs;
+
+    *out = NULL;
+
+    if (rs->r_rules == NULL || rs->num <= 0) {
+        return -1;
+    }
+
+    if (threads < 1 || rs->num < 1024) {
+        threads = 1;
+    }
+
+    off = malloc(rs->num * sizeof(*off));
+    jobs = calloc(threads, sizeof(*jobs));
+    if (off == NULL || jobs == NULL) {
+        SAFE_FREE(off);
+        SAFE_FREE(jobs);
+        return -1;
+    }
+
+    chunk = (rs->num + threads - 1) / threads;
+    for (i = 0; i < threads; i++) {
+        jobs[i].rs = rs;
+        jobs[i].enc = enc;
+        jobs[i].off = off;
+        jobs[i].begin = i * chunk < rs->num ? i * chunk : rs->num;
+        jobs[i].end = (i + 1) * chunk < rs->num ? (i + 1) * chunk : rs->num;
+    }
+
+    if (rng2prfx_run(jobs, threads) != 0) {
+        goto err;
+    }
+
+    for (total = 0, i = 0; i < rs->num; i++) {
+        n = off[i];
+        off[i] = total;
+        total += n;
+    }
+
+    *out = malloc(total * sizeof(**out));
+    if (*out == NULL) {
+        goto err;
+    }
+
+    for (i = 0; i < threads; i++) {
+        jobs[i].out = *out;
+    }
+
+    if (rng2prfx_run(jobs, threads) != 0) {
+        SAFE_FREE(*out);
+        goto err;
+    }
+
+    SAFE_FREE(off);
+    SAFE_FREE(jobs);
+
+    if (flags & RNG2PRFX_DEDUP) {
+        total = dedup_prfx_rules(*out, total);
+    }
+
+    return total;
+
+err:
+    SAFE_FREE(off);
+    SAFE_FREE(jobs);
+    return -1;
+}
+
+/* rules whose ip prefixes enclosing the ranges have the same lengths */
+struct shadow_key {
+    uint32_t sip;
+    uint32_t dip;
+    uint8_t sip_len;
+    uint8_t dip_len;
+};
+
+struct shadow_entry {
+    struct shadow_key key;
+    int *idx;
+    int num;
+    int cap;
+    UT_hash_handle hh;
+};
+
+struct shadow_order {
+    int pri;
+    int idx;
+};
+
+static int shadow_order_cmp(const void *a, const void *b)
+{
+    const struct shadow_order *x = a, *y = b;
+
+    return x->pri != y->pri ? (x->pri < y->pri ? -1 : 1) : x->idx - y->idx;
+}
+
+/* length of the shortest prefix holding the range of an ip dimension */
+static int enclosing_len(const union point *rng)
+{
+    uint32_t diff = rng[0].u32 ^ rng[1].u32;
+
+    return diff ? __builtin_clz(diff) : 32;
+}
+
+static uint32_t prefix_of(uint32_t val, int len)
+{
+    return len ? val & (uint32_t)~((1ULL << (32 - len)) - 1) : 0;
+}
+
+static int rule_covers(const struct rng_rule *a, const struct rng_rule *b)
+{
+    int d;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (a->dim[d][0].u32 > b->dim[d][0].u32 ||
+            a->dim[d][1].u32 < b->dim[d][1].u32) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int rule_overlaps(const struct rng_rule *a, const struct rng_rule *b)
+{
+    int d;
+
+    for (d = 0; d < DIM_MAX; d++) {
+        if (a->dim[d][0].u32 > b->dim[d][1].u32 ||
+            a->dim[d][1].u32 < b->dim[d][0].u32) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Whether the rules cover a box together: the box minus the first rule
+ * overlapping it falls into at most 2 * DIM_MAX boxes, each left to the rules
+ * after it. Gives up as not covered once the budget is spent.
+ */
+static int box_covered(const struct rng_rule *box,
+        const struct rng_rule * const *cand, int num, int *budget)
+{
+    struct rng_rule piece = *box, sub;
+    const struct rng_rule *c;
+    int i, d;
+
+    for (i = 0; i < num && !rule_overlaps(cand[i], box); i++);
+    if (i == num || --*budget < 0) {
+        return 0;
+    }
+
+    c = cand[i];
+    for (d = 0; d < DIM_MAX; d++) {
+        if (piece.dim[d][0].u32 < c->dim[d][0].u32) {
+            sub = piece;
+            sub.dim[d][1].u32 = c->dim[d][0].u32 - 1;
+            if (!box_covered(&sub, cand + i + 1, num - i - 1, budget)) {
+                return 0;
+            }
+            piece.dim[d][0].u32 = c->dim[d][0].u32;
+        }
+        if (piece.dim[d][1].u32 > c->dim[d][1].u32) {
+            sub = piece;
+            sub.dim[d][0].u32 = c->dim[d][1].u32 + 1;
+            if (!box_covered(&sub, cand + i + 1, num - i - 1, budget)) {
+                return 0;
+            }
+            piece.dim[d][1].u32 = c->dim[d][1].u32;
+        }
+    }
+
+    return 1;   /* what is left lies inside c */
+}
+
+static int shadow_add(struct shadow_entry **ht, const struct shadow_key *key,
+        int idx)
+{
+    struct shadow_entry *e;
+    int *tmp;
+
+    HASH_FIND(hh, *ht, key, sizeof(*key), e);
+    if (e == NULL) {
+        e = calloc(1, sizeof(*e));
+        if (e == NULL) {
+            return -1;
+        }
+        e->key = *key;
+        HASH_ADD(hh, *ht, key, sizeof(e->key), e);
+    }
+
+    if (e->num == e->cap) {
+        e->cap = e->cap ? e->cap << 1 : 4;
+        tmp = realloc(e->idx, e->cap * sizeof(*tmp));
+        if (tmp == NULL) {
+            return -1;
+        }
+        e->idx = tmp;
+    }
+    e->idx[e->num++] = idx;
+
+    return 0;
+}
+
+/*
+ * Drop the rules no packet can match because rules of higher priority cover
+ * them. Rules are visited by priority, the kept ones are indexed by the ip
+ * prefixes enclosing their ranges. A rule covering another one holds its ip
+ * ranges, so it sits under the prefixes of the other rule cut to some
+ * shorter lengths: one lookup per length pair in use finds every rule
+ * covering it alone. With SHADOW_EXACT the rules left are also checked
+ * against the union of the higher rules overlapping them, a quadratic scan.
+ *
+ * Works on the range rules, or the prefix rules if there are none; the
+ * rules kept stay in order. Returns the number of rules dropped, or -1.
+ */
+int rm_shadow_rules(struct rule_set *rs, int flags)
+{
+    struct rng_rule *rules = rs->r_rules, *r;
+    const struct rng_rule **kept_rules = NULL, **cand = NULL;
+    struct shadow_order *order;
+    struct shadow_entry *ht = NULL, *e, *tmp;
+    struct shadow_key key;
+    uint64_t pair[33] = {0};
+    uint8_t *drop;
+    struct prefix p;
+    struct range rng;
+    int i, j, k, d, ls, ld, n, kept = 0, budget, ret = 0;
+
+    if (rs->num <= 0 || (rs->r_rules == NULL && rs->p_rules == NULL)) {
+        return 0;
+    }
+
+    order = malloc(rs->num * sizeof(*order));
+    drop = calloc(rs->num, sizeof(*drop));
+    if (rules == NULL) {
+        rules = malloc(rs->num * sizeof(*rules));
+    }
+    if (flags & SHADOW_EXACT) {
+        kept_rules = malloc(rs->num * sizeof(*kept_rules));
+        cand = malloc(rs->num * sizeof(*cand));
+    }
+    if (order == NULL || drop == NULL || rules == NULL ||
+        ((flags & SHADOW_EXACT) && (kept_rules == NULL || cand == NULL))) {
+        ret = -1;
+        goto out;
+    }
+
+    /* prefix rules are checked as the ranges they stand for */
+    for (i = 0; rules != rs->r_rules && i < rs->num; i++) {
+        for (d = 0; d < DIM_MAX; d++) {
+            p.value = rs->p_rules[i].dim[d];
+            p.prefix_len = rs->p_rules[i].len[d];
+            prefix2range(&rng, &p, dim_bits[d]);
+            rules[i].dim[d][0] = rng.begin;
+            rules[i].dim[d][1] = rng.end;
+        }
+        rules[i].pri = rs->p_rules[i].pri;
+    }
+
+    for (i = 0; i < rs->num; i++) {
+        order[i].pri = rules[i].pri;
+        order[i].idx = i;
+    }
+    qsort(order, rs->num, sizeof(*order), shadow_order_cmp);
+
+    for (i = 0; i < rs->num; i++) {
+        r = &rules[order[i].idx];
+        ls = enclosing_len(r->dim[DIM_SIP]);
+        ld = enclosing_len(r->dim[DIM_DIP]);
+
+        /* a single rule covering r */
+        for (j = 0; j <= ls && !drop[order[i].idx]; j++) {
+            for (k = 0; k <= ld; k++) {
+                if (!(pair[j] & (1ULL << k))) {
+                    continue;
+                }
+                bzero(&key, sizeof(key));
+                key.sip = prefix_of(r->dim[DIM_SIP][0].u32, j);
+                key.dip = prefix_of(r->dim[DIM_DIP][0].u32, k);
+                key.sip_len = j;
+                key.dip_len = k;
+                HASH_FIND(hh, ht, &key, sizeof(key), e);
+                for (n = 0; e != NULL && n < e->num; n++) {
+                    if (rule_covers(&rules[e->idx[n]], r)) {
+                        drop[order[i].idx] = 1;
+                        break;
+                    }
+                }
+                if (drop[order[i].idx]) {
+                    break;
+                }
+            }
+        }
+
+        /* several rules covering r together */
+        if (!drop[order[i].idx] && (flags & SHADOW_EXACT)) {
+            for (j = n = 0; j < kept; j++) {
+                if (rule_overlaps(kept_rules[j], r)) {
+                    cand[n++] = kept_rules[j];
+                }
+            }
+            budget = 1 << 12;
+            drop[order[i].idx] = box_covered(r, cand, n, &budget);
+        }
+        if (drop[order[i].idx]) {
+            ret++;
+            continue;
+        }
+
+        bzero(&key, sizeof(key));
+        key.sip = prefix_of(r->dim[DIM_SIP][0].u32, ls);
+        key.dip = prefix_of(r->dim[DIM_DIP][0].u32, ld);
+        key.sip_len = ls;
+        key.dip_len = ld;
+        if (shadow_add(&ht, &key, order[i].idx) != 0) {
+            ret = -1;
+            goto out;
+        }
+        pair[ls] |= 1ULL << ld;
+        if (kept_rules != NULL) {
+            kept_rules[kept] = r;
+        }
+        kept++;
+    }
+
+    for (i = n = 0; i < rs->num; i++) {
+        if (drop[i]) {
+            continue;
+        }
+        if (rs->r_rules != NULL) {
+            rs->r_rules[n] = rs->r_rules[i];
+        }
+        if (rs->p_rules != NULL) {
+            rs->p_rules[n] = rs->p_rules[i];
+        }
+        n++;
+    }
+    rs->num = n;
+
+out:
+    HASH_ITER(hh, ht, e, tmp) {
+        HASH_DEL(ht, e);
+        SAFE_FREE(e->idx);
+        free(e);
+    }
+    if (rules != rs->r_rules) {
+        SAFE_FREE(rules);
+    }
+    SAFE_FREE(kept_rules);
+    SAFE_FREE(cand);
+    SAFE_FREE(drop);
+    SAFE_FREE(order);
+
+    return ret;
+}
@@ -56,6 +56,28 @@ struct queue_node {
 
 STAILQ_HEAD(queue_head, queue_node);
 
+/* a W-bit range splits into 2W - 2 prefixes at most, W <= 32 */
+#define PRFX_PER_RNG_MAX 64
+
+/* rng2prfx_rules flags */
+enum {
+    RNG2PRFX_DEDUP = 1 << 0,    /* drop duplicated prefix rules */
+    RNG2PRFX_ENCODE = 1 << 1,   /* range encode the port dimensions */
+};
+
+/*
+ * Range encoding: the elementary intervals cut by the non-exact port ranges
+ * of a rule set are numbered, and the class id is prepended to the field
+ * value. A range becomes a run of classes, which splits into a handful of
+ * prefixes instead of up to 2W - 2. Encoded fields are 32 bits wide, the
+ * code (class | value) sits in the most significant bits.
+ */
+struct rng_enc {
+    int cls_bits[DIM_MAX];      /* 0 if the dimension is not encoded */
+    int cls_num[DIM_MAX];
+    uint16_t *cls[DIM_MAX];     /* field value -> class id */
+};
+
 int is_equal(union point *left, union point *right);
 int is_less(union point *left, union point *right);
 int is_less_equal(union point *left, union point *right);
@@ -84,4 +106,22 @@ void prefix2range(struct range *range, struct prefix *prefix,
 
 void split_range_rule(struct rng_rule_head *head, struct rng_rule *rule);
 
+int range2prefix_arr(struct prefix *out, const struct range *range,
+        unsigned int bits);
+
+struct rng_enc *rng_enc_create(const struct rule_set *rs,
+        const struct rule_set *more);
+void rng_enc_free(struct rng_enc *enc);
+uint32_t rng_enc_point(const struct rng_enc *enc, int dim, uint32_t val);
+
+int rng2prfx_rules(struct prfx_rule **out, const struct rule_set *rs,
+        const struct rng_enc *enc, int flags, int threads);
+
+/* rm_shadow_rules flags */
+enum {
+    SHADOW_EXACT = 1 << 0,      /* also drop rules covered by several rules */
+};
+
+int rm_shadow_rules(struct rule_set *rs, int flags);
+
 #endif /* __UTILS_H__ */
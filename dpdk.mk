@@ -42,9 +42,10 @@ include $(RTE_SDK)/mk/rte.vars.mk
 APP = fwd
 
 # all source are stored in SRCS-y
-SRCS-y := code/dpdk_sim.c code/pc_eval.c code/tss.c code/hs.c code/utils.c
+SRCS-y := code/dpdk_sim.c code/pc_eval.c code/tss.c code/hs.c code/utils.c code/proto.c code/hs_gen.c
 
 CFLAGS += -O3 -mbmi2
+LDLIBS += -ldl
 #CFLAGS += -mbmi2 -g
 #CFLAGS += $(WERROR_FLAGS)
 
@@ -19,7 +19,8 @@ OBJ = $(patsubst $(CODE_DIR)/%.c, $(BUILD_DIR)/%.o, $(SRC))
 BIN = $(BUILD_DIR)/pc_algo
 
 CC = gcc
-CFLAGS = -Wall -g -O3
+CFLAGS = -Wall -g -O3 -pthread
+LDLIBS = -pthread -lm -ldl
 
 ifneq "$(MAKECMDGOALS)" "clean"
     -include $(DEP)
@@ -35,7 +36,7 @@ $(BUILD_DIR)/%.d: $(CODE_DIR)/%.c
 	rm -f $@.$$$$
 
 $(BIN): $(OBJ)
-	$(CC) -o $@ $^
+	$(CC) -o $@ $^ $(LDLIBS)
 
 all: $(BIN)
 
@@ -16,16 +16,16 @@ def main():
         for i in fi.readlines():
             rules.append(i[:-1])
 
-    if len(rules[0].split(' ')) is 9:
+    if len(rules[0].split(' ')) == 9:
         r_id = 0
-        for i in xrange(0, len(rules)):
+        for i in range(0, len(rules)):
             r_id += 1
             rules[i] = rules[i] + ' ' + str(r_id)
         with open('%s' % sys.argv[1], 'w') as fo:
             for r in rules:
                 fo.write('%s\n' % r)
 
-    for i in xrange(0, len(rules) - 1):
+    for i in range(0, len(rules) - 1):
         if randint(1, ALL) <= UPDATE:
             rules_updt.append(rules[i])
         else: